@@ -31,6 +31,10 @@
 
 ftp_status ftp_i_store_auth(ftp_connection *c, char *user, char *pass)
 {
+	if (user == c->_mc_user && pass == c->_mc_pass)
+		/* Logging in again with the stored credentials (reconnect). */
+		return FTP_OK;
+
 	ftp_i_free(c->_mc_user);
 	ftp_i_free(c->_mc_pass);
 
@@ -45,59 +49,102 @@ ftp_status ftp_i_store_auth(ftp_connection *c, char *user, char *pass)
 	return FTP_OK;
 }
 
-ftp_status ftp_auth(ftp_connection *c, char *user, char *pass, ftp_bool allow_multiple_connections)
+/*
+ * Sends FEAT once per server and stores the result in the shared features.
+ * Failing FEAT is not an error; libmftp then learns capabilities on the fly.
+ */
+static ftp_status ftp_i_negotiate_features(ftp_connection *c)
 {
-	if (user == NULL && pass == NULL && !allow_multiple_connections) {
-		ftp_i_connection_set_error(c, FTP_EARGUMENTS);
-		return FTP_ERROR;
-	}
+	struct ftp_features *f = c->_current_features;
+	if (f->feat_requested)
+		return FTP_OK;
+	f->feat_requested = ftp_btrue;
 
-	if (!ftp_i_connection_is_ready(c)) {
-		ftp_i_connection_set_error(c, FTP_ENOTREADY);
-		return FTP_ERROR;
+	ftp_i_set_input_trigger(c, FTP_SIGNAL_SYSTEM_STATUS);
+	c->_last_answer_lock_signal = FTP_SIGNAL_SYSTEM_STATUS;
+
+	ftp_bool remote_error;
+	if (ftp_i_send_command_and_wait_for_triggers(c, FTP_CFEAT, NULL, NULL, 0, &remote_error) != FTP_OK) {
+		ftp_i_managed_buffer_free(c->_last_answer_buffer);
+		if (!remote_error)
+			return FTP_ERROR;
+		FTP_LOG("Server does not support FEAT.\n");
+		return FTP_OK;
 	}
 
-	if (allow_multiple_connections) {
-		if (user != NULL && pass != NULL)
-			ftp_i_store_auth(c, user, pass);
-		c->_mc_enabled = ftp_btrue;
+	if (!c->_last_answer_buffer)
+		return FTP_OK;
+	ftp_i_read_feat_answer(ftp_i_managed_buffer_cbuf(c->_last_answer_buffer), f);
+	ftp_i_managed_buffer_free(c->_last_answer_buffer);
+
+	/* PASV does not work with IPv6, so EPSV is always tried there. */
+	f->use_epsv = f->has_epsv || c->_adr_fam == AF_INET6;
+	f->use_mlsd = f->has_mlst;
+	return FTP_OK;
+}
+
+static ftp_status ftp_i_login(ftp_connection *c, char *user, char *pass)
+{
+	ftp_i_set_input_trigger(c, FTP_SIGNAL_LOGGED_IN);
+	ftp_i_set_input_trigger(c, FTP_SIGNAL_PASSWORD_REQUIRED);
+
+	ftp_bool remote_error;
+	if (ftp_i_send_command_and_wait_for_triggers(c, FTP_CUSER, user, NULL, 0, &remote_error) != FTP_OK) {
+		ftp_i_connection_set_error(c,
+			(remote_error && c->last_signal == FTP_SIGNAL_NOT_LOGGED_IN) ? FTP_EWRONGAUTH : FTP_EUNEXPECTED);
+		return FTP_ERROR;
 	}
 
-	if (user != NULL && pass != NULL) {
+	if (c->last_signal == FTP_SIGNAL_LOGGED_IN) {
+		/* No password required */
+		return FTP_OK;
+	} else if (c->last_signal == FTP_SIGNAL_PASSWORD_REQUIRED) {
+		/* Password required */
 		ftp_i_set_input_trigger(c, FTP_SIGNAL_LOGGED_IN);
-		ftp_i_set_input_trigger(c, FTP_SIGNAL_PASSWORD_REQUIRED);
 
-		ftp_bool remote_error;
-		if (ftp_i_send_command_and_wait_for_triggers(c, FTP_CUSER, user, NULL, 0, &remote_error) != FTP_OK) {
+		if (ftp_i_send_command_and_wait_for_triggers(c, FTP_CPASS, pass, NULL, 0, &remote_error) != FTP_OK) {
 			ftp_i_connection_set_error(c,
 				(remote_error && c->last_signal == FTP_SIGNAL_NOT_LOGGED_IN) ? FTP_EWRONGAUTH : FTP_EUNEXPECTED);
 			return FTP_ERROR;
 		}
 
 		if (c->last_signal == FTP_SIGNAL_LOGGED_IN) {
-			/* No password required */
 			return FTP_OK;
-		} else if (c->last_signal == FTP_SIGNAL_PASSWORD_REQUIRED) {
-			/* Password required */
-			ftp_i_set_input_trigger(c, FTP_SIGNAL_LOGGED_IN);
-
-			if (ftp_i_send_command_and_wait_for_triggers(c, FTP_CPASS, pass, NULL, 0, &remote_error) != FTP_OK) {
-				ftp_i_connection_set_error(c,
-					(remote_error && c->last_signal == FTP_SIGNAL_NOT_LOGGED_IN) ? FTP_EWRONGAUTH : FTP_EUNEXPECTED);
-				return FTP_ERROR;
-			}
-
-			if (c->last_signal == FTP_SIGNAL_LOGGED_IN) {
-				return FTP_OK;
-			} else {
-				ftp_i_connection_set_error(c, FTP_EUNEXPECTED);
-				return FTP_ERROR;
-			}
 		} else {
 			ftp_i_connection_set_error(c, FTP_EUNEXPECTED);
 			return FTP_ERROR;
 		}
+	} else {
+		ftp_i_connection_set_error(c, FTP_EUNEXPECTED);
+		return FTP_ERROR;
+	}
+}
+
+ftp_status ftp_auth(ftp_connection *c, char *user, char *pass, ftp_bool allow_multiple_connections)
+{
+	if (user == NULL && pass == NULL && !allow_multiple_connections) {
+		ftp_i_connection_set_error(c, FTP_EARGUMENTS);
+		return FTP_ERROR;
+	}
+
+	if (!ftp_i_connection_is_ready(c)) {
+		ftp_i_connection_set_error(c, FTP_ENOTREADY);
+		return FTP_ERROR;
+	}
+
+	if (allow_multiple_connections || c->reconnect_attempts > 0) {
+		/* Credentials are needed to open queued connections and to reconnect. */
+		if (user != NULL && pass != NULL)
+			ftp_i_store_auth(c, user, pass);
+	}
+	if (allow_multiple_connections)
+		c->_mc_enabled = ftp_btrue;
+
+	if (user != NULL && pass != NULL) {
+		if (ftp_i_login(c, user, pass) != FTP_OK)
+			return FTP_ERROR;
+		return ftp_i_negotiate_features(c);
 	}
 
 	return FTP_OK;
-}
\ No newline at end of file
+}
@@ -49,6 +49,10 @@ FTP_I_END_DECLS
 #define FTP_CUSER "USER"
 #define FTP_CPASS "PASS"
 
+#define FTP_CFEAT "FEAT"
+#define FTP_COPTS "OPTS"
+#define FTP_COPTS_MLST "MLST"
+
 #define FTP_CPASV "PASV"
 #define FTP_CEPSV "EPSV"
 
@@ -59,8 +63,13 @@ FTP_I_END_DECLS
 #define FTP_CPWD "PWD"
 #define FTP_CCWD "CWD"
 #define FTP_CLIST "LIST"
+#define FTP_CLIST_RECURSIVE "-R"
 #define FTP_CMLSD "MLSD"
+#define FTP_CNLST "NLST"
+#define FTP_CMLST "MLST"
 #define FTP_CSIZE "SIZE"
+#define FTP_CSTAT "STAT"
+#define FTP_CMDTM "MDTM"
 
 #define FTP_CSTOR "STOR"
 #define FTP_CAPPE "APPE"
@@ -26,6 +26,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/time.h>
+#include <netinet/tcp.h>
 #include "ftpfunctions.h"
 #include "ftpcommands.h"
 #include "ftpsignals.h"
@@ -40,7 +42,7 @@ int ftp_error = 0;
 #define FTP_TLS_ERROR 2
 
 
-int ftp_i_socket_connect(char *destination, unsigned int port, unsigned long timeout)
+int ftp_i_socket_connect(char *destination, unsigned int port, unsigned long timeout, int *family)
 {
 	struct addrinfo *info, hints;
 	int sockfd;
@@ -65,6 +67,8 @@ int ftp_i_socket_connect(char *destination, unsigned int port, unsigned long tim
 		t.tv_sec = timeout;
 		t.tv_usec = 0;
 		setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(struct timeval));
+		if (family)
+			*family = info->ai_family;
 		return sockfd;
 	}
 	return -1;
@@ -72,7 +76,7 @@ int ftp_i_socket_connect(char *destination, unsigned int port, unsigned long tim
 
 int ftp_connect(ftp_connection *c, char *host, unsigned int port)
 {
-	c->_sockfd = ftp_i_socket_connect(host, port, INTERNAL_TIMEOUT);
+	c->_sockfd = ftp_i_socket_connect(host, port, INTERNAL_TIMEOUT, &c->_adr_fam);
 	if (c->_sockfd < 0) {
 		ftp_error = FTP_ECONNECTION;
 		return 1;
@@ -119,7 +123,7 @@ int ftp_i_tls_init(ftp_connection *c)
 	if (ftp_i_release_input_thread(c) != 0)
 		return FTP_TLS_ERROR;
 
-	if (ftp_i_tls_connect(c->_sockfd, &c->_tls_info, NULL, &c->error) != FTP_OK)
+	if (ftp_i_tls_connect(c->_sockfd, c->_host, c->_port, &c->_tls_info, NULL, &c->error) != FTP_OK)
 		return FTP_TLS_ERROR;
 
 	c->_disable_input_thread = ftp_bfalse;
@@ -131,7 +135,7 @@ int ftp_i_tls_init(ftp_connection *c)
 
 int ftp_i_tls_init_data_connection(ftp_connection *c)
 {
-	if (ftp_i_tls_connect(c->_data_connection, &c->_tls_info_dc, c->_tls_info, &c->error) != FTP_OK)
+	if (ftp_i_tls_connect(c->_data_connection, NULL, 0, &c->_tls_info_dc, c->_tls_info, &c->error) != FTP_OK)
 		return FTP_TLS_ERROR;
 
 	return FTP_TLS_OK;
@@ -191,6 +195,7 @@ ftp_connection *ftp_open(char *host, unsigned int port, ftp_security security)
 	c->content_listing_filter = ftp_btrue;
 	c->__features.use_epsv = c->__features.use_mlsd = ftp_btrue;
 	c->_current_features = &(c->__features);
+	c->_security = security;
 
 	if ((ftp_error = ftp_i_init(c, host, port, security)) != 0) {
 		ftp_close(c);
@@ -208,7 +213,10 @@ ftp_status ftp_i_establish_data_connection(ftp_connection *c)
 	if (pasv_port < 0)
 		return FTP_ERROR;
 
-	sockfd = ftp_i_socket_connect(c->_host, pasv_port, STANDARD_TIMEOUT);
+	/* Replies to an earlier transfer were received before the PASV answer. */
+	__atomic_store_n(&c->_transfer_state, FTP_I_TRANSFER_IDLE, __ATOMIC_RELEASE);
+
+	sockfd = ftp_i_socket_connect(c->_host, pasv_port, STANDARD_TIMEOUT, NULL);
 	if (sockfd < 0) {
 		ftp_i_connection_set_error(c, FTP_ECONNECTION);
 		return FTP_ERROR;
@@ -239,6 +247,27 @@ void ftp_i_close_data_connection(ftp_connection *c)
 	c->_data_connection=0;
 }
 
+/*
+ * Called right before sending a command that transfers on the data connection. Its next
+ * final reply completes the transfer, whatever the code is.
+ */
+void ftp_i_begin_transfer(ftp_connection *c)
+{
+	__atomic_store_n(&c->_transfer_state, FTP_I_TRANSFER_RUNNING, __ATOMIC_RELEASE);
+}
+
+/*
+ * Marks the running transfer as stopped by the client, the input thread then drops its
+ * completion reply as nobody waits for it. If the reply has already arrived, there is
+ * nothing left to drop.
+ */
+void ftp_i_abort_transfer(ftp_connection *c)
+{
+	int expected = FTP_I_TRANSFER_RUNNING;
+	__atomic_compare_exchange_n(&c->_transfer_state, &expected, FTP_I_TRANSFER_ABORTED,
+		ftp_bfalse, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
 void ftp_i_close(ftp_connection *c)
 {
 	if (c->status != FTP_DOWN) {
@@ -257,6 +286,8 @@ void ftp_i_close(ftp_connection *c)
 	}
 
 	ftp_i_managed_buffer_free(c->_last_answer_buffer);
+	ftp_i_invalidate_listing_cache(c);
+	ftp_i_dir_cache_release(c);
 	ftp_i_free(c->cur_directory);
 	ftp_i_free(c->_mc_pass);
 	ftp_i_free(c->_mc_user);
@@ -274,6 +305,120 @@ void ftp_i_close(ftp_connection *c)
 	free(c);
 }
 
+/*
+ * Tears down a broken control connection (and its data connection) without talking
+ * to the server, so that ftp_i_init can be used on the connection again.
+ */
+static void ftp_i_drop_connection(ftp_connection *c)
+{
+	c->status = FTP_DOWN;
+	if (c->_data_connection)
+		ftp_i_close_data_connection(c);
+	if (c->_sockfd >= 0)
+		shutdown(c->_sockfd, SHUT_RDWR);
+	ftp_i_release_input_thread(c);
+	if (c->_sockfd >= 0)
+		close(c->_sockfd);
+	c->_sockfd = -1;
+
+#ifdef FTP_TLS_ENABLED
+	ftp_i_tls_drop(&c->_tls_info);
+#endif
+
+	ftp_i_managed_buffer_free(c->_last_answer_buffer);
+	for (int i = 0; i < FTP_TRIGGER_MAX; i++)
+		c->_input_trigger_signals[i] = 0;
+	c->_last_answer_lock_signal = 0;
+	c->_multiline_signal = 0;
+	__atomic_store_n(&c->_pending_noops, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&c->_transfer_state, FTP_I_TRANSFER_IDLE, __ATOMIC_RELEASE);
+	ftp_i_invalidate_listing_cache(c);
+	c->_transfer_type = ftp_tt_undefined;
+	c->_mlst_facts = 0;
+	c->_disable_input_thread = ftp_bfalse;
+	c->_reply_too_large = ftp_bfalse;
+#ifdef FTP_SERVER_VERBOSE
+	ftp_i_managed_buffer_free(c->verbose_command_buffer);
+#endif
+}
+
+/*
+ * Re-establishes a lost control connection: connects, logs in with the stored
+ * credentials and restores the current directory and the transfer type. TLS
+ * connections resume their cached session.
+ */
+static ftp_status ftp_i_reconnect(ftp_connection *c, ftp_transfer_type tt)
+{
+	char *host = c->_host;
+	int error;
+
+#ifdef FTP_TLS_ENABLED
+	/* A connection that negotiated TLS must not come back in plaintext (ftp_auth sends
+	 * the stored password), also not in later attempts. */
+	if (c->_tls_info)
+		c->_security = ftp_security_always;
+#endif
+
+	c->_host = NULL;
+	ftp_i_drop_connection(c);
+	error = ftp_i_init(c, host, c->_port, c->_security);
+	if (c->_host)
+		free(host);
+	else
+		c->_host = host;
+	if (error != 0) {
+		ftp_i_drop_connection(c);
+		ftp_i_connection_set_error(c, error);
+		return FTP_ERROR;
+	}
+
+	if (c->_mc_user && c->_mc_pass &&
+		ftp_auth(c, c->_mc_user, c->_mc_pass, ftp_bfalse) != FTP_OK)
+		return FTP_ERROR;
+
+	if (c->cur_directory) {
+		ftp_i_set_input_trigger(c, FTP_SIGNAL_REQUESTED_ACTION_OKAY);
+		if (ftp_i_send_command_and_wait_for_triggers(c, FTP_CCWD, c->cur_directory, NULL, FTP_EUNEXPECTED, NULL) != FTP_OK)
+			return FTP_ERROR;
+	}
+
+	if (tt != ftp_tt_undefined && ftp_i_set_transfer_type(c, tt) != FTP_OK)
+		return FTP_ERROR;
+
+	FTP_LOG("Reconnected.\n");
+	return FTP_OK;
+}
+
+/*
+ * Called after an idempotent operation failed. If the failure was caused by a lost
+ * control connection and attempts are left, the connection is re-established
+ * (waiting 1, 2, 4, ... seconds before each attempt) and ftp_btrue is returned, so
+ * the operation can be repeated.
+ */
+ftp_bool ftp_i_reconnect_after_failure(ftp_connection *c, unsigned int *attempt)
+{
+	if (c->error != FTP_ESOCKET && c->error != FTP_ETIMEOUT && c->error != FTP_EWRITE &&
+		!(c->error == FTP_ENOTREADY && ftp_i_connection_is_down(c)))
+		return ftp_bfalse;
+	if (!c->_host)
+		return ftp_bfalse;
+	/* Reconnecting would close the data connection under a running transfer. */
+	if (c->_data_connection)
+		return ftp_bfalse;
+
+	ftp_transfer_type tt = c->_transfer_type;
+	while (*attempt < c->reconnect_attempts) {
+		unsigned int delay = 1u << (*attempt < 5 ? *attempt : 5);
+		(*attempt)++;
+		FTP_WARN("Control connection lost, reconnecting in %u s (attempt %u of %u).\n",
+			delay, *attempt, c->reconnect_attempts);
+		sleep(delay);
+		if (ftp_i_reconnect(c, tt) == FTP_OK)
+			return ftp_btrue;
+	}
+	return ftp_bfalse;
+}
+
 void ftp_close(ftp_connection *c)
 {
 	if (c->_child) {
@@ -369,24 +514,78 @@ ftp_status ftp_send(ftp_connection *c, char *signal)
 		c->error = FTP_EWRITE;
 		return FTP_ERROR;
 	}
+	gettimeofday(&c->_last_command, NULL);
 	return FTP_OK;
 }
 
+/*
+ * Enables TCP keepalives on the control connection, using keepalive_interval as idle
+ * time and probe interval where the platform allows it.
+ */
+void ftp_i_set_tcp_keepalive(ftp_connection *c)
+{
+	int on = c->keepalive_interval > 0;
+	setsockopt(c->_sockfd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+	if (!on)
+		return;
+	int interval = (int)c->keepalive_interval, count = 3;
+#ifdef TCP_KEEPIDLE
+	setsockopt(c->_sockfd, IPPROTO_TCP, TCP_KEEPIDLE, &interval, sizeof(interval));
+#elif defined(TCP_KEEPALIVE)
+	setsockopt(c->_sockfd, IPPROTO_TCP, TCP_KEEPALIVE, &interval, sizeof(interval));
+#endif
+#ifdef TCP_KEEPINTVL
+	setsockopt(c->_sockfd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+#endif
+#ifdef TCP_KEEPCNT
+	setsockopt(c->_sockfd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+}
+
+/*
+ * Sends NOOP if the last command on the control connection is older than
+ * keepalive_interval. If wait is false, the answer is not waited for and the input
+ * thread drops it when it arrives. This is used while a file transfer is running.
+ */
+ftp_status ftp_i_keepalive_if_due(ftp_connection *c, ftp_bool wait)
+{
+	struct timeval now;
+	if (c->keepalive_interval == 0 || !ftp_i_connection_is_ready(c))
+		return FTP_OK;
+	gettimeofday(&now, NULL);
+	if (ftp_i_seconds_between(c->_last_command, now) < c->keepalive_interval)
+		return FTP_OK;
+
+	/* Never reconnects, that would close the data connection of a running transfer. */
+	return ftp_i_noop(c, wait);
+}
+
 ftp_status ftp_i_send_command_and_wait_for_triggers(ftp_connection *c, char *command, char *arg1, char *arg2, int error, ftp_bool *remote_err)
 {
-	if (ftp_send(c, command) != FTP_OK)
+	/* The command is sent with a single write. Separate small writes are held back by
+	 * Nagle's algorithm until the server acknowledges the first one, which it may delay. */
+	size_t len = strlen(command) + strlen(FTP_CENDL) + 1;
+	if (arg1)
+		len += strlen(arg1) + 1 + (arg2 ? strlen(arg2) + 1 : 0);
+	char small[512], *line = len <= sizeof(small) ? small : malloc(len);
+	if (!line) {
+		ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
 		return FTP_ERROR;
+	}
+	strcpy(line, command);
 	if (arg1) {
-		if (ftp_send(c, " ") != FTP_OK ||
-			ftp_send(c, arg1) != FTP_OK)
-			return FTP_ERROR;
+		strcat(line, " ");
+		strcat(line, arg1);
 		if (arg2) {
-			if (ftp_send(c, " ") != FTP_OK ||
-				ftp_send(c, arg2) != FTP_OK)
-				return FTP_ERROR;
+			strcat(line, " ");
+			strcat(line, arg2);
 		}
 	}
-	if (ftp_send(c, FTP_CENDL) != FTP_OK)
+	strcat(line, FTP_CENDL);
+	ftp_status sent = ftp_send(c, line);
+	if (line != small)
+		free(line);
+	if (sent != FTP_OK)
 		return FTP_ERROR;
 
 	if (ftp_i_wait_for_triggers(c) != FTP_OK) {
@@ -405,18 +604,120 @@ ftp_status ftp_i_send_command_and_wait_for_triggers(ftp_connection *c, char *com
 	return FTP_OK;
 }
 
-ftp_status ftp_i_read_data_connection_into_buffer(ftp_connection *c, ftp_i_managed_buffer *buf)
+/*
+ * Reads the whole data connection into buf. If more than max_listing_size bytes
+ * arrive, the data is written to a temporary file instead, which is returned rewound
+ * in *spill (buf is left empty then). This requires listing_spill and spill != NULL,
+ * otherwise FTP_ELISTINGTOOLARGE is set.
+ */
+ftp_status ftp_i_read_data_connection_into_buffer(ftp_connection *c, ftp_i_managed_buffer *buf, FILE **spill)
 {
-	char chr;
+	char chunk[FTP_DATA_CHUNK_SIZE];
+	FILE *file = NULL;
 	ssize_t n;
-	while ((n = ftp_i_read(c, 1, &chr, 1)) == 1) {
-		if (ftp_i_managed_buffer_append(buf, &chr, 1) != FTP_OK) {
+	while ((n = ftp_i_read(c, 1, chunk, FTP_DATA_CHUNK_SIZE)) > 0) {
+		if (!file && c->max_listing_size &&
+			ftp_i_managed_buffer_length(buf) + (size_t)n > c->max_listing_size) {
+			if (!spill || !c->listing_spill) {
+				ftp_i_connection_set_error(c, FTP_ELISTINGTOOLARGE);
+				return FTP_ERROR;
+			}
+			size_t len = ftp_i_managed_buffer_length(buf);
+			if (!(file = tmpfile()) || fwrite(ftp_i_managed_buffer_cbuf(buf), 1, len, file) != len)
+				goto file_error;
+			FTP_LOG("listing exceeds max_listing_size, writing it to a temporary file\n");
+			ftp_i_managed_buffer_clear(buf);
+		}
+		if (file) {
+			if (fwrite(chunk, 1, (size_t)n, file) != (size_t)n)
+				goto file_error;
+		} else if (ftp_i_managed_buffer_append(buf, chunk, (size_t)n) != FTP_OK) {
 			ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
 			return FTP_ERROR;
 		}
 	}
 
 	if (n < 0) {
+		if (file)
+			fclose(file);
+		if (ftp_i_is_timed_out(errno)) {
+			errno = 0;
+			ftp_i_connection_set_error(c, FTP_ETIMEOUT);
+		} else {
+			ftp_i_connection_set_error(c, FTP_ESOCKET);
+		}
+		return FTP_ERROR;
+	}
+
+	if (file) {
+		if (fflush(file) != 0 || fseek(file, 0, SEEK_SET) != 0)
+			goto file_error;
+		*spill = file;
+	}
+	return FTP_OK;
+
+file_error:
+	if (file)
+		fclose(file);
+	ftp_i_connection_set_error(c, FTP_ELOCALFILE);
+	return FTP_ERROR;
+}
+
+/*
+ * Reads the data connection in chunks and passes every line to handler. Only the
+ * current chunk and an incomplete line are kept in memory. Stops early (without
+ * error) if handler returns false. Lines longer than max_listing_size fail with
+ * FTP_ELISTINGTOOLARGE.
+ */
+ftp_status ftp_i_read_data_connection_lines(ftp_connection *c, ftp_i_line_handler handler, void *context)
+{
+	char chunk[FTP_DATA_CHUNK_SIZE];
+	ftp_i_managed_buffer *pending;
+	ftp_bool proceed = ftp_btrue;
+	ssize_t n;
+
+	if (!(pending = ftp_i_managed_buffer_new())) {
+		ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
+		return FTP_ERROR;
+	}
+
+	while (proceed && (n = ftp_i_read(c, 1, chunk, FTP_DATA_CHUNK_SIZE)) > 0) {
+		char *start = chunk, *end = chunk + n, *nl;
+		while (proceed && (nl = ftp_i_scan(start, end, '\n')) < end) {
+			char *line = start;
+			size_t len = nl - start;
+			*nl = '\0';
+			if (ftp_i_managed_buffer_length(pending) > 0) {
+				/* Completes a line started in a previous chunk. */
+				if (ftp_i_managed_buffer_append(pending, start, len) != FTP_OK)
+					goto alloc_error;
+				line = ftp_i_managed_buffer_cbuf(pending);
+				len = ftp_i_managed_buffer_length(pending);
+			}
+			if (len > 0 && line[len - 1] == '\r')
+				line[--len] = '\0';
+			if (c->max_listing_size && len > c->max_listing_size)
+				goto too_large;
+			proceed = handler(line, len, context);
+			ftp_i_managed_buffer_clear(pending);
+			start = nl + 1;
+		}
+		if (proceed && start < end) {
+			if (c->max_listing_size &&
+				ftp_i_managed_buffer_length(pending) + (end - start) > c->max_listing_size)
+				goto too_large;
+			if (ftp_i_managed_buffer_append(pending, start, end - start) != FTP_OK)
+				goto alloc_error;
+		}
+	}
+
+	if (!proceed) {
+		ftp_i_managed_buffer_release(pending);
+		return FTP_OK;
+	}
+
+	if (n < 0) {
+		ftp_i_managed_buffer_release(pending);
 		if (ftp_i_is_timed_out(errno)) {
 			errno = 0;
 			ftp_i_connection_set_error(c, FTP_ETIMEOUT);
@@ -426,7 +727,27 @@ ftp_status ftp_i_read_data_connection_into_buffer(ftp_connection *c, ftp_i_manag
 		return FTP_ERROR;
 	}
 
+	if (ftp_i_managed_buffer_length(pending) > 0) {
+		/* Last line without line terminator. */
+		char *line = ftp_i_managed_buffer_cbuf(pending);
+		size_t len = ftp_i_managed_buffer_length(pending);
+		if (line[len - 1] == '\r')
+			line[--len] = '\0';
+		handler(line, len, context);
+	}
+
+	ftp_i_managed_buffer_release(pending);
 	return FTP_OK;
+
+too_large:
+	ftp_i_managed_buffer_release(pending);
+	ftp_i_connection_set_error(c, FTP_ELISTINGTOOLARGE);
+	return FTP_ERROR;
+
+alloc_error:
+	ftp_i_managed_buffer_release(pending);
+	ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
+	return FTP_ERROR;
 }
 
 ftp_status ftp_i_set_transfer_type(ftp_connection *c, ftp_transfer_type tt)
@@ -0,0 +1,322 @@
+/*   libmftp
+ *
+ *   Copyright (c) 2014 nkreipke
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "ftpfunctions.h"
+
+/*
+ * While an array is being built, the name arena may still be moved by realloc, so
+ * entries store the offset of their name in filename. ftp_i_content_array_finish
+ * turns the offsets into pointers.
+ */
+#define ftp_i_name_offset(entry) ((size_t)(uintptr_t)(entry)->filename)
+
+ftp_content_array *ftp_i_content_array_new(void)
+{
+	return calloc(1, sizeof(ftp_content_array));
+}
+
+/* Grows a name arena so that it can hold needed bytes. */
+static ftp_status ftp_i_arena_reserve(char **arena, size_t *arena_size, size_t needed)
+{
+	if (needed <= *arena_size)
+		return FTP_OK;
+	size_t size = *arena_size ? *arena_size * 2 : 4096;
+	while (size < needed)
+		size *= 2;
+	char *grown = realloc(*arena, size);
+	if (!grown)
+		return FTP_ERROR;
+	*arena = grown;
+	*arena_size = size;
+	return FTP_OK;
+}
+
+ftp_status ftp_i_content_array_append(ftp_content_array *a, const ftp_content_listing *item)
+{
+	size_t len = strlen(item->filename) + 1;
+
+	if (a->count == a->_capacity) {
+		size_t capacity = a->_capacity ? a->_capacity * 2 : 64;
+		ftp_content_listing *entries = realloc(a->entries, capacity * sizeof(ftp_content_listing));
+		if (!entries)
+			return FTP_ERROR;
+		a->entries = entries;
+		a->_capacity = capacity;
+	}
+
+	if (ftp_i_arena_reserve(&a->names, &a->_names_size, a->_names_length + len) != FTP_OK)
+		return FTP_ERROR;
+
+	memcpy(a->names + a->_names_length, item->filename, len);
+
+	ftp_content_listing *entry = a->entries + a->count++;
+	entry->facts = item->facts;
+	entry->filename = (char*)(uintptr_t)a->_names_length;
+	entry->next = NULL;
+	a->_names_length += len;
+	return FTP_OK;
+}
+
+void ftp_i_content_array_finish(ftp_content_array *a)
+{
+	/* Give back the unused capacity; shrinking never fails in practice, but the
+	 * old blocks stay valid if it does. */
+	if (a->count > 0 && a->count < a->_capacity) {
+		ftp_content_listing *entries = realloc(a->entries, a->count * sizeof(ftp_content_listing));
+		if (entries) {
+			a->entries = entries;
+			a->_capacity = a->count;
+		}
+	}
+	if (a->_names_length > 0 && a->_names_length < a->_names_size) {
+		char *names = realloc(a->names, a->_names_length);
+		if (names) {
+			a->names = names;
+			a->_names_size = a->_names_length;
+		}
+	}
+
+	for (size_t i = 0; i < a->count; i++)
+		a->entries[i].filename = a->names + ftp_i_name_offset(&a->entries[i]);
+}
+
+ftp_content_array *ftp_i_content_array_copy(const ftp_content_array *a)
+{
+	ftp_content_array *copy = ftp_i_content_array_new();
+	if (!copy)
+		return NULL;
+	for (size_t i = 0; i < a->count; i++) {
+		if (ftp_i_content_array_append(copy, &a->entries[i]) != FTP_OK) {
+			ftp_free_array(copy);
+			return NULL;
+		}
+	}
+	ftp_i_content_array_finish(copy);
+	return copy;
+}
+
+ftp_content_array *ftp_content_array_from_listing(ftp_content_listing *cl)
+{
+	ftp_content_array *a = ftp_i_content_array_new();
+	if (!a)
+		return NULL;
+
+	for (; cl; cl = cl->next) {
+		if (ftp_i_content_array_append(a, cl) != FTP_OK) {
+			ftp_free_array(a);
+			return NULL;
+		}
+	}
+
+	ftp_i_content_array_finish(a);
+	return a;
+}
+
+ftp_content_listing *ftp_content_array_to_listing(ftp_content_array *a)
+{
+	ftp_content_listing *start = NULL, **next = &start;
+
+	for (size_t i = 0; i < a->count; i++) {
+		ftp_content_listing *current = ftp_i_mkcontentlisting();
+		if (current)
+			ftp_i_strcpy_malloc(current->filename, a->entries[i].filename);
+		if (!current || !current->filename) {
+			ftp_i_free(current);
+			if (start)
+				ftp_free(start);
+			return NULL;
+		}
+		current->facts = a->entries[i].facts;
+		*next = current;
+		next = &current->next;
+	}
+
+	return start;
+}
+
+static inline uint32_t ftp_i_hash_name(const char *name)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	for (; *name; name++)
+		h = (h ^ (unsigned char)*name) * 16777619u;
+	return h;
+}
+
+static ftp_status ftp_i_content_array_build_index(ftp_content_array *a)
+{
+	size_t size = 16;
+	while (size < a->count * 2)
+		size *= 2;
+
+	unsigned int *index = calloc(size, sizeof(unsigned int));
+	if (!index)
+		return FTP_ERROR;
+
+	/* Slots hold entry number + 1, 0 marks a free slot. */
+	for (size_t i = 0; i < a->count; i++) {
+		size_t slot = ftp_i_hash_name(a->entries[i].filename) & (size - 1);
+		while (index[slot])
+			slot = (slot + 1) & (size - 1);
+		index[slot] = (unsigned int)i + 1;
+	}
+
+	a->_index = index;
+	a->_index_size = size;
+	return FTP_OK;
+}
+
+static void ftp_i_content_array_drop_index(ftp_content_array *a)
+{
+	ftp_i_free(a->_index);
+	a->_index_size = 0;
+}
+
+ftp_bool ftp_item_exists_in_content_array(ftp_content_array *a, const char *file_nm, ftp_content_listing **item)
+{
+	if (!a)
+		return ftp_bfalse;
+
+	if (!a->_index && ftp_i_content_array_build_index(a) != FTP_OK) {
+		/* Not enough memory for the index, search linearly. */
+		for (size_t i = 0; i < a->count; i++) {
+			if (strcmp(a->entries[i].filename, file_nm) == 0) {
+				if (item)
+					*item = &a->entries[i];
+				return ftp_btrue;
+			}
+		}
+		return ftp_bfalse;
+	}
+
+	size_t mask = a->_index_size - 1;
+	for (size_t slot = ftp_i_hash_name(file_nm) & mask; a->_index[slot]; slot = (slot + 1) & mask) {
+		ftp_content_listing *entry = &a->entries[a->_index[slot] - 1];
+		if (strcmp(entry->filename, file_nm) == 0) {
+			if (item)
+				*item = entry;
+			return ftp_btrue;
+		}
+	}
+	return ftp_bfalse;
+}
+
+static int ftp_i_compare_entries(const void *a, const void *b)
+{
+	return strcmp(((const ftp_content_listing *)a)->filename, ((const ftp_content_listing *)b)->filename);
+}
+
+void ftp_content_array_sort(ftp_content_array *a)
+{
+	ftp_i_content_array_drop_index(a);
+	if (a->count > 1)
+		qsort(a->entries, a->count, sizeof(ftp_content_listing), ftp_i_compare_entries);
+}
+
+void ftp_content_array_filter(ftp_content_array *a, ftp_list_callback keep, void *context)
+{
+	size_t kept = 0;
+	ftp_i_content_array_drop_index(a);
+	for (size_t i = 0; i < a->count; i++) {
+		if (keep(&a->entries[i], context)) {
+			if (kept != i)
+				a->entries[kept] = a->entries[i];
+			kept++;
+		}
+	}
+	/* Names of removed entries stay in the arena until the array is freed. */
+	a->count = kept;
+}
+
+void ftp_free_array(ftp_content_array *a)
+{
+	if (!a)
+		return;
+	ftp_i_free(a->entries);
+	ftp_i_free(a->names);
+	ftp_i_free(a->_index);
+	ftp_i_free(a);
+}
+
+ftp_name_array *ftp_i_name_array_new(void)
+{
+	return calloc(1, sizeof(ftp_name_array));
+}
+
+ftp_status ftp_i_name_array_append(ftp_name_array *a, const char *name, size_t len)
+{
+	if (a->count == a->_capacity) {
+		size_t capacity = a->_capacity ? a->_capacity * 2 : 256;
+		char **names = realloc(a->names, capacity * sizeof(char *));
+		if (!names)
+			return FTP_ERROR;
+		a->names = names;
+		a->_capacity = capacity;
+	}
+
+	if (ftp_i_arena_reserve(&a->arena, &a->_arena_size, a->_arena_length + len + 1) != FTP_OK)
+		return FTP_ERROR;
+
+	memcpy(a->arena + a->_arena_length, name, len);
+	a->arena[a->_arena_length + len] = '\0';
+	/* An offset until ftp_i_name_array_finish, see ftp_i_name_offset. */
+	a->names[a->count++] = (char*)(uintptr_t)a->_arena_length;
+	a->_arena_length += len + 1;
+	return FTP_OK;
+}
+
+void ftp_i_name_array_finish(ftp_name_array *a)
+{
+	if (a->count > 0 && a->count < a->_capacity) {
+		char **names = realloc(a->names, a->count * sizeof(char *));
+		if (names) {
+			a->names = names;
+			a->_capacity = a->count;
+		}
+	}
+	if (a->_arena_length > 0 && a->_arena_length < a->_arena_size) {
+		char *arena = realloc(a->arena, a->_arena_length);
+		if (arena) {
+			a->arena = arena;
+			a->_arena_size = a->_arena_length;
+		}
+	}
+
+	for (size_t i = 0; i < a->count; i++)
+		a->names[i] = a->arena + (size_t)(uintptr_t)a->names[i];
+}
+
+void ftp_free_name_array(ftp_name_array *a)
+{
+	if (!a)
+		return;
+	ftp_i_free(a->names);
+	ftp_i_free(a->arena);
+	ftp_i_free(a);
+}
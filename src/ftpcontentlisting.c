@@ -26,6 +26,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fnmatch.h>
 #include "ftpfunctions.h"
 #include "ftpcommands.h"
 #include "ftpparse.h"
@@ -40,20 +43,23 @@ ftp_content_listing *ftp_i_mkcontentlisting(void)
 
 void ftp_free(ftp_content_listing *cl)
 {
-	if (cl->next)
-		ftp_free(cl->next);
-	ftp_i_free(cl->filename);
-	ftp_i_free(cl);
+	while (cl) {
+		ftp_content_listing *next = cl->next;
+		ftp_i_free(cl->filename);
+		ftp_i_free(cl);
+		cl = next;
+	}
 }
 
-ftp_content_listing *ftp_i_applyclfilter(ftp_content_listing *c, int *items_count)
+/* Frees the entries of c for which keep(entry, context) returns ftp_bfalse. */
+static ftp_content_listing *ftp_i_remove_entries(ftp_content_listing *c, ftp_list_callback keep, void *context, int *items_count)
 {
 	int itemscount = *items_count;
 	ftp_content_listing *start = c;
 	ftp_content_listing *cur = c;
 	ftp_content_listing *previous = NULL;
 	while (cur) {
-		if (!(ftp_i_clfilter_keepthis(cur))) {
+		if (!keep(cur, context)) {
 			//delete this item
 			if (previous) {
 				previous->next = cur->next;
@@ -76,6 +82,52 @@ ftp_content_listing *ftp_i_applyclfilter(ftp_content_listing *c, int *items_coun
 	return start;
 }
 
+ftp_bool ftp_i_clfilter_keep(ftp_content_listing *cur, void *context)
+{
+	return ftp_i_clfilter_keepthis(cur);
+}
+
+ftp_content_listing *ftp_i_applyclfilter(ftp_content_listing *c, int *items_count)
+{
+	return ftp_i_remove_entries(c, ftp_i_clfilter_keep, NULL, items_count);
+}
+
+/*
+ * Whether entry meets all conditions of filter. entry->filename may point into the
+ * buffer that is being parsed.
+ */
+ftp_bool ftp_i_filter_matches(const ftp_listing_filter *filter, ftp_content_listing *entry)
+{
+	const ftp_file_facts *f = &entry->facts;
+
+	if (filter->name && fnmatch(filter->name, entry->filename, 0) != 0)
+		return ftp_bfalse;
+	if (filter->types && (!f->given.type || !(filter->types & (1u << f->type))))
+		return ftp_bfalse;
+	if (filter->min_size > 0 || filter->max_size > 0) {
+		if (!f->given.size || f->size < filter->min_size ||
+			(filter->max_size > 0 && f->size > filter->max_size))
+			return ftp_bfalse;
+	}
+	if (filter->modified_min != 0 || filter->modified_max != 0) {
+		if (!f->given.modify ||
+			(filter->modified_min != 0 && f->modify_time < filter->modified_min) ||
+			(filter->modified_max != 0 && f->modify_time > filter->modified_max))
+			return ftp_bfalse;
+	}
+	return !filter->match || filter->match(entry, filter->context);
+}
+
+static ftp_bool ftp_i_filter_keep(ftp_content_listing *cur, void *filter)
+{
+	return ftp_i_filter_matches(filter, cur);
+}
+
+ftp_content_listing *ftp_i_apply_listing_filter(ftp_content_listing *c, const ftp_listing_filter *filter, int *items_count)
+{
+	return ftp_i_remove_entries(c, ftp_i_filter_keep, (void *)filter, items_count);
+}
+
 ftp_bool ftp_i_clfilter_keepthis(ftp_content_listing *cur)
 {
 	if (cur->facts.given.type &&
@@ -94,224 +146,636 @@ ftp_bool ftp_i_clfilter_keepthis(ftp_content_listing *cur)
 	return ftp_btrue;
 }
 
-ftp_file_type ftp_i_strtotype(char *str)
+ftp_file_type ftp_i_strtotype(const char *str, size_t len)
 {
-	ftp_i_strtolower(str);
-	if (strcmp(str, "file") == 0)
+	if (len == 4 && strncasecmp(str, "file", 4) == 0)
 		return ft_file;
-	else if (strcmp(str, "dir") == 0)
+	else if (len == 3 && strncasecmp(str, "dir", 3) == 0)
 		return ft_dir;
 	else
 		return ft_other;
 }
 
-ftp_bool ftp_i_applyfact(char *fact, ftp_file_facts *facts, unsigned long factlen)
+static inline unsigned long ftp_i_decimal(const char *str, size_t len)
 {
-	char key[100], value[100];
-	unsigned long p = 0;
-	//FTP_LOG("Got file fact %s\n", fact);
-	//search for =
-	while (*(fact+p) != '=') {
-		if (*(fact+p) == '\0')
-			// this is a malformed fact reply, abort parsing.
-			return ftp_bfalse;
-		p++;
-	}
-	strcpy(value, fact+p+1);
-	*(fact+p) = '\0';
-	strcpy(key, fact);
-	ftp_i_strtolower(key);
-	unsigned long vlen = factlen - p - 1;
-	//interpret key
-	if (strcmp(key, "size") == 0) {
-		facts->size = strtoul(value, (char**)NULL, 10);
-		facts->given.size = 1;
-	} else if (strcmp(key, "modify") == 0) {
+	unsigned long v = 0;
+	for (size_t i = 0; i < len && str[i] >= '0' && str[i] <= '9'; i++)
+		v = v * 10 + (unsigned long)(str[i] - '0');
+	return v;
+}
+
+ftp_bool ftp_i_applyfact(unsigned int fact, const char *value, size_t vlen, ftp_file_facts *facts)
+{
+	switch (fact) {
+	case FTP_FACT_SIZE:
+		if (ftp_i_parse_offset(value, vlen, &facts->size))
+			facts->given.size = 1;
+		else
+			FTP_WARN("Ignoring invalid size fact.\n");
+		break;
+	case FTP_FACT_MODIFY:
 		if (vlen < 14) return ftp_bfalse;
-		facts->modify = ftp_i_date_from_string(value);
+		facts->modify = ftp_i_date_from_string(value, vlen);
+		facts->modify_time = ftp_i_date_to_unix_timestamp(&facts->modify);
 		facts->given.modify = 1;
-	} else if (strcmp(key, "create") == 0) {
+		break;
+	case FTP_FACT_CREATE:
 		if (vlen < 14) return ftp_bfalse;
-		facts->create = ftp_i_date_from_string(value);
+		facts->create = ftp_i_date_from_string(value, vlen);
+		facts->create_time = ftp_i_date_to_unix_timestamp(&facts->create);
 		facts->given.create = 1;
-	} else if (strcmp(key, "type") == 0) {
-		facts->type = ftp_i_strtotype(value);
+		break;
+	case FTP_FACT_TYPE:
+		facts->type = ftp_i_strtotype(value, vlen);
 		facts->given.type = 1;
-	} else if (strcmp(key, "unix.group") == 0) {
-		facts->unixgroup = (unsigned int)strtol(value, (char**)NULL, 10);
+		break;
+	case FTP_FACT_UNIXGROUP:
+		facts->unixgroup = (unsigned int)ftp_i_decimal(value, vlen);
 		facts->given.unixgroup = 1;
-	} else if (strcmp(key, "unix.mode") == 0) {
-		facts->unixmode = (unsigned int)strtol(value, (char**)NULL, 10);
+		break;
+	case FTP_FACT_UNIXMODE:
+		facts->unixmode = (unsigned int)ftp_i_decimal(value, vlen);
 		facts->given.unixmode = 1;
+		break;
 	}
 	return ftp_btrue;
 }
 
-ftp_bool ftp_i_applyfacts(char *factlist, ftp_file_facts *facts)
+/*
+ * Parses a fact list ("fact=value;fact=value;") of length len in place. Only the facts
+ * in wanted (FTP_FACT_* values) are decoded.
+ */
+ftp_bool ftp_i_applyfacts(const char *factlist, size_t len, unsigned int wanted, ftp_file_facts *facts)
 {
-	for_sep(fs, factlist, ";", {
-		unsigned long len = strlen(fs);
-		if (len == 0)
-			continue;
-		if (!ftp_i_applyfact(fs, facts, len)) {
-			ftp_i_free(fs);
-			return ftp_bfalse;
+	const char *p = factlist, *end = factlist + len;
+	while (p < end) {
+		const char *sep = ftp_i_scan(p, end, ';');
+		if (sep > p) {
+			const char *eq = ftp_i_scan(p, sep, '=');
+			if (eq == sep)
+				// this is a malformed fact reply, abort parsing.
+				return ftp_bfalse;
+			unsigned int fact = ftp_i_fact_from_name(p, eq - p);
+			if ((fact & wanted) && !ftp_i_applyfact(fact, eq + 1, sep - eq - 1, facts))
+				return ftp_bfalse;
 		}
-	});
+		p = sep + 1;
+	}
+	return ftp_btrue;
+}
+
+/*
+ * Splits len bytes of buf in place into lines terminated by LF or CRLF and passes
+ * each line to handler. Returns the number of lines that were terminated by LF only.
+ */
+unsigned long ftp_i_for_each_line(char *buf, size_t len, ftp_i_line_handler handler, void *context)
+{
+	char *p = buf, *end = buf + len;
+	unsigned long lf_only = 0;
+	while (p < end) {
+		char *nl = ftp_i_scan(p, end, '\n');
+		size_t linelen = nl - p;
+		if (linelen > 0 && p[linelen - 1] == '\r')
+			linelen--;
+		else if (nl < end)
+			lf_only++;
+		p[linelen] = '\0';
+		if (!handler(p, linelen, context))
+			break;
+		p = nl + 1;
+	}
+	return lf_only;
+}
+
+/*
+ * Parses one MLSD line ("fact=value;fact=value; filename"). item->filename will
+ * point into line afterwards.
+ */
+ftp_status ftp_i_parse_mlsd_line(char *line, size_t len, unsigned int facts, ftp_content_listing *item, int *error)
+{
+	char *filename = ftp_i_scan(line, line + len, ' ');
+	if (filename == line + len) {
+		FTP_ERR("[MLSD] Invalid answer.\n");
+		*error = FTP_EINVALID;
+		return FTP_ERROR;
+	}
+	*filename++ = '\0';
+
+	if (!ftp_i_applyfacts(line, filename - 1 - line, facts, &(item->facts))) {
+		FTP_ERR("[MLSD] Invalid answer.\n");
+		*error = FTP_EINVALID;
+		return FTP_ERROR;
+	}
+	item->filename = filename;
+	return FTP_OK;
+}
 
+/*
+ * Parses one LIST line using ftpparse. Returns false if the line does not describe
+ * a file (e.g. "total 14786"). item->filename will point into line afterwards.
+ */
+ftp_bool ftp_i_parse_list_line(char *line, int len, const ftp_i_time_context *now, ftp_content_listing *item)
+{
+	struct ftpparse fp;
+	if (!ftpparse(&fp, line, len, now))
+		return ftp_bfalse;
+
+	/* The name always ends at the end of the line or before " -> " of a link. */
+	fp.name[fp.namelen] = '\0';
+	item->filename = fp.name;
+	if (fp.unix_permissions[0] != 0) {
+		ftp_bool dir;
+		item->facts.unixgroup = ftp_i_unix_mode_from_string(fp.unix_permissions, &dir);
+		item->facts.type = dir ? ft_dir : ft_file;
+	} else {
+		//can only guess type
+		item->facts.type = fp.flagtrycwd ? ft_dir : ft_file;
+	}
+	item->facts.given.type = ftp_btrue;
+	item->facts.size = fp.size;
+	item->facts.given.size = (fp.sizetype != FTPPARSE_SIZE_UNKNOWN);
+	if (fp.mtime_given) {
+		item->facts.modify = fp.mtime;
+		item->facts.modify_time = ftp_i_date_to_unix_timestamp(&fp.mtime);
+		item->facts.given.modify = ftp_btrue;
+	}
 	return ftp_btrue;
 }
 
-ftp_content_listing *ftp_i_read_mlsd_answer(ftp_i_managed_buffer *buffer, int *items_count, int *error)
+/*
+ * Parses one line of a MLSD or LIST answer (without line terminator). If the line
+ * does not contain an entry, item->filename is NULL.
+ */
+ftp_status ftp_i_parse_listing_line(char *line, size_t len, ftp_bool mlsd, unsigned int facts, const ftp_i_time_context *now, ftp_content_listing *item, int *error)
 {
-	int itemscount = 0;
-	ftp_content_listing *start = NULL, *current = NULL;
+	item->filename = NULL;
+	if (len == 0)
+		return FTP_OK;
+	if (mlsd)
+		return ftp_i_parse_mlsd_line(line, len, facts, item, error);
+	ftp_i_parse_list_line(line, (int)len, now, item);
+	return FTP_OK;
+}
+
+struct ftp_i_listing_builder {
+	ftp_content_listing *start, *current;
+	int itemscount;
+	int error;
+	unsigned int facts;
+	const ftp_listing_filter *filter;
+	ftp_i_time_context now;
+};
+
+/*
+ * Copies entry (whose filename points into the parsed buffer) to the end of the list,
+ * unless it is rejected by the filter of the builder.
+ */
+static ftp_bool ftp_i_listing_builder_add(struct ftp_i_listing_builder *b, ftp_content_listing *entry)
+{
+	if (b->filter && !ftp_i_filter_matches(b->filter, entry))
+		return ftp_btrue;
+
+	ftp_content_listing *next = ftp_i_mkcontentlisting();
+	if (next)
+		ftp_i_strcpy_malloc(next->filename, entry->filename);
+	if (!next || !next->filename) {
+		FTP_ERR("Could not allocate filename buffer.\n");
+		ftp_i_free(next);
+		b->error = FTP_ECOULDNOTALLOCATE;
+		return ftp_bfalse;
+	}
+	next->facts = entry->facts;
+
+	if (b->current)
+		b->current->next = next;
+	else
+		b->start = next;
+	b->current = next;
+	b->itemscount++;
+	return ftp_btrue;
+}
+
+static ftp_bool ftp_i_append_mlsd_line(char *line, size_t len, void *context)
+{
+	struct ftp_i_listing_builder *b = context;
+	if (len == 0)
+		return ftp_btrue;
+
+	ftp_content_listing entry;
+	memset(&entry, 0, sizeof(entry));
+	if (ftp_i_parse_mlsd_line(line, len, b->facts, &entry, &b->error) != FTP_OK)
+		return ftp_bfalse;
+	return ftp_i_listing_builder_add(b, &entry);
+}
+
+struct ftp_i_parse_chunk {
+	char *buffer;
+	size_t length;
+	ftp_i_line_handler handler;
+	struct ftp_i_listing_builder builder;
+	unsigned long lf_only;
+	ftp_bool started;
+	pthread_t thread;
+};
+
+static void *ftp_i_parse_chunk_thread(void *context)
+{
+	struct ftp_i_parse_chunk *chunk = context;
+	chunk->lf_only = ftp_i_for_each_line(chunk->buffer, chunk->length, chunk->handler, &chunk->builder);
+	return NULL;
+}
+
+/*
+ * Feeds every line of buf to handler, which appends to b. Large buffers are split at
+ * line boundaries and parsed on several threads; the partial lists are concatenated
+ * in order afterwards. Returns the number of lines terminated by LF only.
+ */
+static unsigned long ftp_i_parse_lines(char *buf, size_t len, ftp_i_line_handler handler, struct ftp_i_listing_builder *b)
+{
+	long threads = 1;
+	if (len >= FTP_PARALLEL_PARSE_THRESHOLD)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > FTP_PARALLEL_PARSE_MAX_THREADS)
+		threads = FTP_PARALLEL_PARSE_MAX_THREADS;
+	if (threads > (long)(len / FTP_PARALLEL_PARSE_CHUNK_SIZE))
+		threads = len / FTP_PARALLEL_PARSE_CHUNK_SIZE;
+	if (threads < 2)
+		return ftp_i_for_each_line(buf, len, handler, b);
+
+	struct ftp_i_parse_chunk chunks[FTP_PARALLEL_PARSE_MAX_THREADS];
+	memset(chunks, 0, sizeof(chunks));
+	char *p = buf, *end = buf + len;
+	int n, i;
+	for (n = 0; n < threads && p < end; n++) {
+		char *split = end;
+		if (n < threads - 1) {
+			split = buf + len / threads * (n + 1);
+			if (split < p)
+				split = p;
+			split = ftp_i_scan(split, end, '\n');
+			if (split < end)
+				split++;
+		}
+		chunks[n].buffer = p;
+		chunks[n].length = split - p;
+		chunks[n].handler = handler;
+		chunks[n].builder.facts = b->facts;
+		chunks[n].builder.filter = b->filter;
+		chunks[n].builder.now = b->now;
+		p = split;
+	}
+
+	/* the first chunk is parsed on this thread, chunks whose thread could not be
+	 * created are parsed here as well. */
+	for (i = 1; i < n; i++)
+		chunks[i].started = (pthread_create(&chunks[i].thread, NULL, ftp_i_parse_chunk_thread, &chunks[i]) == 0);
+	ftp_i_parse_chunk_thread(&chunks[0]);
+	for (i = 1; i < n; i++) {
+		if (chunks[i].started)
+			pthread_join(chunks[i].thread, NULL);
+		else
+			ftp_i_parse_chunk_thread(&chunks[i]);
+	}
+
+	unsigned long lf_only = 0;
+	for (i = 0; i < n; i++) {
+		struct ftp_i_listing_builder *cb = &chunks[i].builder;
+		lf_only += chunks[i].lf_only;
+		if (cb->error != 0 && b->error == 0)
+			b->error = cb->error;
+		if (!cb->start)
+			continue;
+		if (b->current)
+			b->current->next = cb->start;
+		else
+			b->start = cb->start;
+		b->current = cb->current;
+		b->itemscount += cb->itemscount;
+	}
+	FTP_LOG("parsed listing on %i threads\n", n);
+	return lf_only;
+}
+
+ftp_content_listing *ftp_i_read_mlsd_answer(ftp_i_managed_buffer *buffer, unsigned int facts, const ftp_listing_filter *filter, int *items_count, int *error)
+{
+	struct ftp_i_listing_builder b = {NULL, NULL, 0, 0, facts, filter};
 
 #ifdef FTP_CONTENTLISTING_VERBOSE
 	printf("Content Listing Raw data following. -------------\n");
 	ftp_i_managed_buffer_print(buffer, ftp_bfalse);
 #endif
 
-	for_sep(fs, (char*)buffer->buffer, FTP_CNL, {
-		if (strlen(fs) == 0)
-			continue;
+	if (ftp_i_parse_lines(ftp_i_managed_buffer_cbuf(buffer), ftp_i_managed_buffer_length(buffer),
+		ftp_i_append_mlsd_line, &b) > 0)
+		/* instead of using \r\n to separate lines, some servers use \n (which is against specification
+		 * but whatever). */
+		FTP_WARN("[MLSD] feature does not comply with specification: uses \\n instead of \\r\\n\n");
 
-		int i = 0;
-		while (*(fs+i) != ' ') {
-			if (*(fs+i) == '\0')
-				continue;
-			i++;
-		}
-		if (!current) {
-			current = ftp_i_mkcontentlisting();
-			start = current;
-		} else {
-			current->next = ftp_i_mkcontentlisting();
-			current = current->next;
-		}
-		if (!current) {
-			ftp_i_free(fs);
-			*error = FTP_ECOULDNOTALLOCATE;
-			return NULL;
-		}
+	if (b.error != 0) {
+		if (b.start)
+			ftp_free(b.start);
+		*error = b.error;
+		return NULL;
+	}
 
-		char *filename = fs + i + 1;
-		char server_used_wrong_separator = 1;
-		for (char *ptr = filename; *ptr; ptr++) {
-			/* instead of using \r\n to separate lines, some servers use \n (which is against specification
-			 * but whatever). this is a fix for this. */
-			if (*ptr == '\r' && *(ptr+1) == '\0') {
-				server_used_wrong_separator = 0;
-				*ptr = '\0';
-			}
-		}
-		if (server_used_wrong_separator)
-			FTP_WARN("[MLSD] feature does not comply with specification: uses \\n instead of \\r\\n\n");
-		ftp_i_strcpy_malloc(current->filename, fs + i + 1);
-
-		if (!current->filename) {
-			FTP_ERR("Could not allocate filename buffer.\n");
-			ftp_free(start);
-			ftp_i_free(fs);
-			*error = FTP_ECOULDNOTALLOCATE;
-			return NULL;
-		}
-		*(fs+i-1) = '\0';
-		if (!ftp_i_applyfacts(fs,&(current->facts))) {
-			FTP_ERR("[MLSD] Invalid answer.\n");
-			ftp_free(start);
-			ftp_i_free(fs);
-			*error = FTP_EINVALID;
-			return NULL;
-		}
-		itemscount++;
-	});
+	*items_count = b.itemscount;
+	FTP_LOG("parsed %i mlsd entries\n",b.itemscount);
+	return b.start;
+}
 
-	*items_count = itemscount;
-	FTP_LOG("parsed %i mlsd entries\n",itemscount);
-	return start;
+static ftp_bool ftp_i_append_list_line(char *line, size_t len, void *context)
+{
+	ftp_content_listing entry;
+	memset(&entry, 0, sizeof(entry));
+	struct ftp_i_listing_builder *b = context;
+	if (len == 0 || !ftp_i_parse_list_line(line, (int)len, &b->now, &entry))
+		/* ftpparse does not understand e.g. "total" lines, skip them. */
+		return ftp_btrue;
+	return ftp_i_listing_builder_add(b, &entry);
 }
 
-ftp_content_listing *ftp_i_read_list_answer(ftp_i_managed_buffer *buffer, int *items_count, int *error)
+ftp_content_listing *ftp_i_read_list_answer(ftp_i_managed_buffer *buffer, const ftp_listing_filter *filter, int *items_count, int *error)
 {
 #ifndef FTPPARSE_H
 	*error = FTP_ENOTSUPPORTED;
 	return NULL;
 #endif
 
-	int itemscount = 0;
-	ftp_content_listing *start = NULL, *current = NULL;
-	ftp_i_managed_buffer *filename_buffer;
 	/* LIST is supported for compatibility reasons.
 	 * this uses ftpparse (http://cr.yp.to/ftpparse.html) by D. J. Bernstein. */
-	char *buf = buffer->buffer;
-	/* I don't know whether there are servers that terminate lines with LF only,
-	 * so this will check it. */
-	int p = 0;
+	struct ftp_i_listing_builder b = {NULL, NULL, 0, 0, ~0u, filter};
+	ftp_i_time_context_init(&b.now);
 
 #ifdef FTP_CONTENTLISTING_VERBOSE
 	printf("Content Listing Raw data following. -------------\n");
 	ftp_i_managed_buffer_print(buffer, ftp_bfalse);
 #endif
 
-	while (*(buf+p) != '\n') {
-		if (*(buf+p) == '\0')
-			/* this is only one line, so it does not matter. */
-			break;
-		p++;
+	/* Lines may be terminated by CRLF or LF only. */
+	ftp_i_parse_lines(ftp_i_managed_buffer_cbuf(buffer), ftp_i_managed_buffer_length(buffer),
+		ftp_i_append_list_line, &b);
+
+	if (b.error != 0) {
+		if (b.start)
+			ftp_free(b.start);
+		*error = b.error;
+		return NULL;
 	}
-	char *sep = (*(buf+(p-1)) == '\r') ? "\r\n" : "\n";
 
-	for_sep(fs, buf, sep, {
-		ssize_t len = strlen(fs);
-		if (len == 0)
-			continue;
-		struct ftpparse fp;
-		if (ftpparse(&fp, fs, (int)len)) {
-			if (!current) {
-				current = ftp_i_mkcontentlisting();
-				start = current;
-			} else {
-				current->next = ftp_i_mkcontentlisting();
-				current = current->next;
-			}
-			if (!current) {
-				ftp_i_free(fs);
-				*error = FTP_ECOULDNOTALLOCATE;
-				return NULL;
-			}
+	*items_count = b.itemscount;
+	FTP_LOG("parsed %i list entries\n",b.itemscount);
+	return b.start;
+}
 
-			filename_buffer = ftp_i_managed_buffer_new();
-			if (ftp_i_managed_buffer_append(filename_buffer, (void*)fp.name, fp.namelen) != FTP_OK) {
-				ftp_free(start);
-				ftp_i_managed_buffer_free(filename_buffer);
-				ftp_i_free(fs);
-				*error = FTP_ECOULDNOTALLOCATE;
-				return NULL;
-			}
-			current->filename = ftp_i_managed_buffer_disassemble(filename_buffer);
-			if (fp.unix_permissions[0] != 0) {
-				ftp_bool dir;
-				current->facts.unixgroup = ftp_i_unix_mode_from_string(fp.unix_permissions, &dir);
-				current->facts.type = dir ? ft_dir : ft_file;
-			} else {
-				//can only guess type
-				current->facts.type = fp.flagtrycwd ? ft_dir : ft_file;
+/*
+ * Parses a listing that was written to file (see listing_spill). The file is read in
+ * chunks, so besides the entries only a chunk and an incomplete line are held in
+ * memory. The chunk grows for longer lines up to max_line bytes (0 = no limit),
+ * longer lines fail with FTP_ELISTINGTOOLARGE.
+ */
+ftp_content_listing *ftp_i_read_listing_file(FILE *file, ftp_bool mlsd, unsigned int facts, const ftp_listing_filter *filter, size_t max_line, int *items_count, int *error)
+{
+#ifndef FTPPARSE_H
+	if (!mlsd) {
+		*error = FTP_ENOTSUPPORTED;
+		return NULL;
+	}
+#endif
+
+	struct ftp_i_listing_builder b = {NULL, NULL, 0, 0, mlsd ? facts : ~0u, filter};
+	ftp_i_line_handler handler = mlsd ? ftp_i_append_mlsd_line : ftp_i_append_list_line;
+	ftp_i_time_context_init(&b.now);
+
+	/* One more byte for the terminator of a last line without line break. */
+	size_t size = FTP_SPILL_CHUNK_SIZE, used = 0;
+	char *chunk = malloc(size + 1);
+	if (!chunk) {
+		*error = FTP_ECOULDNOTALLOCATE;
+		return NULL;
+	}
+
+	for (;;) {
+		size_t n = fread(chunk + used, 1, size - used, file);
+		if (n == 0) {
+			if (ferror(file))
+				b.error = FTP_ELOCALFILE;
+			else if (used > 0)
+				ftp_i_for_each_line(chunk, used, handler, &b);
+			break;
+		}
+		used += n;
+
+		size_t complete = used;
+		while (complete > 0 && chunk[complete - 1] != '\n')
+			complete--;
+		if (complete == 0) {
+			if (used < size)
+				continue;
+			/* A single line fills the whole chunk. */
+			if (max_line && size >= max_line) {
+				b.error = FTP_ELISTINGTOOLARGE;
+				break;
 			}
-			/*current->facts.modify.type = fp.mtimetype;
-			if (current->facts.modify.type != tt_notgiven) {
-				current->facts.modify.time.timedate = fp.mtime;
-			}*/
-			current->facts.size = (unsigned long)fp.size;
-			if (fp.mtime_given) {
-				current->facts.modify = fp.mtime;
-				current->facts.given.modify = ftp_btrue;
+			char *larger = realloc(chunk, size * 2 + 1);
+			if (!larger) {
+				b.error = FTP_ECOULDNOTALLOCATE;
+				break;
 			}
-			itemscount++;
+			chunk = larger;
+			size *= 2;
+			continue;
 		}
-	});
 
-	*items_count = itemscount;
-	FTP_LOG("parsed %i list entries\n",itemscount);
-	return start;
+		ftp_i_for_each_line(chunk, complete, handler, &b);
+		if (b.error != 0)
+			break;
+		memmove(chunk, chunk + complete, used - complete);
+		used -= complete;
+	}
+	free(chunk);
+
+	if (b.error != 0) {
+		if (b.start)
+			ftp_free(b.start);
+		*error = b.error;
+		return NULL;
+	}
+
+	*items_count = b.itemscount;
+	FTP_LOG("parsed %i entries from a spilled listing\n",b.itemscount);
+	return b.start;
+}
+
+/*
+ * Makes path (the path buffer of the recursive listing) large enough for size bytes.
+ */
+static ftp_bool ftp_i_recursive_listing_reserve(struct ftp_i_recursive_listing *r, size_t size)
+{
+	if (size <= r->path_size)
+		return ftp_btrue;
+	size_t newsize = r->path_size ? r->path_size : 256;
+	while (newsize < size)
+		newsize *= 2;
+	char *path = realloc(r->path, newsize);
+	if (!path)
+		return ftp_bfalse;
+	r->path = path;
+	r->path_size = newsize;
+	return ftp_btrue;
+}
+
+/*
+ * Sets the directory of the following entries, e.g. "./dir/sub", "dir/sub" or
+ * "/root/dir/sub" (from a header line or ftp_walk). The listed root itself is left out.
+ */
+ftp_bool ftp_i_recursive_listing_directory(struct ftp_i_recursive_listing *r, const char *dir, size_t len)
+{
+	if (r->root) {
+		size_t rootlen = strlen(r->root);
+		while (rootlen > 1 && r->root[rootlen - 1] == '/')
+			rootlen--;
+		if (len >= rootlen && strncmp(dir, r->root, rootlen) == 0 &&
+			(len == rootlen || dir[rootlen] == '/' || dir[rootlen - 1] == '/')) {
+			dir += rootlen;
+			len -= rootlen;
+		}
+	}
+	if (len >= 2 && dir[0] == '.' && dir[1] == '/') {
+		dir += 2;
+		len -= 2;
+	} else if (len == 1 && dir[0] == '.') {
+		len = 0;
+	}
+	while (len > 0 && dir[0] == '/') {
+		dir++;
+		len--;
+	}
+	while (len > 0 && dir[len - 1] == '/')
+		len--;
+
+	if (!ftp_i_recursive_listing_reserve(r, len + 1)) {
+		r->error = FTP_ECOULDNOTALLOCATE;
+		return ftp_bfalse;
+	}
+	memcpy(r->path, dir, len);
+	r->path[len] = '\0';
+	r->prefix_len = len;
+	return ftp_btrue;
+}
+
+/*
+ * Appends entry (a name in the current directory) to r->result with its path relative
+ * to the listed directory as filename. "." and ".." are skipped.
+ */
+ftp_bool ftp_i_recursive_listing_add(struct ftp_i_recursive_listing *r, ftp_content_listing *entry)
+{
+	if (strcmp(entry->filename, ".") == 0 || strcmp(entry->filename, "..") == 0)
+		return ftp_btrue;
+	if (r->filter && !ftp_i_clfilter_keepthis(entry))
+		return ftp_btrue;
+
+	ftp_content_listing item = *entry;
+	if (r->prefix_len > 0) {
+		size_t namelen = strlen(entry->filename);
+		if (!ftp_i_recursive_listing_reserve(r, r->prefix_len + namelen + 2))
+			goto alloc_error;
+		r->path[r->prefix_len] = '/';
+		memcpy(r->path + r->prefix_len + 1, entry->filename, namelen + 1);
+		item.filename = r->path;
+	}
+	if (ftp_i_content_array_append(r->result, &item) != FTP_OK)
+		goto alloc_error;
+	return ftp_btrue;
+
+alloc_error:
+	r->error = FTP_ECOULDNOTALLOCATE;
+	return ftp_bfalse;
+}
+
+/*
+ * Line handler for LIST -R answers (ls -R format): blocks of LIST lines, each but the
+ * first introduced by an empty line and a "directory:" header.
+ */
+ftp_bool ftp_i_parse_recursive_list_line(char *line, size_t len, void *context)
+{
+	struct ftp_i_recursive_listing *r = context;
+
+	if (len == 0) {
+		r->block_start = ftp_btrue;
+		return ftp_btrue;
+	}
+	if (r->block_start && line[len - 1] == ':') {
+		r->block_start = ftp_bfalse;
+		/* Some servers start with a header of the listed directory itself. */
+		if (r->started)
+			r->saw_header = ftp_btrue;
+		r->started = ftp_btrue;
+		return ftp_i_recursive_listing_directory(r, line, len - 1);
+	}
+	r->block_start = ftp_bfalse;
+	r->started = ftp_btrue;
+
+	ftp_content_listing entry;
+	memset(&entry, 0, sizeof(entry));
+	if (!ftp_i_parse_list_line(line, (int)len, &r->now, &entry))
+		return ftp_btrue;
+	if (!r->saw_header && entry.facts.type == ft_dir &&
+		strcmp(entry.filename, ".") != 0 && strcmp(entry.filename, "..") != 0)
+		r->saw_subdirectory = ftp_btrue;
+	return ftp_i_recursive_listing_add(r, &entry);
+}
+
+struct ftp_i_stat_answer {
+	char *out;
+	unsigned long lines;
+	ftp_bool has_entry;
+	ftp_i_time_context now;
+};
+
+static ftp_bool ftp_i_compact_stat_line(char *line, size_t len, void *context)
+{
+	struct ftp_i_stat_answer *s = context;
+
+	/* Lines may be indented or carry the reply code ("213-") as well. */
+	while (len > 0 && *line == ' ') {
+		line++;
+		len--;
+	}
+	if (len >= 4 && isdigit(line[0]) && isdigit(line[1]) && isdigit(line[2]) && line[3] == '-') {
+		line += 4;
+		len -= 4;
+	}
+	if (len == 0)
+		return ftp_btrue;
+
+	if (strncmp(line, "total ", 6) != 0)
+		s->lines++;
+	if (!s->has_entry) {
+		struct ftpparse fp;
+		s->has_entry = ftpparse(&fp, line, (int)len, &s->now) != 0;
+	}
+
+	memmove(s->out, line, len);
+	s->out += len;
+	*s->out++ = '\n';
+	return ftp_btrue;
+}
+
+/*
+ * Turns the text of a multi-line STAT answer into a LIST answer in place. Returns
+ * the number of lines except "total" lines; has_entry tells whether any of them is a
+ * LIST entry. If not, the server sent something else than a listing.
+ */
+unsigned long ftp_i_stat_answer_to_list_answer(ftp_i_managed_buffer *buf, ftp_bool *has_entry)
+{
+	char *start = ftp_i_managed_buffer_cbuf(buf);
+	struct ftp_i_stat_answer s = {start, 0, ftp_bfalse};
+	ftp_i_time_context_init(&s.now);
+
+	ftp_i_for_each_line(start, ftp_i_managed_buffer_length(buf), ftp_i_compact_stat_line, &s);
+	buf->length = s.out - start;
+	*s.out = '\0';
+
+	*has_entry = s.has_entry;
+	return s.lines;
 }
@@ -32,6 +32,7 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <time.h>
+#include <stdint.h>
 
 #include "ftperrors.h"
 
@@ -51,10 +52,39 @@
 typedef char                 ftp_status;
 typedef unsigned char        ftp_activity;
 typedef unsigned char        ftp_bool;
+/* File sizes and positions, 64 bits wide on every platform. */
+typedef uint64_t             ftp_offset;
 
+/*
+ * Server capabilities. Queued connections share the features of their root
+ * connection, so capabilities are only learned once per server.
+ */
 struct ftp_features {
 	ftp_bool use_epsv;
 	ftp_bool use_mlsd;
+
+	/* FEAT was sent (feat_requested) and understood by the server (feat_supported).
+	 * The values below are only valid if feat_supported is set. */
+	ftp_bool feat_requested;
+	ftp_bool feat_supported;
+	ftp_bool has_epsv;
+	ftp_bool has_mlst;
+	ftp_bool has_size;
+	ftp_bool has_mdtm;
+	ftp_bool has_rest_stream;
+	ftp_bool has_utf8;
+	ftp_bool has_mode_z;
+	ftp_bool has_hash;
+	/* FTP_FACT_* values the server knows and the ones it sends by default: */
+	unsigned int mlst_facts;
+	unsigned int mlst_default_facts;
+
+	/* LIST -R was tried (list_recursive_probed) and lists recursively: */
+	ftp_bool list_recursive_probed;
+	ftp_bool has_list_recursive;
+	/* STAT <path> was tried (stat_listing_probed) and answers with a listing: */
+	ftp_bool stat_listing_probed;
+	ftp_bool has_stat_listing;
 };
 
 enum ftp_bools {
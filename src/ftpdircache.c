@@ -0,0 +1,298 @@
+/*   libmftp
+ *
+ *   Copyright (c) 2014 nkreipke
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "ftpfunctions.h"
+
+/*
+ * Directory listing cache. It is shared by a connection and its queued connections and
+ * keyed by the absolute path of the listed directory (as reported by PWD). Entries are
+ * kept as content arrays and copied on every hit, so callers own their results.
+ */
+
+struct ftp_i_dir_cache_entry {
+	char *path;
+	struct timeval stored;
+	ftp_content_array *listing;
+	struct ftp_i_dir_cache_entry *next;
+};
+
+struct ftp_i_dir_cache {
+	pthread_mutex_t lock;
+	unsigned int references;
+	struct ftp_i_dir_cache_entry *entries;
+};
+
+static struct ftp_i_dir_cache *ftp_i_dir_cache_get(ftp_connection *c, ftp_bool create)
+{
+	if (!c->_dir_cache && create) {
+		struct ftp_i_dir_cache *cache = calloc(1, sizeof(struct ftp_i_dir_cache));
+		if (!cache)
+			return NULL;
+		pthread_mutex_init(&cache->lock, NULL);
+		cache->references = 1;
+		c->_dir_cache = cache;
+	}
+	return c->_dir_cache;
+}
+
+static void ftp_i_dir_cache_free_entry(struct ftp_i_dir_cache_entry *e)
+{
+	ftp_i_free(e->path);
+	ftp_free_array(e->listing);
+	ftp_i_free(e);
+}
+
+void ftp_i_dir_cache_share(ftp_connection *parent, ftp_connection *child)
+{
+	child->listing_cache_ttl = parent->listing_cache_ttl;
+	/* Without caching there is nothing to share. */
+	if (parent->listing_cache_ttl == 0)
+		return;
+
+	struct ftp_i_dir_cache *cache = ftp_i_dir_cache_get(parent, ftp_btrue);
+	if (!cache || child->_dir_cache == cache)
+		return;
+	pthread_mutex_lock(&cache->lock);
+	cache->references++;
+	pthread_mutex_unlock(&cache->lock);
+	ftp_i_dir_cache_release(child);
+	child->_dir_cache = cache;
+}
+
+void ftp_i_dir_cache_release(ftp_connection *c)
+{
+	struct ftp_i_dir_cache *cache = c->_dir_cache;
+	if (!cache)
+		return;
+	c->_dir_cache = NULL;
+
+	pthread_mutex_lock(&cache->lock);
+	unsigned int references = --cache->references;
+	pthread_mutex_unlock(&cache->lock);
+	if (references > 0)
+		return;
+
+	while (cache->entries) {
+		struct ftp_i_dir_cache_entry *next = cache->entries->next;
+		ftp_i_dir_cache_free_entry(cache->entries);
+		cache->entries = next;
+	}
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+/* The current directory as cache key, NULL if it changed since it was last loaded. */
+const char *ftp_i_dir_cache_key(ftp_connection *c)
+{
+	return c->_cur_directory_stale ? NULL : c->cur_directory;
+}
+
+/* Returns the entry for path if it has not expired. Expired entries are removed.
+ * The cache has to be locked. */
+static struct ftp_i_dir_cache_entry *ftp_i_dir_cache_find(ftp_connection *c, struct ftp_i_dir_cache *cache, const char *path)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+
+	struct ftp_i_dir_cache_entry **e = &cache->entries;
+	while (*e) {
+		struct ftp_i_dir_cache_entry *current = *e;
+		if ((unsigned long)(now.tv_sec - current->stored.tv_sec) >= c->listing_cache_ttl) {
+			*e = current->next;
+			ftp_i_dir_cache_free_entry(current);
+			continue;
+		}
+		if (strcmp(current->path, path) == 0)
+			return current;
+		e = &current->next;
+	}
+	return NULL;
+}
+
+/*
+ * Looks up the listing of the current directory. Returns true on a hit and stores a copy in
+ * *listing (NULL for an empty directory). A copy that cannot be allocated counts as a miss.
+ */
+ftp_bool ftp_i_dir_cache_get_listing(ftp_connection *c, ftp_content_listing **listing, int *items_count)
+{
+	struct ftp_i_dir_cache *cache = ftp_i_dir_cache_get(c, ftp_bfalse);
+	if (!cache || !ftp_i_dir_cache_key(c))
+		return ftp_bfalse;
+
+	ftp_bool hit = ftp_bfalse;
+	pthread_mutex_lock(&cache->lock);
+	struct ftp_i_dir_cache_entry *e = ftp_i_dir_cache_find(c, cache, ftp_i_dir_cache_key(c));
+	if (e) {
+		*listing = ftp_content_array_to_listing(e->listing);
+		*items_count = (int)e->listing->count;
+		hit = (*listing || e->listing->count == 0);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	if (hit)
+		FTP_LOG("Listing of %s taken from cache.\n", c->cur_directory);
+	return hit;
+}
+
+ftp_content_array *ftp_i_dir_cache_get_array(ftp_connection *c)
+{
+	struct ftp_i_dir_cache *cache = ftp_i_dir_cache_get(c, ftp_bfalse);
+	if (!cache || !ftp_i_dir_cache_key(c))
+		return NULL;
+
+	ftp_content_array *result = NULL;
+	pthread_mutex_lock(&cache->lock);
+	struct ftp_i_dir_cache_entry *e = ftp_i_dir_cache_find(c, cache, ftp_i_dir_cache_key(c));
+	if (e)
+		result = ftp_i_content_array_copy(e->listing);
+	pthread_mutex_unlock(&cache->lock);
+
+	if (result)
+		FTP_LOG("Listing of %s taken from cache.\n", c->cur_directory);
+	return result;
+}
+
+/* Stores the listing of the current directory, the cache takes ownership of listing. */
+void ftp_i_dir_cache_store(ftp_connection *c, ftp_content_array *listing)
+{
+	struct ftp_i_dir_cache *cache = ftp_i_dir_cache_get(c, ftp_btrue);
+	struct ftp_i_dir_cache_entry *e = NULL;
+	if (cache && ftp_i_dir_cache_key(c) && (e = calloc(1, sizeof(struct ftp_i_dir_cache_entry))))
+		ftp_i_strcpy_malloc(e->path, c->cur_directory);
+	if (!e || !e->path) {
+		ftp_i_free(e);
+		ftp_free_array(listing);
+		return;
+	}
+	e->listing = listing;
+	gettimeofday(&e->stored, NULL);
+
+	pthread_mutex_lock(&cache->lock);
+	struct ftp_i_dir_cache_entry *old = ftp_i_dir_cache_find(c, cache, e->path);
+	if (old) {
+		ftp_free_array(old->listing);
+		old->listing = e->listing;
+		old->stored = e->stored;
+		e->listing = NULL;
+	} else {
+		e->next = cache->entries;
+		cache->entries = e;
+		e = NULL;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	if (e)
+		ftp_i_dir_cache_free_entry(e);
+}
+
+/* Appends path to the absolute directory dir and drops "." components and trailing
+ * slashes. Returns NULL if the result cannot be determined (e.g. ".." components). */
+char *ftp_i_resolve_path(const char *dir, const char *path)
+{
+	size_t dirlen = (path[0] == '/' || !dir) ? 0 : strlen(dir);
+	if (path[0] != '/' && !dir)
+		return NULL;
+	char *result = malloc(dirlen + strlen(path) + 2);
+	if (!result)
+		return NULL;
+
+	memcpy(result, dir, dirlen);
+	size_t len = dirlen;
+	while (len > 0 && result[len - 1] == '/')
+		len--;
+
+	const char *p = path;
+	while (*p) {
+		while (*p == '/')
+			p++;
+		const char *end = strchr(p, '/');
+		size_t complen = end ? (size_t)(end - p) : strlen(p);
+		if (complen == 2 && p[0] == '.' && p[1] == '.') {
+			free(result);
+			return NULL;
+		}
+		if (complen > 0 && !(complen == 1 && p[0] == '.')) {
+			result[len++] = '/';
+			memcpy(result + len, p, complen);
+			len += complen;
+		}
+		p += complen;
+	}
+	if (len == 0)
+		result[len++] = '/';
+	result[len] = '\0';
+	return result;
+}
+
+/*
+ * Drops cached listings affected by a change of path (relative to the current directory):
+ * the listing of its parent directory and, if with_contents is set, the listings of path
+ * itself and everything below it. Drops everything if path cannot be resolved.
+ */
+void ftp_i_dir_cache_invalidate(ftp_connection *c, const char *path, ftp_bool with_contents)
+{
+	struct ftp_i_dir_cache *cache = ftp_i_dir_cache_get(c, ftp_bfalse);
+	if (!cache)
+		return;
+
+	char *resolved = path ? ftp_i_resolve_path(ftp_i_dir_cache_key(c), path) : NULL;
+	size_t len = resolved ? strlen(resolved) : 0;
+	/* length of the parent directory of resolved ("/" for top level items) */
+	size_t parentlen = len;
+	while (parentlen > 0 && resolved[parentlen - 1] != '/')
+		parentlen--;
+	if (parentlen > 1)
+		parentlen--;
+
+	pthread_mutex_lock(&cache->lock);
+	struct ftp_i_dir_cache_entry **e = &cache->entries;
+	while (*e) {
+		struct ftp_i_dir_cache_entry *current = *e;
+		const char *key = current->path;
+		ftp_bool drop = !resolved ||
+			(strlen(key) == parentlen && strncmp(key, resolved, parentlen) == 0) ||
+			(with_contents && strncmp(key, resolved, len) == 0 &&
+				(key[len] == '\0' || key[len] == '/' || len == 1));
+		if (drop) {
+			*e = current->next;
+			ftp_i_dir_cache_free_entry(current);
+		} else {
+			e = &current->next;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	ftp_i_free(resolved);
+}
+
+void ftp_flush_listing_cache(ftp_connection *c)
+{
+	ftp_i_dir_cache_invalidate(c, NULL, ftp_bfalse);
+}
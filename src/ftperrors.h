@@ -39,6 +39,7 @@
 #define FTP_ETIMEOUT 11
 
 #define FTP_EWRITE 20
+#define FTP_ELOCALFILE 21
 
 #define FTP_EUNEXPECTED 100
 #define FTP_ETOOLONG 101
@@ -47,6 +48,8 @@
 #define FTP_ENOTFOUND_OR_NOTEMPTY 104
 #define FTP_EINVALID 105
 #define FTP_ESERVERCAPABILITIES 106
+#define FTP_ELISTINGTOOLARGE 107
+#define FTP_EREPLYTOOLARGE 108
 
 #define FTP_EALREADY 110
 #define FTP_EARGUMENTS 112
@@ -26,11 +26,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <inttypes.h>
 #include "ftpfunctions.h"
 #include "ftpsignals.h"
 #include "ftpcommands.h"
 
-ftp_status ftp_reload_cur_directory(ftp_connection *c)
+static ftp_bool ftp_i_item_exists(ftp_connection *, char *, ftp_content_listing **);
+
+static ftp_status ftp_i_reload_cur_directory(ftp_connection *c)
 {
 	if (!ftp_i_connection_is_ready(c)) {
 		ftp_i_connection_set_error(c, FTP_ENOTREADY);
@@ -50,11 +53,12 @@ ftp_status ftp_reload_cur_directory(ftp_connection *c)
 		ftp_i_connection_set_error(c, result);
 		return FTP_ERROR;
 	}
+	c->_cur_directory_stale = ftp_bfalse;
 
 	return FTP_OK;
 }
 
-ftp_status ftp_change_cur_directory(ftp_connection *c, char *path)
+static ftp_status ftp_i_change_cur_directory(ftp_connection *c, char *path)
 {
 	if (!ftp_i_connection_is_ready(c)) {
 		ftp_i_connection_set_error(c, FTP_ENOTREADY);
@@ -63,83 +67,321 @@ ftp_status ftp_change_cur_directory(ftp_connection *c, char *path)
 
 	ftp_i_set_input_trigger(c, FTP_SIGNAL_REQUESTED_ACTION_OKAY);
 
-	return ftp_i_send_command_and_wait_for_triggers(c, FTP_CCWD, path, NULL, FTP_EUNEXPECTED, NULL);
+	if (ftp_i_send_command_and_wait_for_triggers(c, FTP_CCWD, path, NULL, FTP_EUNEXPECTED, NULL) != FTP_OK)
+		return FTP_ERROR;
+
+	ftp_i_invalidate_listing_cache(c);
+	/* Queued connections follow on their next use. */
+	c->_directory_generation++;
+
+	/* A reconnect and the directory cache have to know the absolute path of the
+	 * current directory. */
+	if (c->reconnect_attempts > 0 || c->listing_cache_ttl > 0)
+		return ftp_i_reload_cur_directory(c);
+	/* cur_directory keeps the old path until it is reloaded, but must not be used as
+	 * a cache key later on. */
+	c->_cur_directory_stale = ftp_btrue;
+	return FTP_OK;
 }
 
-ftp_content_listing *ftp_contents_of_directory(ftp_connection *c, int *items_count)
+/*
+ * Asks the server to send only the given facts (FTP_FACT_* values, 0 for its defaults)
+ * in MLSD and MLST answers. Facts the server does not know are left out. Failing is not
+ * an error, the server then just sends more than needed.
+ */
+static void ftp_i_select_facts(ftp_connection *c, unsigned int facts)
+{
+	struct ftp_features *f = c->_current_features;
+	if (!f->feat_supported || !f->has_mlst)
+		return;
+
+	facts = facts ? (facts | FTP_FACT_TYPE) & f->mlst_facts : f->mlst_default_facts;
+	if (facts == (c->_mlst_facts ? c->_mlst_facts : f->mlst_default_facts))
+		return;
+
+	char list[FTP_FACT_LIST_MAX];
+	ftp_i_fact_list(facts, list);
+	ftp_i_set_input_trigger(c, FTP_SIGNAL_COMMAND_OKAY);
+	if (ftp_i_send_command_and_wait_for_triggers(c, FTP_COPTS, FTP_COPTS_MLST, list, 0, NULL) != FTP_OK)
+		FTP_WARN("Server did not accept OPTS MLST %s\n", list);
+	c->_mlst_facts = facts;
+}
+
+/* Switches to ASCII mode and establishes the data connection for a listing. */
+static ftp_status ftp_i_begin_listing(ftp_connection *c)
 {
 	if (!ftp_i_data_connection_is_ready(c) || !ftp_i_connection_is_ready(c)) {
 		ftp_i_connection_set_error(c, FTP_ENOTREADY);
-		return NULL;
+		return FTP_ERROR;
 	}
 
 	if (ftp_i_set_transfer_type(c, ftp_tt_ascii) != FTP_OK)
-		return NULL;
+		return FTP_ERROR;
 
-	if (ftp_i_establish_data_connection(c) != FTP_OK)
-		return NULL;
+	return ftp_i_establish_data_connection(c);
+}
 
-	ftp_bool remote_error,
-		use_mlsd = c->_current_features->use_mlsd;
+/* Sends a command whose answer is transferred on the established data connection. */
+static ftp_status ftp_i_send_listing_command(ftp_connection *c, char *cmd, char *arg1, char *arg2, ftp_bool *remote_error)
+{
+	ftp_i_set_input_trigger(c, FTP_SIGNAL_ABOUT_TO_OPEN_DATA_CONNECTION);
+	ftp_i_set_input_trigger(c, FTP_SIGNAL_DATA_CONNECTION_OPEN_STARTING_TRANSFER);
+	ftp_i_begin_transfer(c);
 
-	while (1) {
-		ftp_i_set_input_trigger(c, FTP_SIGNAL_ABOUT_TO_OPEN_DATA_CONNECTION);
-		ftp_i_set_input_trigger(c, FTP_SIGNAL_DATA_CONNECTION_OPEN_STARTING_TRANSFER);
+	return ftp_i_send_command_and_wait_for_triggers(c, cmd, arg1, arg2, 0, remote_error);
+}
 
-		if (ftp_i_send_command_and_wait_for_triggers(c,
-			(use_mlsd ? FTP_CMLSD : FTP_CLIST), NULL, NULL, 0, &remote_error) != FTP_OK) {
-			if (remote_error || !use_mlsd) {
-				ftp_i_close_data_connection(c);
-				ftp_i_connection_set_error(c, FTP_EUNEXPECTED);
-				return NULL;
-			}
+/*
+ * Sends MLSD (or LIST if MLSD is not supported) and prepares the data connection
+ * for reading the listing. path is the directory to list, NULL for the current one.
+ * facts are the FTP_FACT_* values to ask for (0 for the server defaults).
+ */
+static ftp_status ftp_i_open_listing(ftp_connection *c, const char *path, unsigned int facts, ftp_bool *mlsd)
+{
+	if (c->_current_features->use_mlsd)
+		ftp_i_select_facts(c, facts);
 
-			/* Use legacy LIST mode */
-			use_mlsd = ftp_bfalse;
-		} else {
-			break;
+	if (ftp_i_begin_listing(c) != FTP_OK)
+		return FTP_ERROR;
+
+	ftp_bool remote_error,
+		use_mlsd = c->_current_features->use_mlsd;
+
+	while (ftp_i_send_listing_command(c, (use_mlsd ? FTP_CMLSD : FTP_CLIST), (char *)path, NULL, &remote_error) != FTP_OK) {
+		if (remote_error && path && c->last_signal == FTP_SIGNAL_FILE_ERROR) {
+			/* The directory does not exist, this says nothing about MLSD support. */
+			ftp_i_close_data_connection(c);
+			ftp_i_connection_set_error(c, FTP_ENOTFOUND);
+			return FTP_ERROR;
 		}
+		if (!remote_error || !use_mlsd) {
+			ftp_i_close_data_connection(c);
+			ftp_i_connection_set_error(c, FTP_EUNEXPECTED);
+			return FTP_ERROR;
+		}
+
+		/* Use legacy LIST mode */
+		use_mlsd = ftp_bfalse;
 	}
 
-	c->_current_features->use_mlsd = use_mlsd;
+	/* The features are shared with queued connections that may list at the same time. */
+	if (c->_current_features->use_mlsd != use_mlsd)
+		c->_current_features->use_mlsd = use_mlsd;
 
 	if (ftp_i_prepare_data_connection(c) != FTP_OK) {
 		ftp_i_close_data_connection(c);
-		return NULL;
+		return FTP_ERROR;
 	}
 
-	ftp_i_managed_buffer *buf;
-	if (!(buf = ftp_i_managed_buffer_new())) {
-		ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
-		return NULL;
+	*mlsd = use_mlsd;
+	return FTP_OK;
+}
+
+/* Whether listings should be tried with STAT, see control_connection_listing. */
+static ftp_bool ftp_i_use_stat_listing(ftp_connection *c)
+{
+	struct ftp_features *f = c->_current_features;
+	return c->control_connection_listing && (!f->stat_listing_probed || f->has_stat_listing);
+}
+
+/*
+ * Lists path (NULL for the current directory) with STAT over the control connection.
+ * *buf is set to a LIST answer. Sets FTP_ESERVERCAPABILITIES if the answer is no
+ * usable listing or larger than max_reply_size, the caller then has to list over a
+ * data connection.
+ */
+static ftp_status ftp_i_stat_listing(ftp_connection *c, const char *path, ftp_i_managed_buffer **buf)
+{
+	struct ftp_features *f = c->_current_features;
+
+	if (!ftp_i_connection_is_ready(c)) {
+		ftp_i_connection_set_error(c, FTP_ENOTREADY);
+		return FTP_ERROR;
 	}
 
-	ftp_status result = ftp_i_read_data_connection_into_buffer(c, buf);
+	/* The answer code differs between servers. */
+	ftp_i_set_input_trigger(c, FTP_SIGNAL_SYSTEM_STATUS);
+	ftp_i_set_input_trigger(c, FTP_SIGNAL_DIRECTORY_STATUS);
+	ftp_i_set_input_trigger(c, FTP_SIGNAL_FILE_STATUS);
+	c->_last_answer_lock_signal = FTP_INTERNAL_SIGNAL_STATUS;
 
-	ftp_i_close_data_connection(c);
+	/* Without an argument, STAT describes the connection. */
+	ftp_bool remote_error;
+	ftp_status result = ftp_i_send_command_and_wait_for_triggers(c, FTP_CSTAT, (char *)(path ? path : "."), NULL, 0, &remote_error);
+	c->_last_answer_lock_signal = 0;
+	ftp_i_managed_buffer *answer = c->_last_answer_buffer;
+	c->_last_answer_buffer = NULL;
 
 	if (result != FTP_OK) {
-		ftp_i_managed_buffer_free(buf);
+		ftp_i_managed_buffer_free(answer);
+		/* Too large for the control connection, but not for a data connection. */
+		if (c->error == FTP_EREPLYTOOLARGE) {
+			ftp_i_connection_set_error(c, FTP_ESERVERCAPABILITIES);
+			return FTP_ERROR;
+		}
+		if (!remote_error) {
+			ftp_i_connection_set_error(c, FTP_EUNEXPECTED);
+			return FTP_ERROR;
+		}
+		/* A missing directory is reported by the data connection listing. */
+		if (!f->stat_listing_probed && c->last_signal != FTP_SIGNAL_FILE_ERROR) {
+			f->has_stat_listing = ftp_bfalse;
+			f->stat_listing_probed = ftp_btrue;
+		}
+		ftp_i_connection_set_error(c, FTP_ESERVERCAPABILITIES);
+		return FTP_ERROR;
+	}
+
+	ftp_bool has_entry = ftp_bfalse;
+	unsigned long lines = answer ? ftp_i_stat_answer_to_list_answer(answer, &has_entry) : 0;
+
+	if (has_entry) {
+		if (!f->stat_listing_probed) {
+			f->has_stat_listing = ftp_btrue;
+			f->stat_listing_probed = ftp_btrue;
+		}
+	} else if (lines > 0 || !f->has_stat_listing) {
+		/* Some other status text, or an empty answer that could be an empty directory
+		 * but says nothing before STAT listings are known to work. */
+		if (lines > 0 && !f->stat_listing_probed) {
+			f->has_stat_listing = ftp_bfalse;
+			f->stat_listing_probed = ftp_btrue;
+		}
+		ftp_i_managed_buffer_free(answer);
+		ftp_i_connection_set_error(c, FTP_ESERVERCAPABILITIES);
+		return FTP_ERROR;
+	}
+
+	if (!answer && !(answer = ftp_i_managed_buffer_new())) {
+		ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
+		return FTP_ERROR;
+	}
+	*buf = answer;
+	return FTP_OK;
+}
+
+/* Makes sure that the current directory (the directory cache key) is known. */
+static ftp_bool ftp_i_dir_cache_usable(ftp_connection *c)
+{
+	return c->listing_cache_ttl > 0 &&
+		(ftp_i_dir_cache_key(c) || ftp_i_reload_cur_directory(c) == FTP_OK);
+}
+
+/* The FTP_FACT_* values needed to check the conditions of filter. */
+static unsigned int ftp_i_filter_facts(const ftp_listing_filter *filter)
+{
+	unsigned int facts = 0;
+	if (filter->types)
+		facts |= FTP_FACT_TYPE;
+	if (filter->min_size > 0 || filter->max_size > 0)
+		facts |= FTP_FACT_SIZE;
+	if (filter->modified_min != 0 || filter->modified_max != 0)
+		facts |= FTP_FACT_MODIFY;
+	return facts;
+}
+
+/*
+ * The wildcard pattern of filter if it can be sent as LIST argument, otherwise NULL.
+ * MLSD and STAT take no patterns, and LIST would take a leading '-' for options.
+ */
+static const char *ftp_i_filter_pattern(ftp_connection *c, const ftp_listing_filter *filter)
+{
+	const char *name = filter->name;
+	if (!filter->send_pattern || !name || !*name || *name == '-' ||
+		strpbrk(name, "/ \t\r\n") ||
+		c->_current_features->use_mlsd || ftp_i_use_stat_listing(c))
 		return NULL;
+	return name;
+}
+
+/*
+ * Lists the current directory. Entries that do not match filter (optional) are skipped
+ * while parsing.
+ */
+static ftp_content_listing *ftp_i_contents_of_directory(ftp_connection *c, const ftp_listing_filter *filter, int *items_count)
+{
+	ftp_content_listing *content = NULL;
+	int itemscount = 0, error = 0;
+
+	ftp_bool use_cache = ftp_i_dir_cache_usable(c);
+	if (use_cache && ftp_i_dir_cache_get_listing(c, &content, &itemscount)) {
+		if (filter && content)
+			content = ftp_i_apply_listing_filter(content, filter, &itemscount);
+		goto filter;
+	}
+	/* Only complete listings are cached. */
+	if (filter)
+		use_cache = ftp_bfalse;
+
+	unsigned int facts = ftp_i_wanted_facts(c);
+	unsigned int selected = c->listing_facts;
+	if (filter && c->listing_facts) {
+		facts |= ftp_i_filter_facts(filter);
+		selected |= ftp_i_filter_facts(filter);
+	}
+	const char *pattern = filter ? ftp_i_filter_pattern(c, filter) : NULL;
+
+	ftp_bool use_mlsd = ftp_bfalse;
+	ftp_i_managed_buffer *buf = NULL;
+	FILE *spill = NULL;
+	if (ftp_i_use_stat_listing(c) && ftp_i_stat_listing(c, NULL, &buf) != FTP_OK &&
+		c->error != FTP_ESERVERCAPABILITIES)
+		return NULL;
+
+	if (!buf) {
+		if (ftp_i_open_listing(c, pattern, selected, &use_mlsd) != FTP_OK) {
+			/* Many servers answer 550 if nothing matches the pattern. */
+			if (pattern && c->error == FTP_ENOTFOUND)
+				goto filter;
+			return NULL;
+		}
+
+		if (!(buf = ftp_i_managed_buffer_new())) {
+			ftp_i_close_data_connection(c);
+			ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
+			return NULL;
+		}
+
+		ftp_status result = ftp_i_read_data_connection_into_buffer(c, buf, &spill);
+
+		/* Nobody waits for the completion reply of an incomplete transfer. */
+		if (result != FTP_OK)
+			ftp_i_abort_transfer(c);
+		ftp_i_close_data_connection(c);
+
+		if (result != FTP_OK) {
+			ftp_i_managed_buffer_free(buf);
+			return NULL;
+		}
 	}
 
 	/* Parse server answer */
-	ftp_content_listing *content = NULL;
-	int itemscount, error;
-	if (use_mlsd) {
-		content = ftp_i_read_mlsd_answer(buf, &itemscount, &error);
+	if (spill) {
+		ftp_i_managed_buffer_free(buf);
+		content = ftp_i_read_listing_file(spill, use_mlsd, facts, filter, c->max_listing_size, &itemscount, &error);
+		fclose(spill);
+	} else if (use_mlsd) {
+		content = ftp_i_read_mlsd_answer(buf, facts, filter, &itemscount, &error);
 	} else {
-		c->_current_features->use_mlsd = ftp_bfalse;
-		content = ftp_i_read_list_answer(buf, &itemscount, &error);
+		content = ftp_i_read_list_answer(buf, filter, &itemscount, &error);
 	}
 
 	ftp_i_managed_buffer_free(buf);
 
-	if (!content) {
+	if (!content && error != 0) {
 		ftp_i_connection_set_error(c, error);
 		return NULL;
 	}
 
+	if (use_cache)
+		ftp_i_dir_cache_store(c, content ? ftp_content_array_from_listing(content) : ftp_i_content_array_new());
+
+filter:
+	if (!content) {
+		ftp_i_connection_set_error(c, 0);
+		return NULL;
+	}
+
 	if (c->content_listing_filter)
 		content = ftp_i_applyclfilter(content, &itemscount);
 
@@ -149,6 +391,427 @@ ftp_content_listing *ftp_contents_of_directory(ftp_connection *c, int *items_cou
 	return content;
 }
 
+struct ftp_i_list_each_context {
+	ftp_connection *c;
+	ftp_bool use_mlsd;
+	ftp_list_callback callback;
+	void *context;
+	ftp_bool stopped;
+	int error;
+	ftp_i_time_context now;
+	/* Passes entries that content_listing_filter would remove as well. */
+	ftp_bool unfiltered;
+};
+
+static ftp_bool ftp_i_list_each_line(char *line, size_t len, void *context)
+{
+	struct ftp_i_list_each_context *ctx = context;
+	ftp_content_listing item;
+	memset(&item, 0, sizeof(item));
+
+	if (ftp_i_parse_listing_line(line, len, ctx->use_mlsd, ftp_i_wanted_facts(ctx->c), &ctx->now, &item, &ctx->error) != FTP_OK)
+		return ftp_bfalse;
+	if (!item.filename)
+		return ftp_btrue;
+	if (ctx->c->content_listing_filter && !ctx->unfiltered && !ftp_i_clfilter_keepthis(&item))
+		return ftp_btrue;
+
+	if (!ctx->callback(&item, ctx->context)) {
+		ctx->stopped = ftp_btrue;
+		return ftp_bfalse;
+	}
+	return ftp_btrue;
+}
+
+static ftp_status ftp_i_list_each(ftp_connection *c, const char *path, struct ftp_i_list_each_context *ctx)
+{
+	ftp_i_time_context_init(&ctx->now);
+
+	ftp_i_managed_buffer *buf = NULL;
+	if (ftp_i_use_stat_listing(c)) {
+		if (ftp_i_stat_listing(c, path, &buf) == FTP_OK) {
+			ctx->use_mlsd = ftp_bfalse;
+			ftp_i_for_each_line(ftp_i_managed_buffer_cbuf(buf), ftp_i_managed_buffer_length(buf),
+				ftp_i_list_each_line, ctx);
+			ftp_i_managed_buffer_free(buf);
+			goto done;
+		}
+		if (c->error != FTP_ESERVERCAPABILITIES)
+			return FTP_ERROR;
+	}
+
+	if (ftp_i_open_listing(c, path, c->listing_facts, &ctx->use_mlsd) != FTP_OK)
+		return FTP_ERROR;
+
+	ftp_status result = ftp_i_read_data_connection_lines(c, ftp_i_list_each_line, ctx);
+
+	/* If the listing was stopped early, the server answers with 226 or 426 once
+	 * the data connection is closed. Nobody waits for this reply. */
+	if (ctx->stopped || result != FTP_OK)
+		ftp_i_abort_transfer(c);
+	ftp_i_close_data_connection(c);
+
+	if (result != FTP_OK)
+		return FTP_ERROR;
+done:
+	if (ctx->error != 0) {
+		ftp_i_connection_set_error(c, ctx->error);
+		return FTP_ERROR;
+	}
+	return FTP_OK;
+}
+
+ftp_status ftp_list_each(ftp_connection *c, ftp_list_callback callback, void *context)
+{
+	if (!callback) {
+		ftp_i_connection_set_error(c, FTP_EARGUMENTS);
+		return FTP_ERROR;
+	}
+
+	struct ftp_i_list_each_context ctx = {c, ftp_bfalse, callback, context, ftp_bfalse, 0};
+	return ftp_i_list_each(c, NULL, &ctx);
+}
+
+static ftp_bool ftp_i_append_to_array(ftp_content_listing *item, void *array)
+{
+	return ftp_i_content_array_append(array, item) == FTP_OK;
+}
+
+static ftp_content_array *ftp_i_list_into_array(ftp_connection *c, const char *path, ftp_bool unfiltered)
+{
+	ftp_content_array *a = ftp_i_content_array_new();
+	if (!a) {
+		ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
+		return NULL;
+	}
+
+	struct ftp_i_list_each_context ctx = {c, ftp_bfalse, ftp_i_append_to_array, a, ftp_bfalse, 0};
+	ctx.unfiltered = unfiltered;
+	if (ftp_i_list_each(c, path, &ctx) != FTP_OK) {
+		ftp_free_array(a);
+		return NULL;
+	}
+	if (ctx.stopped) {
+		/* Only a failed allocation stops appending. */
+		ftp_free_array(a);
+		ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
+		return NULL;
+	}
+
+	ftp_i_content_array_finish(a);
+	return a;
+}
+
+/* Lists path (relative to the current directory) into a content array, no caching. */
+ftp_content_array *ftp_i_contents_of_path(ftp_connection *c, const char *path)
+{
+	return ftp_i_list_into_array(c, path, ftp_bfalse);
+}
+
+static ftp_content_array *ftp_i_contents_of_directory_array(ftp_connection *c)
+{
+	ftp_content_array *a;
+	if (!ftp_i_dir_cache_usable(c))
+		return ftp_i_list_into_array(c, NULL, ftp_bfalse);
+
+	/* Like ftp_contents_of_directory, the cache holds unfiltered listings and
+	 * content_listing_filter is applied to every copy that is handed out. */
+	if (!(a = ftp_i_dir_cache_get_array(c))) {
+		if (!(a = ftp_i_list_into_array(c, NULL, ftp_btrue)))
+			return NULL;
+		ftp_content_array *copy = ftp_i_content_array_copy(a);
+		if (copy)
+			ftp_i_dir_cache_store(c, copy);
+	}
+	if (c->content_listing_filter)
+		ftp_content_array_filter(a, ftp_i_clfilter_keep, NULL);
+	return a;
+}
+
+struct ftp_i_names_context {
+	ftp_name_array *result;
+	ftp_bool failed;
+};
+
+static ftp_bool ftp_i_append_name(char *line, size_t len, void *context)
+{
+	struct ftp_i_names_context *ctx = context;
+	/* Some servers list "." and ".." as well. */
+	if (len == 0 || (line[0] == '.' && (len == 1 || (len == 2 && line[1] == '.'))))
+		return ftp_btrue;
+	if (ftp_i_name_array_append(ctx->result, line, len) != FTP_OK) {
+		ctx->failed = ftp_btrue;
+		return ftp_bfalse;
+	}
+	return ftp_btrue;
+}
+
+static ftp_name_array *ftp_i_names_of_directory(ftp_connection *c)
+{
+	ftp_name_array *a = ftp_i_name_array_new();
+	if (!a) {
+		ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
+		return NULL;
+	}
+
+	if (ftp_i_begin_listing(c) != FTP_OK) {
+		ftp_free_name_array(a);
+		return NULL;
+	}
+
+	ftp_bool remote_error;
+	if (ftp_i_send_listing_command(c, FTP_CNLST, NULL, NULL, &remote_error) != FTP_OK) {
+		ftp_i_close_data_connection(c);
+		if (remote_error && (c->last_signal == FTP_SIGNAL_FILE_ERROR ||
+			c->last_signal == FTP_SIGNAL_FILE_UNAVAILABLE)) {
+			/* Some servers answer NLST in an empty directory with "450 No files found". */
+			return a;
+		}
+		ftp_free_name_array(a);
+		ftp_i_connection_set_error(c, FTP_EUNEXPECTED);
+		return NULL;
+	}
+
+	if (ftp_i_prepare_data_connection(c) != FTP_OK) {
+		ftp_i_close_data_connection(c);
+		ftp_free_name_array(a);
+		return NULL;
+	}
+
+	struct ftp_i_names_context ctx = {a, ftp_bfalse};
+	ftp_status result = ftp_i_read_data_connection_lines(c, ftp_i_append_name, &ctx);
+	if (ctx.failed || result != FTP_OK)
+		ftp_i_abort_transfer(c);
+	ftp_i_close_data_connection(c);
+
+	if (result != FTP_OK || ctx.failed) {
+		if (ctx.failed)
+			ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
+		ftp_free_name_array(a);
+		return NULL;
+	}
+
+	ftp_i_name_array_finish(a);
+	return a;
+}
+
+/*
+ * Lists the tree below path with a single LIST -R. Sets FTP_ESERVERCAPABILITIES if
+ * the server does not understand it (it may also answer with a flat listing).
+ */
+static ftp_status ftp_i_list_recursive(ftp_connection *c, const char *path, struct ftp_i_recursive_listing *r)
+{
+	if (ftp_i_begin_listing(c) != FTP_OK)
+		return FTP_ERROR;
+
+	ftp_bool remote_error;
+	if (ftp_i_send_listing_command(c, FTP_CLIST, FTP_CLIST_RECURSIVE, (char *)path, &remote_error) != FTP_OK) {
+		/* Either -R or the path was not understood, the per directory listing will tell. */
+		ftp_i_close_data_connection(c);
+		ftp_i_connection_set_error(c, remote_error ? FTP_ESERVERCAPABILITIES : FTP_EUNEXPECTED);
+		return FTP_ERROR;
+	}
+
+	if (ftp_i_prepare_data_connection(c) != FTP_OK) {
+		ftp_i_close_data_connection(c);
+		return FTP_ERROR;
+	}
+
+	ftp_status result = ftp_i_read_data_connection_lines(c, ftp_i_parse_recursive_list_line, r);
+	if (r->error != 0 || result != FTP_OK)
+		ftp_i_abort_transfer(c);
+	ftp_i_close_data_connection(c);
+
+	if (result != FTP_OK)
+		return FTP_ERROR;
+	if (r->error != 0) {
+		ftp_i_connection_set_error(c, r->error);
+		return FTP_ERROR;
+	}
+	if (r->saw_subdirectory && !r->saw_header) {
+		/* -R was ignored. */
+		ftp_i_connection_set_error(c, FTP_ESERVERCAPABILITIES);
+		return FTP_ERROR;
+	}
+	return FTP_OK;
+}
+
+static ftp_bool ftp_i_tree_walk_entry(const char *directory, ftp_content_listing *entry, void *context)
+{
+	struct ftp_i_recursive_listing *r = context;
+	return ftp_i_recursive_listing_directory(r, directory, strlen(directory)) &&
+		ftp_i_recursive_listing_add(r, entry);
+}
+
+/*
+ * Lists everything below path (NULL for the current directory) into one array, with
+ * paths relative to path as file names. Uses LIST -R where the server supports it and
+ * lists every directory on its own otherwise.
+ */
+static ftp_content_array *ftp_i_contents_of_tree(ftp_connection *c, const char *path)
+{
+	struct ftp_features *f = c->_current_features;
+	struct ftp_i_recursive_listing r;
+	memset(&r, 0, sizeof(r));
+	r.root = path;
+	r.filter = c->content_listing_filter;
+	r.block_start = ftp_btrue;
+	ftp_i_time_context_init(&r.now);
+
+	if (!(r.result = ftp_i_content_array_new())) {
+		ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
+		return NULL;
+	}
+
+	ftp_bool probe = !f->list_recursive_probed;
+	if (probe || f->has_list_recursive) {
+		if (ftp_i_list_recursive(c, path, &r) == FTP_OK) {
+			/* Without subdirectories, the answer does not tell whether -R works. */
+			if (probe && r.saw_header) {
+				f->has_list_recursive = ftp_btrue;
+				f->list_recursive_probed = ftp_btrue;
+			}
+			goto done;
+		}
+		if (c->error != FTP_ESERVERCAPABILITIES)
+			goto error;
+
+		FTP_WARN("LIST -R failed, listing every directory on its own.\n");
+		ftp_free_array(r.result);
+		if (!(r.result = ftp_i_content_array_new())) {
+			ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
+			goto error;
+		}
+		r.prefix_len = 0;
+	}
+
+	r.root = path ? path : ".";
+	ftp_walk_options options = {0, 0, NULL, &r};
+	if (ftp_walk(c, r.root, ftp_i_tree_walk_entry, &options) != FTP_OK)
+		goto error;
+	if (r.error != 0) {
+		ftp_i_connection_set_error(c, r.error);
+		goto error;
+	}
+	/* The directory could be listed, so LIST -R failed because of -R. */
+	if (probe) {
+		f->has_list_recursive = ftp_bfalse;
+		f->list_recursive_probed = ftp_btrue;
+	}
+
+done:
+	ftp_i_free(r.path);
+	ftp_i_content_array_finish(r.result);
+	return r.result;
+
+error:
+	ftp_i_free(r.path);
+	ftp_free_array(r.result);
+	return NULL;
+}
+
+void ftp_i_invalidate_listing_cache(ftp_connection *c)
+{
+	ftp_free_array(c->_listing_cache);
+	c->_listing_cache = NULL;
+	if (c->_found_item) {
+		ftp_free(c->_found_item);
+		c->_found_item = NULL;
+	}
+}
+
+/*
+ * Gets the facts of a single file with MLST. item->filename is not set.
+ * facts are the FTP_FACT_* values the caller cannot do without. The facts selected for
+ * listings are kept and only widened if they leave one of these out.
+ */
+ftp_status ftp_i_mlst(ftp_connection *c, char *filenm, unsigned int facts, ftp_content_listing *item)
+{
+	struct ftp_features *f = c->_current_features;
+	unsigned int selected = c->_mlst_facts ? c->_mlst_facts : f->mlst_default_facts;
+	if (facts & f->mlst_facts & ~selected)
+		ftp_i_select_facts(c, selected | facts);
+
+	ftp_i_set_input_trigger(c, FTP_SIGNAL_REQUESTED_ACTION_OKAY);
+	c->_last_answer_lock_signal = FTP_SIGNAL_REQUESTED_ACTION_OKAY;
+
+	ftp_bool remote_error;
+	if (ftp_i_send_command_and_wait_for_triggers(c, FTP_CMLST, filenm, NULL, 0, &remote_error) != FTP_OK) {
+		if (remote_error)
+			ftp_i_connection_set_error(c, c->last_signal == FTP_SIGNAL_FILE_ERROR ? FTP_ENOTFOUND : FTP_EUNEXPECTED);
+		ftp_i_managed_buffer_free(c->_last_answer_buffer);
+		return FTP_ERROR;
+	}
+
+	if (!c->_last_answer_buffer) {
+		ftp_i_connection_set_error(c, FTP_EUNEXPECTED);
+		return FTP_ERROR;
+	}
+
+	/* The facts are sent in the only line between "250-" and "250 ", starting
+	 * with a space. */
+	char *line = ftp_i_managed_buffer_cbuf(c->_last_answer_buffer);
+	while (*line == ' ')
+		line++;
+	line[strcspn(line, FTP_CENDL)] = '\0';
+
+	int error = 0;
+	memset(item, 0, sizeof(ftp_content_listing));
+	ftp_status result = ftp_i_parse_mlsd_line(line, strlen(line), ~0u, item, &error);
+	item->filename = NULL;
+	ftp_i_managed_buffer_free(c->_last_answer_buffer);
+
+	if (result != FTP_OK) {
+		ftp_i_connection_set_error(c, error);
+		return FTP_ERROR;
+	}
+	return FTP_OK;
+}
+
+static ftp_bool ftp_i_item_exists(ftp_connection *c, char *filenm, ftp_content_listing **item)
+{
+	if (!ftp_i_connection_is_ready(c)) {
+		ftp_i_connection_set_error(c, FTP_ENOTREADY);
+		return ftp_bfalse;
+	}
+
+	ftp_i_connection_set_error(c, 0);
+	if (c->_found_item) {
+		ftp_free(c->_found_item);
+		c->_found_item = NULL;
+	}
+
+	if (!c->_listing_cache && c->_current_features->has_mlst) {
+		ftp_content_listing *found = ftp_i_mkcontentlisting();
+		if (!found) {
+			ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
+			return ftp_bfalse;
+		}
+		if (ftp_i_mlst(c, filenm, 0, found) != FTP_OK) {
+			ftp_free(found);
+			if (c->error == FTP_ENOTFOUND)
+				ftp_i_connection_set_error(c, 0);
+			return ftp_bfalse;
+		}
+		ftp_i_strcpy_malloc(found->filename, filenm);
+		if (!found->filename) {
+			ftp_free(found);
+			ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
+			return ftp_bfalse;
+		}
+		c->_found_item = found;
+		if (item)
+			*item = found;
+		return ftp_btrue;
+	}
+
+	/* Without MLST the listing is fetched once and kept until the directory changes. */
+	if (!c->_listing_cache && !(c->_listing_cache = ftp_i_contents_of_directory_array(c)))
+		return ftp_bfalse;
+
+	return ftp_item_exists_in_content_array(c->_listing_cache, filenm, item);
+}
+
 ftp_bool ftp_item_exists_in_content_listing(ftp_content_listing *c, char *file_nm, ftp_content_listing **current)
 {
 	for (ftp_content_listing *cl = c; cl; cl = cl->next) {
@@ -161,7 +824,7 @@ ftp_bool ftp_item_exists_in_content_listing(ftp_content_listing *c, char *file_n
 	return ftp_bfalse;
 }
 
-ftp_file *ftp_fopen(ftp_connection *c, char *filenm, ftp_activity activity, unsigned long startpos)
+ftp_file *ftp_fopen(ftp_connection *c, char *filenm, ftp_activity activity, ftp_offset startpos)
 {
 	if (activity != FTP_READ && activity != FTP_WRITE) {
 		c->error = FTP_EARGUMENTS;
@@ -175,6 +838,8 @@ ftp_file *ftp_fopen(ftp_connection *c, char *filenm, ftp_activity activity, unsi
 		ftp_i_connection_set_error(c, FTP_ENOTREADY);
 		return NULL;
 	}
+	if (activity == FTP_WRITE)
+		ftp_i_invalidate_listing_cache(c);
 	ftp_file *f = (ftp_file*)malloc(sizeof(ftp_file));
 	if (!f) {
 		c->error = FTP_ECOULDNOTALLOCATE;
@@ -182,6 +847,7 @@ ftp_file *ftp_fopen(ftp_connection *c, char *filenm, ftp_activity activity, unsi
 	}
 	f->eof = ftp_bfalse;
 	f->parent = NULL;
+	f->_path = NULL;
 	f->activity = activity;
 
 	ftp_connection *fc;
@@ -194,6 +860,9 @@ ftp_file *ftp_fopen(ftp_connection *c, char *filenm, ftp_activity activity, unsi
 	f->c = fc;
 	f->error = &(fc->error);
 
+	if (fc->keepalive_interval > 0)
+		ftp_i_set_tcp_keepalive(fc);
+
 	if (ftp_i_set_transfer_type(fc, ftp_tt_binary) != FTP_OK ||
 		ftp_i_establish_data_connection(fc) != FTP_OK) {
 		if (fc != c) {
@@ -213,12 +882,13 @@ ftp_file *ftp_fopen(ftp_connection *c, char *filenm, ftp_activity activity, unsi
 			sprintf(command, FTP_CSTOR " %s" FTP_CENDL,filenm);
 			if (startpos > 0) {
 				char retrcmd[100];
-				sprintf(retrcmd, FTP_CREST " %li" FTP_CENDL, startpos);
+				sprintf(retrcmd, FTP_CREST " %" PRIu64 FTP_CENDL, startpos);
 				ftp_send(fc, retrcmd);
 			}
 		}
 		ftp_i_set_input_trigger(fc, FTP_SIGNAL_ABOUT_TO_OPEN_DATA_CONNECTION);
 		ftp_i_set_input_trigger(fc, FTP_SIGNAL_DATA_CONNECTION_OPEN_STARTING_TRANSFER);
+		ftp_i_begin_transfer(fc);
 		ftp_send(fc, command);
 		if (ftp_i_wait_for_triggers(fc) != FTP_OK) {
 			c->error = fc->error;
@@ -235,13 +905,14 @@ ftp_file *ftp_fopen(ftp_connection *c, char *filenm, ftp_activity activity, unsi
 	} else {
 		if (startpos != 0) {
 			char retrcmd[100];
-			sprintf(retrcmd, FTP_CREST " %li" FTP_CENDL, startpos);
+			sprintf(retrcmd, FTP_CREST " %" PRIu64 FTP_CENDL, startpos);
 			ftp_send(fc, retrcmd);
 		}
 		char command[500];
 		sprintf(command, FTP_CRETR " %s" FTP_CENDL,filenm);
 		ftp_i_set_input_trigger(fc, FTP_SIGNAL_ABOUT_TO_OPEN_DATA_CONNECTION);
 		ftp_i_set_input_trigger(fc, FTP_SIGNAL_DATA_CONNECTION_OPEN_STARTING_TRANSFER);
+		ftp_i_begin_transfer(fc);
 		ftp_send(fc, command);
 		if (ftp_i_wait_for_triggers(fc) != FTP_OK) {
 			c->error = fc->error;
@@ -261,6 +932,11 @@ ftp_file *ftp_fopen(ftp_connection *c, char *filenm, ftp_activity activity, unsi
 		free(f);
 		return NULL;
 	}
+	if (activity == FTP_WRITE && c->_dir_cache) {
+		/* The directory is invalidated again by ftp_fclose, when the upload is complete. */
+		ftp_i_dir_cache_invalidate(c, filenm, ftp_bfalse);
+		f->_path = ftp_i_resolve_path(ftp_i_dir_cache_key(c), filenm);
+	}
 	return f;
 }
 
@@ -271,6 +947,10 @@ void ftp_fclose(ftp_file *file)
 	if (file->c->_data_connection != 0)
 		ftp_i_close_data_connection(file->c);
 
+	if (file->activity == FTP_WRITE && file->c->_dir_cache)
+		ftp_i_dir_cache_invalidate(file->c, file->_path, ftp_bfalse);
+	ftp_i_free(file->_path);
+
 	ftp_i_mark_as_unused(file->c);
 
 	free(file);
@@ -285,6 +965,11 @@ size_t ftp_fwrite(const void *buf, size_t size, size_t count, ftp_file *f)
 		*(f->error) = FTP_EARGUMENTS;
 		return 0;
 	}
+	ftp_i_keepalive_if_due(f->c, ftp_bfalse);
+	if (f->c->_data_connection == 0) {
+		*(f->error) = FTP_ENOTREADY;
+		return 0;
+	}
 	//upload chunks
 	while (data_count < count) {
 		ssize_t r = ftp_i_write(f->c, 1, buf + (data_count * size), size);
@@ -309,6 +994,11 @@ size_t ftp_fread(void *buf, size_t size, size_t count, ftp_file *f)
 		*(f->error) = FTP_EARGUMENTS;
 		return 0;
 	}
+	ftp_i_keepalive_if_due(f->c, ftp_bfalse);
+	if (f->c->_data_connection == 0) {
+		*(f->error) = FTP_ENOTREADY;
+		return 0;
+	}
 	//download chunks
 	while (data_count < count) {
 		ssize_t r = ftp_i_read(f->c, 1, buf + (data_count * size), size);
@@ -330,31 +1020,22 @@ size_t ftp_fread(void *buf, size_t size, size_t count, ftp_file *f)
 	return data_count;
 }
 
-ftp_status ftp_size_legacy(ftp_connection *c, char *filenm, size_t *size)
+ftp_status ftp_size_legacy(ftp_connection *c, char *filenm, ftp_offset *size)
 {
-	ftp_content_listing *content = ftp_contents_of_directory(c, NULL);
-	if (!content)
-		return FTP_ERROR;
-
-	ftp_content_listing *current = NULL;
-	if (!ftp_item_exists_in_content_listing(content, filenm, &current)) {
-		c->error = FTP_ENOTFOUND;
+	/* Uses MLST or the (cached) listing of the current directory. */
+	ftp_content_listing *item;
+	if (!ftp_i_item_exists(c, filenm, &item)) {
+		if (c->error == 0)
+			ftp_i_connection_set_error(c, FTP_ENOTFOUND);
 		return FTP_ERROR;
 	}
 
-	if (!current) {
-		c->error = FTP_EUNEXPECTED;
-		return FTP_ERROR;
-	}
-
-	*size = current->facts.size;
-	ftp_free(content);
+	*size = item->facts.size;
 	return FTP_OK;
 }
 
-ftp_status ftp_size(ftp_connection *c, char *filenm, size_t *size)
+static ftp_status ftp_i_size(ftp_connection *c, char *filenm, ftp_offset *size)
 {
-//FIXME: learn server SIZE behavior (current_features)
 	if (!ftp_i_connection_is_ready(c)) {
 		ftp_i_connection_set_error(c, FTP_ENOTREADY);
 		return FTP_ERROR;
@@ -365,6 +1046,10 @@ ftp_status ftp_size(ftp_connection *c, char *filenm, size_t *size)
 		return FTP_ERROR;
 	}
 
+	struct ftp_features *f = c->_current_features;
+	if (f->feat_supported && !f->has_size)
+		return ftp_size_legacy(c, filenm, size);
+
 	if (ftp_i_set_transfer_type(c, ftp_tt_binary) != FTP_OK)
 		return FTP_ERROR;
 
@@ -376,24 +1061,141 @@ ftp_status ftp_size(ftp_connection *c, char *filenm, size_t *size)
 		if (!remote_error)
 			return FTP_ERROR;
 
+		if (f->feat_supported) {
+			/* SIZE is supported, so the file does not exist. */
+			ftp_i_connection_set_error(c, c->last_signal == FTP_SIGNAL_FILE_ERROR ? FTP_ENOTFOUND : FTP_EUNEXPECTED);
+			return FTP_ERROR;
+		}
+
 		/* Maybe this server does not support the SIZE command.
 		 * We will try to get the size from a directory listing */
 		FTP_WARN("Server does not support SIZE command, falling back to legacy content listing mode.\n");
 		return ftp_size_legacy(c, filenm, size);
 	}
 
+	ftp_i_managed_buffer *answer = c->_last_answer_buffer;
+	c->_last_answer_buffer = NULL;
+	const char *p = answer ? ftp_i_managed_buffer_cbuf(answer) : "";
+	while (*p == ' ')
+		p++;
+	ftp_bool valid = ftp_i_parse_offset(p, strlen(p), size);
+	ftp_i_managed_buffer_free(answer);
+	if (!valid) {
+		FTP_ERR("[SIZE] Invalid answer.\n");
+		ftp_i_connection_set_error(c, FTP_EINVALID);
+		return FTP_ERROR;
+	}
+	return FTP_OK;
+}
+
+static ftp_status ftp_i_modification_date(ftp_connection *c, char *filenm, ftp_date *date)
+{
+	if (!ftp_i_connection_is_ready(c)) {
+		ftp_i_connection_set_error(c, FTP_ENOTREADY);
+		return FTP_ERROR;
+	}
+
+	if (date == NULL) {
+		c->error = FTP_EARGUMENTS;
+		return FTP_ERROR;
+	}
+
+	struct ftp_features *f = c->_current_features;
+	if (f->feat_supported && !f->has_mdtm) {
+		ftp_content_listing item;
+		if (!f->has_mlst) {
+			ftp_i_connection_set_error(c, FTP_ESERVERCAPABILITIES);
+			return FTP_ERROR;
+		}
+		if (ftp_i_mlst(c, filenm, FTP_FACT_MODIFY, &item) != FTP_OK)
+			return FTP_ERROR;
+		if (!item.facts.given.modify) {
+			ftp_i_connection_set_error(c, FTP_ESERVERCAPABILITIES);
+			return FTP_ERROR;
+		}
+		*date = item.facts.modify;
+		return FTP_OK;
+	}
+
+	ftp_i_set_input_trigger(c, FTP_SIGNAL_FILE_STATUS);
+	c->_last_answer_lock_signal = FTP_SIGNAL_FILE_STATUS;
+
+	ftp_bool remote_error;
+	if (ftp_i_send_command_and_wait_for_triggers(c, FTP_CMDTM, filenm, NULL, 0, &remote_error) != FTP_OK) {
+		if (remote_error)
+			ftp_i_connection_set_error(c, c->last_signal == FTP_SIGNAL_FILE_ERROR ? FTP_ENOTFOUND : FTP_ESERVERCAPABILITIES);
+		ftp_i_managed_buffer_free(c->_last_answer_buffer);
+		return FTP_ERROR;
+	}
+
+	if (!c->_last_answer_buffer) {
+		ftp_i_connection_set_error(c, FTP_EUNEXPECTED);
+		return FTP_ERROR;
+	}
+
+	/* 213 YYYYMMDDHHMMSS(.sss) */
 	char *answer = ftp_i_managed_buffer_cbuf(c->_last_answer_buffer);
-	int i;
-	char sizstr[15];
-	for (i = 0; (*(answer+i) != '\r' && *(answer+i) != '\n' && *(answer+i) != '\0'); i++)
-		sizstr[i] = *(answer+i);
-	sizstr[i] = '\0';
-	*size = strtoul(sizstr, (char**)NULL, 10);
+	answer[strcspn(answer, FTP_CENDL)] = '\0';
+	if (strlen(answer) < 14) {
+		ftp_i_managed_buffer_free(c->_last_answer_buffer);
+		ftp_i_connection_set_error(c, FTP_EUNEXPECTED);
+		return FTP_ERROR;
+	}
+	*date = ftp_i_date_from_string(answer, strlen(answer));
 
 	ftp_i_managed_buffer_free(c->_last_answer_buffer);
 	return FTP_OK;
 }
 
+static ftp_status ftp_i_stat(ftp_connection *c, char *filenm, ftp_file_facts *facts)
+{
+	if (!ftp_i_connection_is_ready(c)) {
+		ftp_i_connection_set_error(c, FTP_ENOTREADY);
+		return FTP_ERROR;
+	}
+
+	if (facts == NULL) {
+		c->error = FTP_EARGUMENTS;
+		return FTP_ERROR;
+	}
+
+	struct ftp_features *f = c->_current_features;
+	if (f->has_mlst || !f->feat_supported) {
+		ftp_content_listing item;
+		if (ftp_i_mlst(c, filenm, 0, &item) == FTP_OK) {
+			*facts = item.facts;
+			return FTP_OK;
+		}
+		if (f->has_mlst || c->error != FTP_EUNEXPECTED)
+			return FTP_ERROR;
+		/* The server does not know MLST. */
+	}
+
+	/* Fall back to SIZE and MDTM. Only files have a size, so a directory is
+	 * found through its modification date. */
+	memset(facts, 0, sizeof(ftp_file_facts));
+
+	ftp_offset size;
+	if (ftp_i_size(c, filenm, &size) == FTP_OK) {
+		facts->size = size;
+		facts->given.size = 1;
+		facts->type = ft_file;
+		facts->given.type = 1;
+	} else if (c->error != FTP_ENOTFOUND && c->error != FTP_EUNEXPECTED) {
+		return FTP_ERROR;
+	}
+
+	if (ftp_i_modification_date(c, filenm, &facts->modify) == FTP_OK) {
+		facts->modify_time = ftp_i_date_to_unix_timestamp(&facts->modify);
+		facts->given.modify = 1;
+	} else if (!facts->given.size) {
+		return FTP_ERROR;
+	}
+
+	ftp_i_connection_set_error(c, 0);
+	return FTP_OK;
+}
+
 ftp_status ftp_rename(ftp_connection *c, char *oldfn, char *newfn)
 {
 	if (!ftp_i_connection_is_ready(c)) {
@@ -401,6 +1203,7 @@ ftp_status ftp_rename(ftp_connection *c, char *oldfn, char *newfn)
 		return FTP_ERROR;
 	}
 
+	ftp_i_invalidate_listing_cache(c);
 	ftp_i_set_input_trigger(c, FTP_SIGNAL_REQUEST_FURTHER_INFORMATION);
 
 	ftp_bool remote_error;
@@ -412,7 +1215,10 @@ ftp_status ftp_rename(ftp_connection *c, char *oldfn, char *newfn)
 
 	ftp_i_set_input_trigger(c, FTP_SIGNAL_REQUESTED_ACTION_OKAY);
 
-	return ftp_i_send_command_and_wait_for_triggers(c, FTP_CRNTO, newfn, NULL, FTP_EUNEXPECTED, NULL);
+	ftp_status result = ftp_i_send_command_and_wait_for_triggers(c, FTP_CRNTO, newfn, NULL, FTP_EUNEXPECTED, NULL);
+	ftp_i_dir_cache_invalidate(c, oldfn, ftp_btrue);
+	ftp_i_dir_cache_invalidate(c, newfn, ftp_btrue);
+	return result;
 }
 
 ftp_status ftp_delete(ftp_connection *c, char *fnm, ftp_bool is_folder)
@@ -422,10 +1228,13 @@ ftp_status ftp_delete(ftp_connection *c, char *fnm, ftp_bool is_folder)
 		return FTP_ERROR;
 	}
 
+	ftp_i_invalidate_listing_cache(c);
 	ftp_i_set_input_trigger(c, FTP_SIGNAL_REQUESTED_ACTION_OKAY);
 
 	ftp_bool remote_error;
-	if (ftp_i_send_command_and_wait_for_triggers(c, (is_folder ? FTP_CRMD : FTP_CDELE), fnm, NULL, 0, &remote_error) != FTP_OK) {
+	ftp_status result = ftp_i_send_command_and_wait_for_triggers(c, (is_folder ? FTP_CRMD : FTP_CDELE), fnm, NULL, 0, &remote_error);
+	ftp_i_dir_cache_invalidate(c, fnm, is_folder);
+	if (result != FTP_OK) {
 		if (remote_error) {
 			ftp_i_connection_set_error(c, (c->last_signal == FTP_SIGNAL_FILE_ERROR ?
 					(is_folder ? FTP_ENOTFOUND_OR_NOTEMPTY : FTP_ENOTFOUND) :
@@ -451,9 +1260,12 @@ ftp_status ftp_chmod(ftp_connection *c, char *fnm, unsigned int mode)
 
 	sprintf(mode_string, "%u", mode);
 
+	ftp_i_invalidate_listing_cache(c);
 	ftp_i_set_input_trigger(c, FTP_SIGNAL_COMMAND_OKAY);
 
-	return ftp_i_send_command_and_wait_for_triggers(c, FTP_CUNIX_CHMOD, mode_string, fnm, FTP_EUNEXPECTED, NULL);
+	ftp_status result = ftp_i_send_command_and_wait_for_triggers(c, FTP_CUNIX_CHMOD, mode_string, fnm, FTP_EUNEXPECTED, NULL);
+	ftp_i_dir_cache_invalidate(c, fnm, ftp_bfalse);
+	return result;
 }
 
 ftp_status ftp_create_folder(ftp_connection *c, char *fnm)
@@ -463,12 +1275,15 @@ ftp_status ftp_create_folder(ftp_connection *c, char *fnm)
 		return FTP_ERROR;
 	}
 
+	ftp_i_invalidate_listing_cache(c);
 	ftp_i_set_input_trigger(c, FTP_SIGNAL_MKDIR_SUCCESS_OR_PWD);
 
-	return ftp_i_send_command_and_wait_for_triggers(c, FTP_CMKD, fnm, NULL, FTP_EUNEXPECTED, NULL);
+	ftp_status result = ftp_i_send_command_and_wait_for_triggers(c, FTP_CMKD, fnm, NULL, FTP_EUNEXPECTED, NULL);
+	ftp_i_dir_cache_invalidate(c, fnm, ftp_btrue);
+	return result;
 }
 
-ftp_status ftp_noop(ftp_connection *c, ftp_bool wfresponse)
+ftp_status ftp_i_noop(ftp_connection *c, ftp_bool wfresponse)
 {
 	if (!ftp_i_connection_is_ready(c)) {
 		ftp_i_connection_set_error(c, FTP_ENOTREADY);
@@ -477,7 +1292,14 @@ ftp_status ftp_noop(ftp_connection *c, ftp_bool wfresponse)
 
 	if (wfresponse)
 		ftp_i_set_input_trigger(c, FTP_SIGNAL_COMMAND_OKAY);
-	ftp_send(c, FTP_CNOOP FTP_CENDL);
+	else
+		/* The input thread drops the answer, it may do so before ftp_send returns. */
+		__atomic_add_fetch(&c->_pending_noops, 1, __ATOMIC_ACQ_REL);
+	if (ftp_send(c, FTP_CNOOP FTP_CENDL) != FTP_OK) {
+		if (!wfresponse)
+			__atomic_sub_fetch(&c->_pending_noops, 1, __ATOMIC_ACQ_REL);
+		return FTP_ERROR;
+	}
 	if (wfresponse) {
 		if (ftp_i_wait_for_triggers(c) != FTP_OK)
 			return FTP_ERROR;
@@ -488,3 +1310,92 @@ ftp_status ftp_noop(ftp_connection *c, ftp_bool wfresponse)
 	}
 	return FTP_OK;
 }
+
+ftp_status ftp_reload_cur_directory(ftp_connection *c)
+{
+	ftp_status result;
+	ftp_i_idempotent(c, result, ftp_i_reload_cur_directory(c), result != FTP_OK);
+	return result;
+}
+
+ftp_status ftp_change_cur_directory(ftp_connection *c, char *path)
+{
+	ftp_status result;
+	ftp_i_idempotent(c, result, ftp_i_change_cur_directory(c, path), result != FTP_OK);
+	return result;
+}
+
+ftp_content_listing *ftp_contents_of_directory(ftp_connection *c, int *items_count)
+{
+	ftp_content_listing *result;
+	ftp_i_idempotent(c, result, ftp_i_contents_of_directory(c, NULL, items_count), !result && c->error != 0);
+	return result;
+}
+
+ftp_content_listing *ftp_contents_of_directory_matching(ftp_connection *c, const ftp_listing_filter *filter, int *items_count)
+{
+	if (!filter) {
+		ftp_i_connection_set_error(c, FTP_EARGUMENTS);
+		return NULL;
+	}
+
+	ftp_content_listing *result;
+	ftp_i_idempotent(c, result, ftp_i_contents_of_directory(c, filter, items_count), !result && c->error != 0);
+	return result;
+}
+
+ftp_content_array *ftp_contents_of_directory_array(ftp_connection *c)
+{
+	ftp_content_array *result;
+	ftp_i_idempotent(c, result, ftp_i_contents_of_directory_array(c), !result && c->error != 0);
+	return result;
+}
+
+ftp_name_array *ftp_names_of_directory(ftp_connection *c)
+{
+	ftp_name_array *result;
+	ftp_i_idempotent(c, result, ftp_i_names_of_directory(c), !result && c->error != 0);
+	return result;
+}
+
+ftp_content_array *ftp_contents_of_tree(ftp_connection *c, const char *path)
+{
+	ftp_content_array *result;
+	ftp_i_idempotent(c, result, ftp_i_contents_of_tree(c, path), !result && c->error != 0);
+	return result;
+}
+
+ftp_status ftp_size(ftp_connection *c, char *filenm, ftp_offset *size)
+{
+	ftp_status result;
+	ftp_i_idempotent(c, result, ftp_i_size(c, filenm, size), result != FTP_OK);
+	return result;
+}
+
+ftp_status ftp_modification_date(ftp_connection *c, char *filenm, ftp_date *date)
+{
+	ftp_status result;
+	ftp_i_idempotent(c, result, ftp_i_modification_date(c, filenm, date), result != FTP_OK);
+	return result;
+}
+
+ftp_status ftp_stat(ftp_connection *c, char *filenm, ftp_file_facts *facts)
+{
+	ftp_status result;
+	ftp_i_idempotent(c, result, ftp_i_stat(c, filenm, facts), result != FTP_OK);
+	return result;
+}
+
+ftp_status ftp_noop(ftp_connection *c, ftp_bool wfresponse)
+{
+	ftp_status result;
+	ftp_i_idempotent(c, result, ftp_i_noop(c, wfresponse), result != FTP_OK);
+	return result;
+}
+
+ftp_bool ftp_item_exists(ftp_connection *c, char *filenm, ftp_content_listing **item)
+{
+	ftp_bool result;
+	ftp_i_idempotent(c, result, ftp_i_item_exists(c, filenm, item), !result && c->error != 0);
+	return result;
+}
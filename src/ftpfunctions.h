@@ -25,6 +25,7 @@
 #ifndef libmftp_ftpfunctions_h
 #define libmftp_ftpfunctions_h
 
+#include <stdio.h>
 #include "libmftp.h"
 
 #ifdef FTP_VERBOSE
@@ -38,6 +39,8 @@
 #endif
 
 #define FTP_INTERNAL_SIGNAL_ERROR 1000
+/* As _last_answer_lock_signal: collects multi-line 211, 212 or 213 answers (STAT). */
+#define FTP_INTERNAL_SIGNAL_STATUS 1001
 
 
 #define ftp_i_free(ptr) do { \
@@ -106,6 +109,15 @@
 #define ftp_i_connection_is_down(c) (c->status == FTP_DOWN)
 #define ftp_i_last_signal_was_error(con) ftp_i_signal_is_error(con->last_signal)
 
+/*
+ * Runs an idempotent operation and repeats it after a reconnect if it failed because
+ * the control connection was lost (see ftp_connection->reconnect_attempts).
+ */
+#define ftp_i_idempotent(c,result,call,failed) do { \
+	unsigned int ftp_i_attempt = 0; \
+	while ((result) = (call), (failed) && ftp_i_reconnect_after_failure(c, &ftp_i_attempt)); \
+} while (0)
+
 #if 0
 /* For Testing */
 #define ftp_i_printf_array(arr,len,format) printf("contents of "#arr":\n");for(int arr_i=0;arr_i<len;arr_i++){printf("%5i "format"\n",arr_i,*(arr+arr_i));}
@@ -127,11 +139,32 @@
 
 #define ANSWER_LEN 5000
 
+/* Stack size of input threads if ftp_connection->low_memory_idle is set: */
+#define FTP_INPUT_THREAD_STACK_SIZE (64 * 1024)
+
+/* Number of bytes read from the data connection at once when it is processed line by line: */
+#define FTP_DATA_CHUNK_SIZE 4096
+
+/* Number of bytes read at once from a listing that was written to a temporary file: */
+#define FTP_SPILL_CHUNK_SIZE (64 * 1024)
+
+/* Listings larger than this are split at line boundaries and parsed on several threads: */
+#define FTP_PARALLEL_PARSE_THRESHOLD (4 * 1024 * 1024)
+/* Minimum number of bytes per parser thread and maximum number of parser threads: */
+#define FTP_PARALLEL_PARSE_CHUNK_SIZE (1024 * 1024)
+#define FTP_PARALLEL_PARSE_MAX_THREADS 8
+
+/* State of the transfer on the data connection (_transfer_state), shared with the
+ * input thread that receives its completion reply: */
+#define FTP_I_TRANSFER_IDLE 0
+#define FTP_I_TRANSFER_RUNNING 1
+#define FTP_I_TRANSFER_ABORTED 2
+
 typedef struct {
 	void *buffer;
-	unsigned long size;
-	unsigned long length;
-	unsigned long offset;
+	size_t size;
+	size_t length;
+	size_t offset;
 } ftp_i_managed_buffer;
 
 typedef struct {
@@ -141,6 +174,15 @@ typedef struct {
 	unsigned int tcp_port;
 } ftp_i_ex_answer;
 
+/* Receives a null-terminated line without line terminator; returns false to stop reading. */
+typedef ftp_bool (*ftp_i_line_handler)(char *, size_t, void *);
+
+/* The current time, taken once per listing to guess the year of LIST dates. */
+typedef struct {
+	int64_t now;
+	unsigned int current_year;
+} ftp_i_time_context;
+
 FTP_I_BEGIN_DECLS
 
 /*                    Read/Write */
@@ -151,7 +193,14 @@ ssize_t               ftp_i_read(ftp_connection *, int, void *, size_t);
 void                  ftp_i_close(ftp_connection *);
 ftp_status            ftp_i_set_transfer_type(ftp_connection *, ftp_transfer_type);
 ftp_status            ftp_i_send_command_and_wait_for_triggers(ftp_connection *, char *, char *, char *, int, ftp_bool *);
-ftp_status            ftp_i_read_data_connection_into_buffer(ftp_connection *, ftp_i_managed_buffer *);
+ftp_status            ftp_i_read_data_connection_into_buffer(ftp_connection *, ftp_i_managed_buffer *, FILE **);
+ftp_status            ftp_i_read_data_connection_lines(ftp_connection *, ftp_i_line_handler, void *);
+void                  ftp_i_set_tcp_keepalive(ftp_connection *);
+ftp_status            ftp_i_keepalive_if_due(ftp_connection *, ftp_bool);
+ftp_status            ftp_i_noop(ftp_connection *, ftp_bool);
+
+/*                    Reconnect */
+ftp_bool              ftp_i_reconnect_after_failure(ftp_connection *, unsigned int *);
 
 /*                    Input Thread */
 int                   ftp_i_establish_input_thread(ftp_connection *);
@@ -167,10 +216,24 @@ int                   ftp_i_input_sign(char *);
 ftp_status            ftp_i_establish_data_connection(ftp_connection *);
 ftp_status            ftp_i_prepare_data_connection(ftp_connection *);
 void                  ftp_i_close_data_connection(ftp_connection *);
+void                  ftp_i_begin_transfer(ftp_connection *);
+void                  ftp_i_abort_transfer(ftp_connection *);
 
 /*                    Connection Queueing */
 ftp_connection *      ftp_i_dequeue_usable_connection(ftp_connection *, ftp_bool, ftp_bool);
 void                  ftp_i_mark_as_unused(ftp_connection *);
+void                  ftp_i_trim_queue(ftp_connection *);
+void                  ftp_i_reserve_queued_connections(ftp_connection *, int);
+int                   ftp_i_claim_idle_connections(ftp_connection *, ftp_connection **, int);
+
+/*                    Parallel Listing */
+struct ftp_i_listing_job {
+	const char *path;
+	ftp_content_array *result;
+	int error;
+};
+ftp_content_array    *ftp_i_contents_of_path(ftp_connection *, const char *);
+ftp_status            ftp_i_list_paths(ftp_connection *, struct ftp_i_listing_job *, size_t, unsigned int);
 
 /*                    PASV */
 int                   ftp_i_enter_pasv_old(ftp_connection *c);
@@ -181,36 +244,104 @@ unsigned int          ftp_i_values_from_comma_separated_string(char *, unsigned
 int                   ftp_i_textfrombrackets(char *, char *, int);
 ftp_i_ex_answer       ftp_i_interpret_ex_answer(char *, int *);
 int                   ftp_i_set_pwd_information(char*, char**);
-ftp_date              ftp_i_date_from_string(char *);
+ftp_bool              ftp_i_parse_offset(const char *, size_t, ftp_offset *);
+ftp_date              ftp_i_date_from_string(const char *, size_t);
 #define               ftp_i_date_from_values(y,m,d,h,min,s) ((ftp_date){(y),(m),(d),(h),(min),(s)})
-ftp_date              ftp_i_date_from_unix_timestamp(unsigned long);
+ftp_date              ftp_i_date_from_unix_timestamp(int64_t);
+int64_t               ftp_i_date_to_unix_timestamp(const ftp_date *);
+void                  ftp_i_time_context_init(ftp_i_time_context *);
+unsigned int          ftp_i_fact_from_name(const char *, size_t);
+#define               FTP_FACT_LIST_MAX 80
+void                  ftp_i_fact_list(unsigned int, char *);
+void                  ftp_i_read_feat_answer(char *, struct ftp_features *);
 
 /*                    Content Listing Parsing */
 ftp_content_listing  *ftp_i_mkcontentlisting(void);
 ftp_content_listing  *ftp_i_applyclfilter(ftp_content_listing *, int *);
-ftp_content_listing  *ftp_i_read_mlsd_answer(ftp_i_managed_buffer *, int *, int *);
-ftp_content_listing  *ftp_i_read_list_answer(ftp_i_managed_buffer *, int *, int *);
+ftp_content_listing  *ftp_i_apply_listing_filter(ftp_content_listing *, const ftp_listing_filter *, int *);
+ftp_content_listing  *ftp_i_read_mlsd_answer(ftp_i_managed_buffer *, unsigned int, const ftp_listing_filter *, int *, int *);
+ftp_content_listing  *ftp_i_read_list_answer(ftp_i_managed_buffer *, const ftp_listing_filter *, int *, int *);
+ftp_content_listing  *ftp_i_read_listing_file(FILE *, ftp_bool, unsigned int, const ftp_listing_filter *, size_t, int *, int *);
+ftp_status            ftp_i_parse_mlsd_line(char *, size_t, unsigned int, ftp_content_listing *, int *);
+ftp_bool              ftp_i_parse_list_line(char *, int, const ftp_i_time_context *, ftp_content_listing *);
+ftp_status            ftp_i_parse_listing_line(char *, size_t, ftp_bool, unsigned int, const ftp_i_time_context *, ftp_content_listing *, int *);
+unsigned long         ftp_i_for_each_line(char *, size_t, ftp_i_line_handler, void *);
+unsigned long         ftp_i_stat_answer_to_list_answer(ftp_i_managed_buffer *, ftp_bool *);
 ftp_bool              ftp_i_clfilter_keepthis(ftp_content_listing *);
-ftp_bool              ftp_i_applyfact(char *, ftp_file_facts *, unsigned long);
-ftp_bool              ftp_i_applyfacts(char *, ftp_file_facts *);
-ftp_file_type         ftp_i_strtotype(char *str);
+ftp_bool              ftp_i_clfilter_keep(ftp_content_listing *, void *);
+ftp_bool              ftp_i_filter_matches(const ftp_listing_filter *, ftp_content_listing *);
+ftp_bool              ftp_i_applyfact(unsigned int, const char *, size_t, ftp_file_facts *);
+ftp_bool              ftp_i_applyfacts(const char *, size_t, unsigned int, ftp_file_facts *);
+/* FTP_FACT_* values to decode from listings, see listing_facts: */
+#define               ftp_i_wanted_facts(c) ((c)->listing_facts ? (c)->listing_facts | FTP_FACT_TYPE : ~0u)
+ftp_file_type         ftp_i_strtotype(const char *, size_t);
 int                   ftp_i_unix_mode_from_string(char *, ftp_bool *);
 
+/*                    Recursive Listing */
+/* State while parsing a LIST -R answer line by line. */
+struct ftp_i_recursive_listing {
+	ftp_content_array *result;
+	const char *root;       /* listed path as sent to the server (or NULL) */
+	ftp_bool filter;        /* apply the content listing filter */
+	char *path;             /* directory of the following entries relative to root, then the entry */
+	size_t prefix_len, path_size;
+	ftp_bool block_start;   /* first line or after an empty line, where headers are */
+	ftp_bool started;       /* a line was parsed, further headers are subdirectories */
+	ftp_bool saw_header;    /* of a subdirectory */
+	ftp_bool saw_subdirectory;  /* before the first header, so there should be headers */
+	ftp_i_time_context now;
+	int error;
+};
+ftp_bool              ftp_i_recursive_listing_directory(struct ftp_i_recursive_listing *, const char *, size_t);
+ftp_bool              ftp_i_recursive_listing_add(struct ftp_i_recursive_listing *, ftp_content_listing *);
+ftp_bool              ftp_i_parse_recursive_list_line(char *, size_t, void *);
+
+/*                    Content Array */
+ftp_content_array    *ftp_i_content_array_new(void);
+ftp_status            ftp_i_content_array_append(ftp_content_array *, const ftp_content_listing *);
+void                  ftp_i_content_array_finish(ftp_content_array *);
+ftp_content_array    *ftp_i_content_array_copy(const ftp_content_array *);
+ftp_name_array       *ftp_i_name_array_new(void);
+ftp_status            ftp_i_name_array_append(ftp_name_array *, const char *, size_t);
+void                  ftp_i_name_array_finish(ftp_name_array *);
+void                  ftp_i_invalidate_listing_cache(ftp_connection *);
+ftp_status            ftp_i_mlst(ftp_connection *, char *, unsigned int, ftp_content_listing *);
+
+/*                    Local Files */
+/* Snapshots and indexes are written to path.tmp and renamed by ftp_i_file_commit. */
+FILE *                ftp_i_file_create(const char *, char **);
+ftp_status            ftp_i_file_commit(FILE *, char *, const char *, ftp_bool);
+const void *          ftp_i_file_map(const char *, size_t, size_t *);
+unsigned int          ftp_i_facts_given_bits(const ftp_file_facts *);
+void                  ftp_i_facts_set_given_bits(ftp_file_facts *, unsigned int);
+
+/*                    Directory Cache */
+void                  ftp_i_dir_cache_share(ftp_connection *, ftp_connection *);
+void                  ftp_i_dir_cache_release(ftp_connection *);
+const char *          ftp_i_dir_cache_key(ftp_connection *);
+ftp_bool              ftp_i_dir_cache_get_listing(ftp_connection *, ftp_content_listing **, int *);
+ftp_content_array    *ftp_i_dir_cache_get_array(ftp_connection *);
+void                  ftp_i_dir_cache_store(ftp_connection *, ftp_content_array *);
+void                  ftp_i_dir_cache_invalidate(ftp_connection *, const char *, ftp_bool);
+char *                ftp_i_resolve_path(const char *, const char *);
+
 /*                    Managed Buffer */
 ftp_i_managed_buffer *ftp_i_managed_buffer_new(void);
 #define               ftp_i_managed_buffer_length(buf) (buf->length)
 #define               ftp_i_managed_buffer_cbuf(buf) ((char*)((ftp_i_managed_buffer*)buf)->buffer)
-ftp_status            ftp_i_managed_buffer_append(ftp_i_managed_buffer *, void *, unsigned long);
+ftp_status            ftp_i_managed_buffer_append(ftp_i_managed_buffer *, void *, size_t);
 #define               ftp_i_managed_buffer_append_str(buf,string) do {void *s = (void*)(string); ftp_i_managed_buffer_append(buf, s, strlen(s));} while(0)
-unsigned long         ftp_i_managed_buffer_read(ftp_i_managed_buffer *, void *, unsigned long);
+size_t                ftp_i_managed_buffer_read(ftp_i_managed_buffer *, void *, size_t);
 ftp_bool              ftp_i_managed_buffer_contains_str(ftp_i_managed_buffer *, char *, ftp_bool);
-ftp_status            ftp_i_managed_buffer_memcpy(ftp_i_managed_buffer *, const ftp_i_managed_buffer *, unsigned long, unsigned long);
+ftp_status            ftp_i_managed_buffer_memcpy(ftp_i_managed_buffer *, const ftp_i_managed_buffer *, size_t, size_t);
 ftp_status            ftp_i_managed_buffer_duplicate(ftp_i_managed_buffer *, const ftp_i_managed_buffer *);
 void                  ftp_i_managed_buffer_print(ftp_i_managed_buffer *, ftp_bool);
 char *                ftp_i_managed_buffer_disassemble(ftp_i_managed_buffer *);
 void                  ftp_i_managed_buffer_release(ftp_i_managed_buffer *);
+void                  ftp_i_managed_buffer_clear(ftp_i_managed_buffer *);
 
 /*                    General */
+char *                ftp_i_scan(const char *, const char *, char);
 void                  ftp_i_strsep(char **, char **, const char *);
 extern long           ftp_i_seconds_between(struct timeval t1, struct timeval t2);
 extern int            ftp_i_char_is_number(char);
@@ -223,10 +354,13 @@ void                  ftp_i_memcpy(void *, const void *, size_t, size_t);
 #ifdef FTP_TLS_ENABLED
 
 /*                    FTP/TLS */
-ftp_status            ftp_i_tls_connect(int, void**, void*, int*);
+ftp_status            ftp_i_tls_connect(int, const char *, int, void**, void*, int*);
 void                  ftp_i_tls_disconnect(void **tls_info_ptr);
+void                  ftp_i_tls_drop(void **tls_info_ptr);
 ssize_t               ftp_i_tls_write(void *, const void *, size_t);
 ssize_t               ftp_i_tls_read(void *, void *, size_t);
+void                  ftp_i_tls_set_release_buffers(void *, ftp_bool);
+size_t                ftp_i_tls_idle_footprint(void *);
 
 #endif
 
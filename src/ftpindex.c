@@ -0,0 +1,654 @@
+/*   libmftp
+ *
+ *   Copyright (c) 2014 nkreipke
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+
+
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "ftpfunctions.h"
+
+/*
+ * Index file layout (all numbers in host byte order, see byte_order):
+ *
+ *     header                   ftp_i_index_header
+ *     records                  data_size bytes, one record per entry, sorted by path (strcmp)
+ *     restart table            restart_count * uint64_t, 8 byte aligned
+ *
+ * A record is
+ *
+ *     varint shared            bytes of the path in common with the previous record
+ *     varint unshared          followed by that many bytes of the rest of the path
+ *     uint8 given, uint8 type
+ *     varint size, zigzag modify_time, zigzag create_time, varint unixgroup, varint unixmode
+ *
+ * Every restart_interval-th record has shared = 0; the restart table holds their offsets
+ * in the records, so a lookup only decodes the records after the closest restart.
+ */
+
+#define FTP_I_INDEX_MAGIC              "MFTPINDX"
+#define FTP_I_INDEX_VERSION            1
+#define FTP_I_INDEX_BOM                0x01020304
+#define FTP_I_INDEX_RESTART_INTERVAL   16
+/* Longest encoding of the fixed part of a record: */
+#define FTP_I_INDEX_RECORD_MAX         (2 + 5 * 10)
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t restart_interval;
+	uint32_t flags;
+	uint64_t count;
+	uint64_t data_size;
+	uint64_t restart_count;
+} ftp_i_index_header;
+
+#define ftp_i_index_restarts_offset(h) ((sizeof(ftp_i_index_header) + (h)->data_size + 7) & ~(uint64_t)7)
+#define ftp_i_zigzag(v)   (((uint64_t)(v) << 1) ^ (uint64_t)((v) >> 63))
+#define ftp_i_unzigzag(u) ((int64_t)((u) >> 1) ^ -(int64_t)((u) & 1))
+
+static size_t ftp_i_encode_varint(unsigned char *p, uint64_t v)
+{
+	size_t n = 0;
+	while (v >= 0x80) {
+		p[n++] = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	p[n++] = (unsigned char)v;
+	return n;
+}
+
+static ftp_bool ftp_i_decode_varint(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+	uint64_t result = 0;
+	for (unsigned int shift = 0; shift < 64 && *p < end; shift += 7) {
+		unsigned char b = *(*p)++;
+		result |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*v = result;
+			return ftp_btrue;
+		}
+	}
+	return ftp_bfalse;
+}
+
+static ftp_status ftp_i_path_reserve(char **path, size_t *path_size, size_t needed)
+{
+	if (needed <= *path_size)
+		return FTP_OK;
+	size_t size = *path_size ? *path_size : 256;
+	while (size < needed)
+		size *= 2;
+	char *grown = realloc(*path, size);
+	if (!grown)
+		return FTP_ERROR;
+	*path = grown;
+	*path_size = size;
+	return FTP_OK;
+}
+
+/*
+ * Writing
+ */
+
+struct ftp_i_index_writer {
+	FILE *f;
+	ftp_i_index_header header;
+	char *prev;
+	size_t prev_len, prev_size;
+	uint64_t *restarts;
+	size_t restart_capacity;
+	ftp_bool ok;
+};
+
+static void ftp_i_index_write_record(struct ftp_i_index_writer *w, const char *path, const ftp_file_facts *f)
+{
+	if (!w->ok)
+		return;
+
+	size_t len = strlen(path), shared = 0;
+	if (w->header.count % FTP_I_INDEX_RESTART_INTERVAL == 0) {
+		if (w->header.restart_count == w->restart_capacity) {
+			size_t capacity = w->restart_capacity ? w->restart_capacity * 2 : 256;
+			uint64_t *restarts = realloc(w->restarts, capacity * sizeof(uint64_t));
+			if (!restarts) {
+				w->ok = ftp_bfalse;
+				errno = ENOMEM;
+				return;
+			}
+			w->restarts = restarts;
+			w->restart_capacity = capacity;
+		}
+		w->restarts[w->header.restart_count++] = w->header.data_size;
+	} else {
+		while (shared < len && shared < w->prev_len && path[shared] == w->prev[shared])
+			shared++;
+	}
+
+	unsigned char buf[FTP_I_INDEX_RECORD_MAX];
+	size_t n = ftp_i_encode_varint(buf, shared);
+	n += ftp_i_encode_varint(buf + n, len - shared);
+	w->ok = fwrite(buf, 1, n, w->f) == n && fwrite(path + shared, 1, len - shared, w->f) == len - shared;
+	w->header.data_size += n + len - shared;
+
+	n = 0;
+	buf[n++] = (unsigned char)ftp_i_facts_given_bits(f);
+	buf[n++] = (unsigned char)f->type;
+	n += ftp_i_encode_varint(buf + n, f->size);
+	n += ftp_i_encode_varint(buf + n, ftp_i_zigzag(f->modify_time));
+	n += ftp_i_encode_varint(buf + n, ftp_i_zigzag(f->create_time));
+	n += ftp_i_encode_varint(buf + n, f->unixgroup);
+	n += ftp_i_encode_varint(buf + n, f->unixmode);
+	if (w->ok)
+		w->ok = fwrite(buf, 1, n, w->f) == n;
+	w->header.data_size += n;
+	w->header.count++;
+
+	if (w->ok && ftp_i_path_reserve(&w->prev, &w->prev_size, len + 1) != FTP_OK) {
+		w->ok = ftp_bfalse;
+		errno = ENOMEM;
+	}
+	if (w->ok) {
+		memcpy(w->prev, path, len + 1);
+		w->prev_len = len;
+	}
+}
+
+/* Writes the restart table and the header and closes the file. */
+static ftp_status ftp_i_index_write_finish(struct ftp_i_index_writer *w, char *tmp_path, const char *path)
+{
+	static const unsigned char padding[8];
+	size_t pad = (size_t)(ftp_i_index_restarts_offset(&w->header) - sizeof(ftp_i_index_header) - w->header.data_size);
+
+	if (w->ok)
+		w->ok = fwrite(padding, 1, pad, w->f) == pad &&
+			fwrite(w->restarts, sizeof(uint64_t), w->header.restart_count, w->f) == w->header.restart_count;
+	if (w->ok)
+		w->ok = fseek(w->f, 0, SEEK_SET) == 0 &&
+			fwrite(&w->header, sizeof(ftp_i_index_header), 1, w->f) == 1;
+
+	ftp_i_free(w->prev);
+	ftp_i_free(w->restarts);
+	return ftp_i_file_commit(w->f, tmp_path, path, w->ok);
+}
+
+/*
+ * Reading
+ */
+
+static ftp_bool ftp_i_index_header_valid(const ftp_i_index_header *h, size_t map_size)
+{
+	if (memcmp(h->magic, FTP_I_INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != FTP_I_INDEX_VERSION ||
+	    h->byte_order != FTP_I_INDEX_BOM ||
+	    h->restart_interval != FTP_I_INDEX_RESTART_INTERVAL)
+		return ftp_bfalse;
+
+	if (h->data_size > map_size - sizeof(ftp_i_index_header))
+		return ftp_bfalse;
+	uint64_t restarts_offset = ftp_i_index_restarts_offset(h);
+	if (restarts_offset > map_size ||
+	    h->restart_count > (map_size - restarts_offset) / sizeof(uint64_t))
+		return ftp_bfalse;
+	if (h->restart_count != h->count / h->restart_interval + (h->count % h->restart_interval != 0))
+		return ftp_bfalse;
+	return ftp_btrue;
+}
+
+ftp_index *ftp_index_open(const char *path)
+{
+	size_t map_size;
+	const void *map = ftp_i_file_map(path, sizeof(ftp_i_index_header), &map_size);
+	if (!map)
+		return NULL;
+
+	if (!ftp_i_index_header_valid(map, map_size)) {
+		munmap((void *)map, map_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ftp_index *idx = calloc(1, sizeof(ftp_index));
+	if (!idx) {
+		munmap((void *)map, map_size);
+		errno = ENOMEM;
+		return NULL;
+	}
+	idx->count = (size_t)((const ftp_i_index_header *)map)->count;
+	idx->_map = map;
+	idx->_map_size = map_size;
+	return idx;
+}
+
+void ftp_index_close(ftp_index *idx)
+{
+	if (!idx)
+		return;
+	munmap((void *)idx->_map, idx->_map_size);
+	free(idx);
+}
+
+#define ftp_i_index_header_of(idx)  ((const ftp_i_index_header *)(idx)->_map)
+#define ftp_i_index_data(idx)       ((const unsigned char *)(idx)->_map + sizeof(ftp_i_index_header))
+#define ftp_i_index_restarts(idx)   ((const uint64_t *)((const char *)(idx)->_map + ftp_i_index_restarts_offset(ftp_i_index_header_of(idx))))
+
+/* Decodes the records of an index one after another. */
+struct ftp_i_index_cursor {
+	const unsigned char *pos, *end;
+	char *path;
+	size_t path_len, path_size;
+	ftp_file_facts facts;
+	ftp_bool damaged;
+};
+
+static void ftp_i_index_cursor_init(struct ftp_i_index_cursor *cur, ftp_index *idx)
+{
+	memset(cur, 0, sizeof(struct ftp_i_index_cursor));
+	cur->pos = ftp_i_index_data(idx);
+	cur->end = cur->pos + ftp_i_index_header_of(idx)->data_size;
+}
+
+/* Moves the cursor to a restart point, the next record read is the restart record. */
+static ftp_bool ftp_i_index_cursor_seek(struct ftp_i_index_cursor *cur, ftp_index *idx, size_t restart)
+{
+	uint64_t offset = ftp_i_index_restarts(idx)[restart];
+	if (offset >= ftp_i_index_header_of(idx)->data_size) {
+		cur->damaged = ftp_btrue;
+		return ftp_bfalse;
+	}
+	cur->pos = ftp_i_index_data(idx) + offset;
+	cur->path_len = 0;
+	return ftp_btrue;
+}
+
+/* Reads the next record into path and facts. Returns ftp_bfalse at the end of the
+ * records or if a record is damaged (damaged is set then). */
+static ftp_bool ftp_i_index_cursor_next(struct ftp_i_index_cursor *cur)
+{
+	uint64_t shared, unshared, size, modify, create, unixgroup, unixmode;
+
+	if (cur->pos >= cur->end)
+		return ftp_bfalse;
+	if (!ftp_i_decode_varint(&cur->pos, cur->end, &shared) ||
+	    !ftp_i_decode_varint(&cur->pos, cur->end, &unshared) ||
+	    shared > cur->path_len || unshared > (uint64_t)(cur->end - cur->pos))
+		goto damaged;
+	if (ftp_i_path_reserve(&cur->path, &cur->path_size, (size_t)(shared + unshared + 1)) != FTP_OK) {
+		errno = ENOMEM;
+		cur->damaged = ftp_btrue;
+		return ftp_bfalse;
+	}
+	memcpy(cur->path + shared, cur->pos, (size_t)unshared);
+	cur->pos += unshared;
+	cur->path_len = (size_t)(shared + unshared);
+	cur->path[cur->path_len] = '\0';
+
+	if (cur->end - cur->pos < 2)
+		goto damaged;
+	unsigned int given = *cur->pos++;
+	unsigned int type = *cur->pos++;
+	if (!ftp_i_decode_varint(&cur->pos, cur->end, &size) ||
+	    !ftp_i_decode_varint(&cur->pos, cur->end, &modify) ||
+	    !ftp_i_decode_varint(&cur->pos, cur->end, &create) ||
+	    !ftp_i_decode_varint(&cur->pos, cur->end, &unixgroup) ||
+	    !ftp_i_decode_varint(&cur->pos, cur->end, &unixmode))
+		goto damaged;
+
+	ftp_file_facts *f = &cur->facts;
+	memset(f, 0, sizeof(ftp_file_facts));
+	ftp_i_facts_set_given_bits(f, given);
+	f->size = size;
+	f->modify_time = ftp_i_unzigzag(modify);
+	f->create_time = ftp_i_unzigzag(create);
+	if (f->given.modify)
+		f->modify = ftp_i_date_from_unix_timestamp(f->modify_time);
+	if (f->given.create)
+		f->create = ftp_i_date_from_unix_timestamp(f->create_time);
+	f->type = type <= ft_other ? (ftp_file_type)type : ft_other;
+	f->unixgroup = (unsigned int)unixgroup;
+	f->unixmode = (unsigned int)unixmode;
+	return ftp_btrue;
+
+damaged:
+	errno = EINVAL;
+	cur->damaged = ftp_btrue;
+	return ftp_bfalse;
+}
+
+/* Compares key with the path of the record at a restart point. */
+static int ftp_i_index_compare_restart(ftp_index *idx, size_t restart, const char *key, size_t key_len, ftp_bool *damaged)
+{
+	const ftp_i_index_header *h = ftp_i_index_header_of(idx);
+	uint64_t offset = ftp_i_index_restarts(idx)[restart], shared, len;
+	const unsigned char *p = ftp_i_index_data(idx) + (offset < h->data_size ? offset : h->data_size);
+	const unsigned char *end = ftp_i_index_data(idx) + h->data_size;
+
+	if (offset >= h->data_size ||
+	    !ftp_i_decode_varint(&p, end, &shared) || !ftp_i_decode_varint(&p, end, &len) ||
+	    shared != 0 || len > (uint64_t)(end - p)) {
+		*damaged = ftp_btrue;
+		return 0;
+	}
+	int cmp = memcmp(key, p, key_len < len ? key_len : (size_t)len);
+	if (cmp == 0)
+		cmp = key_len < len ? -1 : key_len > len;
+	return cmp;
+}
+
+/* Turns a directory into the prefix of the paths below it ("/a/" for "/a" and "/a/",
+ * "/" for "/"), NULL if out of memory. */
+static char *ftp_i_index_dir_prefix(const char *dir)
+{
+	size_t len = strlen(dir);
+	while (len > 0 && dir[len - 1] == '/')
+		len--;
+	char *prefix = malloc(len + 2);
+	if (!prefix)
+		return NULL;
+	memcpy(prefix, dir, len);
+	prefix[len] = '/';
+	prefix[len + 1] = '\0';
+	return prefix;
+}
+
+/* Splits the path of the current record into directory and name and calls callback. */
+static ftp_bool ftp_i_index_report(struct ftp_i_index_cursor *cur, const ftp_listing_filter *filter, ftp_walk_callback callback, void *context)
+{
+	ftp_content_listing entry;
+	char *slash = strrchr(cur->path, '/');
+	const char *directory = "";
+
+	entry.facts = cur->facts;
+	entry.next = NULL;
+	entry.filename = slash ? slash + 1 : cur->path;
+	if (filter && !ftp_i_filter_matches(filter, &entry))
+		return ftp_btrue;
+
+	if (slash == cur->path)
+		directory = "/";
+	else if (slash)
+		directory = cur->path;
+	if (slash)
+		*slash = '\0';
+	ftp_bool go_on = callback(directory, &entry, context);
+	if (slash)
+		*slash = '/';
+	return go_on;
+}
+
+ftp_status ftp_index_query(ftp_index *idx, const char *dir, const ftp_listing_filter *filter, ftp_walk_callback callback, void *context)
+{
+	struct ftp_i_index_cursor cur;
+	char *prefix = NULL;
+	size_t prefix_len = 0;
+
+	if (!callback) {
+		errno = EINVAL;
+		return FTP_ERROR;
+	}
+	ftp_i_index_cursor_init(&cur, idx);
+
+	if (dir && *dir) {
+		prefix = ftp_i_index_dir_prefix(dir);
+		if (!prefix) {
+			errno = ENOMEM;
+			return FTP_ERROR;
+		}
+		prefix_len = strlen(prefix);
+
+		/* Start at the last restart before the prefix. */
+		size_t restart_count = (size_t)ftp_i_index_header_of(idx)->restart_count;
+		size_t low = 0, high = restart_count;
+		while (low < high && !cur.damaged) {
+			size_t mid = low + (high - low) / 2;
+			if (ftp_i_index_compare_restart(idx, mid, prefix, prefix_len, &cur.damaged) > 0)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		if (low > 0 && !cur.damaged)
+			ftp_i_index_cursor_seek(&cur, idx, low - 1);
+	}
+
+	while (!cur.damaged && ftp_i_index_cursor_next(&cur)) {
+		if (prefix) {
+			int cmp = strncmp(cur.path, prefix, prefix_len);
+			if (cmp < 0)
+				continue;
+			if (cmp > 0)
+				break;
+		}
+		if (!ftp_i_index_report(&cur, filter, callback, context))
+			break;
+	}
+
+	ftp_i_free(prefix);
+	ftp_i_free(cur.path);
+	return cur.damaged ? FTP_ERROR : FTP_OK;
+}
+
+/*
+ * Updating
+ */
+
+struct ftp_i_index_walk {
+	/* Walked entries, filename is the whole path. */
+	ftp_content_array *entries;
+	/* Directories below root that were not listed; old entries below them are kept. */
+	ftp_name_array *kept;
+	size_t root_len;
+	unsigned int max_depth;
+	ftp_bool (*prune)(const char *, void *);
+	void *context;
+	char *path;
+	size_t path_size;
+	ftp_bool failed;
+};
+
+static ftp_bool ftp_i_index_walk_prune(const char *path, void *context)
+{
+	struct ftp_i_index_walk *w = context;
+	if (!w->prune || !w->prune(path, w->context))
+		return ftp_bfalse;
+	if (ftp_i_name_array_append(w->kept, path, strlen(path)) != FTP_OK)
+		w->failed = ftp_btrue;
+	return ftp_btrue;
+}
+
+static ftp_bool ftp_i_index_walk_entry(const char *directory, ftp_content_listing *entry, void *context)
+{
+	struct ftp_i_index_walk *w = context;
+	size_t dirlen = strlen(directory), namelen = strlen(entry->filename);
+	if (dirlen > 0 && directory[dirlen - 1] == '/')
+		dirlen--;
+
+	if (w->failed || ftp_i_path_reserve(&w->path, &w->path_size, dirlen + namelen + 2) != FTP_OK) {
+		w->failed = ftp_btrue;
+		return ftp_bfalse;
+	}
+	memcpy(w->path, directory, dirlen);
+	w->path[dirlen] = '/';
+	memcpy(w->path + dirlen + 1, entry->filename, namelen + 1);
+
+	ftp_content_listing item = *entry;
+	item.filename = w->path;
+	item.next = NULL;
+	if (ftp_i_content_array_append(w->entries, &item) != FTP_OK) {
+		w->failed = ftp_btrue;
+		return ftp_bfalse;
+	}
+
+	/* Directories at max_depth are not listed by ftp_walk. */
+	if (w->max_depth && entry->facts.given.type && entry->facts.type == ft_dir) {
+		unsigned int depth = 0;
+		for (const char *p = w->path + w->root_len; *p; p++)
+			depth += *p == '/';
+		if (depth == w->max_depth &&
+		    ftp_i_name_array_append(w->kept, w->path, dirlen + namelen + 1) != FTP_OK) {
+			w->failed = ftp_btrue;
+			return ftp_bfalse;
+		}
+	}
+	return ftp_btrue;
+}
+
+static int ftp_i_compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Whether an entry of the old index survives an update of root: entries outside root
+ * and entries below directories that were not listed are kept. */
+static ftp_bool ftp_i_index_keep_old(char *path, const char *root, size_t root_len, ftp_name_array *kept)
+{
+	if (strncmp(path, root, root_len) != 0 || path[root_len] != '/')
+		return ftp_btrue;
+
+	for (char *p = path + root_len + 1; (p = strchr(p, '/')); p++) {
+		*p = '\0';
+		char *key = path;
+		ftp_bool found = kept->count && bsearch(&key, kept->names, kept->count, sizeof(char *), ftp_i_compare_names);
+		*p = '/';
+		if (found)
+			return ftp_btrue;
+	}
+	return ftp_bfalse;
+}
+
+ftp_status ftp_index_update(ftp_connection *c, const char *index_path, const char *root, ftp_walk_options *options)
+{
+	if (!index_path || !root) {
+		ftp_i_connection_set_error(c, FTP_EARGUMENTS);
+		return FTP_ERROR;
+	}
+
+	ftp_index *old = ftp_index_open(index_path);
+	if (!old && errno != ENOENT) {
+		ftp_i_connection_set_error(c, FTP_ELOCALFILE);
+		return FTP_ERROR;
+	}
+
+	/* Paths are stored as ftp_walk forms them: root without trailing slashes, '/', name. */
+	size_t root_len = strlen(root);
+	while (root_len > 0 && root[root_len - 1] == '/')
+		root_len--;
+
+	struct ftp_i_index_walk w;
+	memset(&w, 0, sizeof(struct ftp_i_index_walk));
+	w.entries = ftp_i_content_array_new();
+	w.kept = ftp_i_name_array_new();
+	w.root_len = root_len;
+	char *walk_root = malloc(root_len + 2);
+	if (!w.entries || !w.kept || !walk_root) {
+		ftp_free_array(w.entries);
+		ftp_free_name_array(w.kept);
+		ftp_i_free(walk_root);
+		ftp_index_close(old);
+		ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
+		return FTP_ERROR;
+	}
+	memcpy(walk_root, root, root_len);
+	strcpy(walk_root + root_len, root_len ? "" : "/");
+
+	ftp_walk_options o;
+	memset(&o, 0, sizeof(ftp_walk_options));
+	if (options)
+		o = *options;
+	w.max_depth = o.max_depth;
+	w.prune = o.prune;
+	w.context = o.context;
+	o.prune = ftp_i_index_walk_prune;
+	o.context = &w;
+
+	ftp_status status = ftp_walk(c, walk_root, ftp_i_index_walk_entry, &o);
+	if (status == FTP_OK && w.failed) {
+		ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
+		status = FTP_ERROR;
+	}
+	ftp_i_free(w.path);
+
+	if (status == FTP_OK) {
+		ftp_i_content_array_finish(w.entries);
+		ftp_content_array_sort(w.entries);
+		ftp_i_name_array_finish(w.kept);
+		if (w.kept->count > 1)
+			qsort(w.kept->names, w.kept->count, sizeof(char *), ftp_i_compare_names);
+
+		struct ftp_i_index_writer writer;
+		char *tmp_path;
+		memset(&writer, 0, sizeof(struct ftp_i_index_writer));
+		memcpy(writer.header.magic, FTP_I_INDEX_MAGIC, sizeof(writer.header.magic));
+		writer.header.version = FTP_I_INDEX_VERSION;
+		writer.header.byte_order = FTP_I_INDEX_BOM;
+		writer.header.restart_interval = FTP_I_INDEX_RESTART_INTERVAL;
+		writer.f = ftp_i_file_create(index_path, &tmp_path);
+		/* The header is written last, when the counts are known. */
+		writer.ok = writer.f && fseek(writer.f, sizeof(ftp_i_index_header), SEEK_SET) == 0;
+
+		/* Merge the kept entries of the old index with the walked ones. */
+		struct ftp_i_index_cursor cur;
+		memset(&cur, 0, sizeof(struct ftp_i_index_cursor));
+		ftp_bool have_old = ftp_bfalse;
+		if (old) {
+			ftp_i_index_cursor_init(&cur, old);
+			have_old = ftp_i_index_cursor_next(&cur);
+		}
+		size_t i = 0;
+		while (writer.ok && (have_old || i < w.entries->count)) {
+			if (have_old && !ftp_i_index_keep_old(cur.path, root, root_len, w.kept)) {
+				have_old = ftp_i_index_cursor_next(&cur);
+				continue;
+			}
+			int cmp = !have_old ? 1 : i == w.entries->count ? -1 : strcmp(cur.path, w.entries->entries[i].filename);
+			if (cmp < 0) {
+				ftp_i_index_write_record(&writer, cur.path, &cur.facts);
+				have_old = ftp_i_index_cursor_next(&cur);
+			} else {
+				if (cmp == 0)
+					have_old = ftp_i_index_cursor_next(&cur);
+				ftp_i_index_write_record(&writer, w.entries->entries[i].filename, &w.entries->entries[i].facts);
+				i++;
+			}
+		}
+		if (cur.damaged)
+			writer.ok = ftp_bfalse;
+		ftp_i_free(cur.path);
+
+		if (!writer.f || ftp_i_index_write_finish(&writer, tmp_path, index_path) != FTP_OK) {
+			ftp_i_connection_set_error(c, errno == ENOMEM ? FTP_ECOULDNOTALLOCATE : FTP_ELOCALFILE);
+			status = FTP_ERROR;
+		}
+	}
+
+	ftp_free_array(w.entries);
+	ftp_free_name_array(w.kept);
+	ftp_i_free(walk_root);
+	ftp_index_close(old);
+	return status;
+}
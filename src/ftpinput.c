@@ -28,6 +28,7 @@
 #include <string.h>
 #include "ftpfunctions.h"
 #include "ftpcommands.h"
+#include "ftpsignals.h"
 
 #define SIGN_TERMINATE (-1)
 #define SIGN_NOTHING 0
@@ -49,11 +50,20 @@ void* ftp_i_input_thread(void *connection)
 {
 	ftp_connection *c = (ftp_connection *)connection;
 
-	ftp_i_managed_buffer *message = ftp_i_managed_buffer_new();
+	/* The message buffer is only allocated once input arrives, so that idle
+	 * connections do not hold one. */
+	ftp_i_managed_buffer *message = NULL;
+	/* Whether the current line is longer than max_reply_size. */
+	ftp_bool truncated = ftp_bfalse;
 
 	while (!c->_release_input_thread) {
 		char current;
 		if (ftp_i_read(c, 0, &current, 1) == 1) {
+			if (!message && !(message = ftp_i_managed_buffer_new())) {
+				FTP_ERR("Allocation error.\n");
+				ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
+				break;
+			}
 			if (current == CHAR_LF)
 				// Ignoring newline characters.
 				continue;
@@ -67,13 +77,19 @@ void* ftp_i_input_thread(void *connection)
 					ftp_i_connection_set_error(c, FTP_EUNEXPECTED);
 					break;
 				}
+				if (truncated) {
+					c->_reply_too_large = ftp_btrue;
+					truncated = ftp_bfalse;
+				}
 				if (ftp_i_process_input(c, message))
 					// Processed message requires this input thread to terminate in order to
 					// notify the waiting main thread.
 					break;
 				// Reset message buffer.
 				ftp_i_managed_buffer_free(message);
-				message = ftp_i_managed_buffer_new();
+			} else if (c->max_reply_size && ftp_i_managed_buffer_length(message) >= c->max_reply_size) {
+				// The rest of the line is skipped, the reply code is still processed.
+				truncated = ftp_btrue;
 			} else {
 				if (ftp_i_managed_buffer_append(message, (void *)&current, 1) != FTP_OK) {
 					FTP_ERR("Allocation error.\n");
@@ -109,21 +125,90 @@ void* ftp_i_input_thread(void *connection)
 	return NULL;
 }
 
+/*
+ * Stores the text of a server answer in _last_answer_buffer.
+ */
+static ftp_bool ftp_i_store_last_answer(ftp_connection *c, char *text, size_t len)
+{
+	if (c->_last_answer_buffer) {
+		FTP_WARN("BUG: _last_answer_buffer is not empty.\n");
+		ftp_i_managed_buffer_free(c->_last_answer_buffer);
+	}
+	ftp_i_managed_buffer *last_answer = ftp_i_managed_buffer_new();
+	if (!last_answer || ftp_i_managed_buffer_append(last_answer, text, len) != FTP_OK) {
+		FTP_ERR("Allocation error.\n");
+		ftp_i_managed_buffer_free(last_answer);
+		return ftp_bfalse;
+	}
+	c->_last_answer_buffer = (void *)last_answer;
+	return ftp_btrue;
+}
+
+/*
+ * Determines whether the text of an answer with this signal has to be stored.
+ */
+static ftp_bool ftp_i_answer_is_locked(ftp_connection *c, int signal, ftp_bool multiline)
+{
+	if (c->_last_answer_lock_signal == FTP_INTERNAL_SIGNAL_STATUS)
+		return multiline && signal >= FTP_SIGNAL_SYSTEM_STATUS && signal <= FTP_SIGNAL_FILE_STATUS;
+	return c->_last_answer_lock_signal != SIGN_NOTHING && c->_last_answer_lock_signal == signal;
+}
+
+/*
+ * Whether signal ends a command. 1xx and 3xx replies (e.g. 150 to RETR or 350 to REST)
+ * are followed by another reply.
+ */
+static ftp_bool ftp_i_is_final_reply(int signal)
+{
+	return signal >= 200 && (signal < 300 || signal >= 400);
+}
+
 /*
  * Processes raw input bytes from the server. An input message usually starts with a
  * three-digit code and may contain further information appended to it.
+ * Multi-line answers ("123-First line" ... "123 Last line") are only processed once the
+ * last line arrives. If the answer is locked (_last_answer_lock_signal), the lines in
+ * between are collected in _last_answer_buffer, each terminated with CRLF.
  * This function returns ftp_btrue if the processed signal is a trigger or an error signal.
  */
 ftp_bool ftp_i_process_input(ftp_connection *c, ftp_i_managed_buffer *buf)
 {
 	int signal;
-	ftp_bool is_error;
+	ftp_bool is_error, last_line;
+	char *line = ftp_i_managed_buffer_cbuf(buf);
 
-	if (ftp_i_managed_buffer_length(buf) < 3)
-		return ftp_bfalse;
+	signal = ftp_i_managed_buffer_length(buf) < 3 ? FTP_INTERNAL_SIGNAL_ERROR : ftp_i_input_sign(line);
+	last_line = (signal != FTP_INTERNAL_SIGNAL_ERROR && line[3] != '-');
 
-	if ((signal = ftp_i_input_sign(ftp_i_managed_buffer_cbuf(buf))) == FTP_INTERNAL_SIGNAL_ERROR)
+	if (c->_multiline_signal != SIGN_NOTHING) {
+		if (!last_line || signal != c->_multiline_signal) {
+			/* Line inside a multi-line answer. */
+#ifdef FTP_SERVER_VERBOSE
+			printf("# [server->client] ");
+			if (c->_temporary)
+				printf("(TMP) ");
+			ftp_i_managed_buffer_print(buf, ftp_btrue);
+#endif
+			ftp_i_managed_buffer *answer = c->_last_answer_buffer;
+			if (ftp_i_answer_is_locked(c, c->_multiline_signal, ftp_btrue) && answer) {
+				if (c->max_reply_size && ftp_i_managed_buffer_length(answer) +
+					ftp_i_managed_buffer_length(buf) + 2 > c->max_reply_size) {
+					// The answer is dropped, the waiting operation fails once it is complete.
+					ftp_i_managed_buffer_free(c->_last_answer_buffer);
+					c->_last_answer_buffer = NULL;
+					c->_reply_too_large = ftp_btrue;
+				} else if (ftp_i_managed_buffer_append(answer, line, ftp_i_managed_buffer_length(buf)) != FTP_OK ||
+					ftp_i_managed_buffer_append(answer, FTP_CENDL, 2) != FTP_OK)
+					FTP_ERR("Allocation error.\n");
+			}
+			return ftp_bfalse;
+		}
+	}
+
+	if (signal == FTP_INTERNAL_SIGNAL_ERROR) {
+		c->_reply_too_large = ftp_bfalse;
 		return ftp_bfalse;
+	}
 
 #ifdef FTP_SERVER_VERBOSE
 	printf("# [server->client] ");
@@ -132,31 +217,69 @@ ftp_bool ftp_i_process_input(ftp_connection *c, ftp_i_managed_buffer *buf)
 	ftp_i_managed_buffer_print(buf, ftp_btrue);
 #endif
 
+	if (!last_line) {
+		/* First line of a multi-line answer. */
+		c->_multiline_signal = signal;
+		if (ftp_i_answer_is_locked(c, signal, ftp_btrue))
+			ftp_i_store_last_answer(c, "", 0);
+		return ftp_bfalse;
+	}
+
+	/* Only reported if somebody waits for this answer. */
+	ftp_bool too_large = c->_reply_too_large;
+	c->_reply_too_large = ftp_bfalse;
+
+	/* Replies arrive in order. Keepalive NOOPs are only sent while a transfer runs or
+	 * before the next command, so a final reply is either the answer to a pending NOOP
+	 * or the completion of the transfer. While a transfer runs, only 200 and 202 (the
+	 * valid NOOP answers) are taken as NOOP answers. */
+	int transfer = __atomic_load_n(&c->_transfer_state, __ATOMIC_ACQUIRE);
+	if (ftp_i_is_final_reply(signal) && __atomic_load_n(&c->_pending_noops, __ATOMIC_ACQUIRE) > 0 &&
+		(transfer == FTP_I_TRANSFER_IDLE || signal == FTP_SIGNAL_COMMAND_OKAY ||
+		signal == FTP_SIGNAL_COMMAND_SUPERFLUOUS)) {
+		// Answer to a keepalive NOOP that nobody waits for.
+		__atomic_sub_fetch(&c->_pending_noops, 1, __ATOMIC_ACQ_REL);
+		c->_multiline_signal = SIGN_NOTHING;
+		return ftp_bfalse;
+	}
+
+	if (ftp_i_is_final_reply(signal) && transfer != FTP_I_TRANSFER_IDLE) {
+		// The transfer is over, whatever the code is (226, 250, 426, 550, ...). If the
+		// client stopped reading it before, the reply is dropped, otherwise it is
+		// processed as usual.
+		int state = __atomic_exchange_n(&c->_transfer_state, FTP_I_TRANSFER_IDLE, __ATOMIC_ACQ_REL);
+		if (state == FTP_I_TRANSFER_ABORTED) {
+			c->_multiline_signal = SIGN_NOTHING;
+			return ftp_bfalse;
+		}
+	}
+
 	c->last_signal = signal;
 	is_error = ftp_i_signal_is_error(signal);
 	if (is_error)
 		c->_internal_error_signal = ftp_btrue;
 
-	if (c->_last_answer_lock_signal != SIGN_NOTHING && c->_last_answer_lock_signal == signal) {
+	ftp_bool multiline = (c->_multiline_signal != SIGN_NOTHING);
+	if (multiline) {
+		/* Last line of a multi-line answer, the text was already collected. */
+		c->_multiline_signal = SIGN_NOTHING;
+	} else if (ftp_i_answer_is_locked(c, signal, ftp_bfalse) && !too_large) {
 		// Store the string attached to the signal number.
-		if (c->_last_answer_buffer) {
-			FTP_WARN("BUG: _last_answer_buffer is not empty.\n");
-			ftp_i_managed_buffer_free(c->_last_answer_buffer);
-		}
-		ftp_i_managed_buffer *last_answer = ftp_i_managed_buffer_new();
-		if (ftp_i_managed_buffer_memcpy(last_answer, buf, 4, ftp_i_managed_buffer_length(buf) - 4) != FTP_OK) {
-			FTP_ERR("Allocation error.\n");
-			ftp_i_managed_buffer_free(last_answer);
+		size_t len = ftp_i_managed_buffer_length(buf);
+		if (!ftp_i_store_last_answer(c, line + (len > 4 ? 4 : len), (len > 4 ? len - 4 : 0)))
 			return ftp_bfalse;
-		}
-		c->_last_answer_buffer = (void *)last_answer;
 	}
+	if (too_large && ftp_i_answer_is_locked(c, signal, multiline))
+		// Incomplete answers are not passed on.
+		ftp_i_managed_buffer_free(c->_last_answer_buffer);
 
 	if (ftp_i_has_triggers(c))
 		// This connection waits for something. We will return true if a trigger signal was
 		// reached and also if the signal is an error.
-		if (is_error || ftp_i_is_trigger(c, signal))
+		if (is_error || ftp_i_is_trigger(c, signal)) {
+			c->_reply_too_large = too_large;
 			return ftp_btrue;
+		}
 
 	return ftp_bfalse;
 }
@@ -182,7 +305,14 @@ int ftp_i_establish_input_thread(ftp_connection *c)
 	if (c->_input_thread != 0)
 		FTP_WARN("BUG: trying to establish an input thread while an instance already esists.\n");
 	pthread_t t;
-	int r = pthread_create(&t, NULL, ftp_i_input_thread, c);
+	pthread_attr_t attr;
+	int r;
+	if ((r = pthread_attr_init(&attr)) != 0)
+		return r;
+	if (c->low_memory_idle)
+		pthread_attr_setstacksize(&attr, FTP_INPUT_THREAD_STACK_SIZE);
+	r = pthread_create(&t, &attr, ftp_i_input_thread, c);
+	pthread_attr_destroy(&attr);
 	c->_input_thread = t;
 	return r;
 }
@@ -205,6 +335,17 @@ ftp_status ftp_i_wait_for_triggers(ftp_connection *c)
 		return FTP_ERROR;
 	}
 
+	if (c->_reply_too_large) {
+		c->_reply_too_large = ftp_bfalse;
+		ftp_i_connection_set_error(c, FTP_EREPLYTOOLARGE);
+	}
+
+#ifdef FTP_TLS_ENABLED
+	// The input thread is not running, so the TLS state can be changed safely.
+	if (c->_tls_info)
+		ftp_i_tls_set_release_buffers(c->_tls_info, c->low_memory_idle);
+#endif
+
 	ftp_bool result = FTP_OK;
 	if (c->error != 0)
 		// An error occurred while waiting for the trigger (timeout, socket error, ...)
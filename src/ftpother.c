@@ -30,8 +30,6 @@
 #include <time.h>
 #include "ftpfunctions.h"
 
-#define TM_YEAR_OFFSET 1900
-
 
 inline long ftp_i_seconds_between(struct timeval t1, struct timeval t2)
 {
@@ -188,51 +186,109 @@ int ftp_i_unix_mode_from_string(char *string, ftp_bool *is_dir)
 	return (modeowner * 100) + (modegroup * 10) + modeother;
 }
 
+/*
+ * Reads len decimal digits; stops at the first non-digit.
+ */
+static inline unsigned int ftp_i_digits(const char *str, int len)
+{
+	unsigned int v = 0;
+	for (int i = 0; i < len && str[i] >= '0' && str[i] <= '9'; i++)
+		v = v * 10 + (unsigned int)(str[i] - '0');
+	return v;
+}
+
+/*
+ * Reads the decimal number at the start of str (at most len characters). Returns
+ * ftp_bfalse if there is no digit or the number does not fit into an ftp_offset.
+ */
+ftp_bool ftp_i_parse_offset(const char *str, size_t len, ftp_offset *value)
+{
+	ftp_offset v = 0;
+	size_t i;
+	for (i = 0; i < len && str[i] >= '0' && str[i] <= '9'; i++) {
+		unsigned int digit = (unsigned int)(str[i] - '0');
+		if (v > (UINT64_MAX - digit) / 10)
+			return ftp_bfalse;
+		v = v * 10 + digit;
+	}
+	if (i == 0)
+		return ftp_bfalse;
+	*value = v;
+	return ftp_btrue;
+}
+
 /**
  * Parses a MLSD date response in the format YYYYMMDDHHMMSS(.sss)
- * @param  str 14 characters of MLSD date
+ * @param  str MLSD date, does not need to be null-terminated
+ * @param  len Length of the date value
  * @return     The date.
  */
-ftp_date ftp_i_date_from_string(char *str)
+ftp_date ftp_i_date_from_string(const char *str, size_t len)
 {
-	if (strlen(str) < 14) {
+	if (len < 14) {
 		FTP_WARN("MLSD date fact is not in the appropriate format.\n");
 		return ftp_i_date_from_values(0, 0, 0, 0, 0, 0);
 	}
-	char year[5], month[3], day[3], hour[3], minute[3], second[3];
-	ftp_i_memcpy_nulltrm(year, str, 0, 4);
-	ftp_i_memcpy_nulltrm(month, str, 4, 2);
-	ftp_i_memcpy_nulltrm(day, str, 6, 2);
-	ftp_i_memcpy_nulltrm(hour, str, 8, 2);
-	ftp_i_memcpy_nulltrm(minute, str, 10, 2);
-	ftp_i_memcpy_nulltrm(second, str, 12, 2);
-	unsigned int y, m, d, h, min, s;
-	y = (unsigned int)strtol(year, NULL, 10);
-	m = (unsigned int)strtol(month, NULL, 10);
-	d = (unsigned int)strtol(day, NULL, 10);
-	h = (unsigned int)strtol(hour, NULL, 10);
-	min = (unsigned int)strtol(minute, NULL, 10);
-	s = (unsigned int)strtol(second, NULL, 10);
-	return ftp_i_date_from_values(y, m, d, h, min, s);
+	return ftp_i_date_from_values(ftp_i_digits(str, 4), ftp_i_digits(str + 4, 2), ftp_i_digits(str + 6, 2),
+		ftp_i_digits(str + 8, 2), ftp_i_digits(str + 10, 2), ftp_i_digits(str + 12, 2));
+}
+
+/*
+ * Days between 1970-01-01 and the given day of the proleptic Gregorian calendar
+ * (month 1-12). This needs neither the time zone nor any lock, unlike mktime.
+ */
+static int64_t ftp_i_days_from_civil(int64_t y, unsigned int m, unsigned int d)
+{
+	y -= m <= 2;
+	int64_t era = (y >= 0 ? y : y - 399) / 400;
+	int64_t yoe = y - era * 400;
+	int64_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+/*
+ * Converts seconds since 1970-01-01 00:00:00 UTC to a date in UTC.
+ */
+ftp_date ftp_i_date_from_unix_timestamp(int64_t ts)
+{
+	int64_t days = ts / 86400, secs = ts % 86400;
+	if (secs < 0) {
+		secs += 86400;
+		days--;
+	}
+
+	/* The inverse of ftp_i_days_from_civil. */
+	days += 719468;
+	int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+	int64_t doe = days - era * 146097;
+	int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	int64_t mp = (5 * doy + 2) / 153;
+	unsigned int month = (unsigned int)(mp < 10 ? mp + 3 : mp - 9);
+	int64_t year = yoe + era * 400 + (month <= 2);
+	if (year < 0)
+		return ftp_i_date_from_values(0, 0, 0, 0, 0, 0);
+
+	return ftp_i_date_from_values((unsigned int)year, month, (unsigned int)(doy - (153 * mp + 2) / 5 + 1),
+		(unsigned int)(secs / 3600), (unsigned int)(secs / 60 % 60), (unsigned int)(secs % 60));
 }
 
-static inline time_t convert_timestamp_to_time_t(unsigned long timestamp)
+/*
+ * Converts a date in UTC to seconds since 1970-01-01 00:00:00 UTC; 0 for an unset date.
+ */
+int64_t ftp_i_date_to_unix_timestamp(const ftp_date *date)
 {
-	/*
-	 * This function may or may not be heavily platform dependent as the
-	 * implementation of time_t can vary. If you have a better idea on how to
-	 * do this, please let me know.
-	 */
-	return (time_t)timestamp;
+	if (date->year == 0 || date->month < 1 || date->month > 12)
+		return 0;
+	return ftp_i_days_from_civil(date->year, date->month, date->day) * 86400 +
+		date->hour * 3600 + date->minute * 60 + date->second;
 }
 
-ftp_date ftp_i_date_from_unix_timestamp(unsigned long ts)
+void ftp_i_time_context_init(ftp_i_time_context *t)
 {
-	time_t timestamp = convert_timestamp_to_time_t(ts);
-	struct tm *local = localtime(&timestamp);
-	if (!local)
-		return ftp_i_date_from_values(0,0,0,0,0,0);
-	return ftp_i_date_from_values(local->tm_year + TM_YEAR_OFFSET, local->tm_mon, local->tm_mday, local->tm_hour, local->tm_min, local->tm_sec);
+	t->now = (int64_t)time(NULL);
+	t->current_year = ftp_i_date_from_unix_timestamp(t->now).year;
 }
 
 #pragma mark - Managed Buffer
@@ -256,32 +312,34 @@ ftp_i_managed_buffer *ftp_i_managed_buffer_new(void)
 	return buf;
 }
 
-ftp_status ftp_i_managed_buffer_append(ftp_i_managed_buffer *buf, void *data, unsigned long length)
+ftp_status ftp_i_managed_buffer_append(ftp_i_managed_buffer *buf, void *data, size_t length)
 {
 	if (!buf)
 		return FTP_ERROR;
+	if (length > SIZE_MAX - 1000 - buf->length)
+		return FTP_ERROR;
 	if (buf->length + length + 1 > buf->size) {
-		//we create 1000 bytes extra so realloc is used less often
-		unsigned long newsiz = buf->length + length + 1000;
+		//grow by at least half of the current size so large buffers are not reallocated all the time
+		size_t newsiz = buf->length + length + 1000;
+		if (buf->size / 2 <= SIZE_MAX - buf->size && newsiz < buf->size + buf->size / 2)
+			newsiz = buf->size + buf->size / 2;
 		void *newbuf = realloc(buf->buffer, newsiz);
 		if (!newbuf)
 			return FTP_ERROR;
 		buf->buffer = newbuf;
 		buf->size = newsiz;
 	}
-	unsigned long lo = 0;
-	unsigned char *in = (unsigned char*)data, *out = (unsigned char*)buf->buffer;
-	while (lo < length)
-		*(out + (buf->offset++)) = *(in + (lo++));
-	*(out + buf->offset) = 0; //buffer is always null-terminated
+	memcpy((char*)buf->buffer + buf->offset, data, length);
+	buf->offset += length;
+	*((char*)buf->buffer + buf->offset) = 0; //buffer is always null-terminated
 	buf->length += length;
 	return FTP_OK;
 }
 
-unsigned long ftp_i_managed_buffer_read(ftp_i_managed_buffer *buf, void *data, unsigned long preferred_length)
+size_t ftp_i_managed_buffer_read(ftp_i_managed_buffer *buf, void *data, size_t preferred_length)
 {
 	unsigned char *out = (unsigned char*)data, *in = (unsigned char*)buf->buffer;
-	unsigned long lo = 0;
+	size_t lo = 0;
 	while (lo < preferred_length && buf->offset < buf->length)
 		*(out + (lo++)) = *(in + (buf->offset++));
 	return lo;
@@ -290,7 +348,7 @@ unsigned long ftp_i_managed_buffer_read(ftp_i_managed_buffer *buf, void *data, u
 ftp_bool ftp_i_managed_buffer_contains_str(ftp_i_managed_buffer *buf, char *str, ftp_bool startswith)
 {
 	char *bufs = ftp_i_managed_buffer_cbuf(buf);
-	unsigned long current = 0;
+	size_t current = 0;
 
 	while (*bufs)
 	{
@@ -311,9 +369,9 @@ ftp_bool ftp_i_managed_buffer_contains_str(ftp_i_managed_buffer *buf, char *str,
 	return ftp_bfalse;
 }
 
-ftp_status ftp_i_managed_buffer_memcpy(ftp_i_managed_buffer *dest, const ftp_i_managed_buffer *src, unsigned long offset, unsigned long length)
+ftp_status ftp_i_managed_buffer_memcpy(ftp_i_managed_buffer *dest, const ftp_i_managed_buffer *src, size_t offset, size_t length)
 {
-	if (src->length < offset + length)
+	if (offset > src->length || length > src->length - offset)
 		return FTP_ERROR;
 	return ftp_i_managed_buffer_append(dest, src->buffer + offset, length);
 }
@@ -330,7 +388,7 @@ ftp_status ftp_i_managed_buffer_duplicate(ftp_i_managed_buffer *dest, const ftp_
 void ftp_i_managed_buffer_print(ftp_i_managed_buffer *buf, ftp_bool ignore_newlines)
 {
 	unsigned char *b = buf->buffer;
-	unsigned long l = 0;
+	size_t l = 0;
 	while (l < buf->length) {
 		if (!ignore_newlines ||
 			(*(b+l) != CHAR_CR && *(b+l) != CHAR_LF))
@@ -361,3 +419,10 @@ void ftp_i_managed_buffer_release(ftp_i_managed_buffer *buf)
 	ftp_i_free(buf->buffer);
 	ftp_i_free(buf);
 }
+
+void ftp_i_managed_buffer_clear(ftp_i_managed_buffer *buf)
+{
+	buf->offset = 0;
+	buf->length = 0;
+	*(char*)(buf->buffer) = 0;
+}
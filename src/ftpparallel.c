@@ -0,0 +1,109 @@
+/*   libmftp
+ *
+ *   Copyright (c) 2014 nkreipke
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "ftpfunctions.h"
+
+/* Upper bound for the number of connections used by ftp_i_list_paths: */
+#define FTP_MAX_PARALLEL_LISTINGS 16
+
+struct ftp_i_listing_worker {
+	ftp_connection *c;
+	struct ftp_i_listing_job *jobs;
+	size_t count;
+	size_t *next;
+	pthread_mutex_t *lock;
+	pthread_t thread;
+	ftp_bool started;
+};
+
+static void *ftp_i_listing_worker_run(void *context)
+{
+	struct ftp_i_listing_worker *w = context;
+	while (ftp_i_connection_is_ready(w->c)) {
+		pthread_mutex_lock(w->lock);
+		size_t i = (*w->next)++;
+		pthread_mutex_unlock(w->lock);
+		if (i >= w->count)
+			break;
+
+		struct ftp_i_listing_job *job = &w->jobs[i];
+		job->result = ftp_i_contents_of_path(w->c, job->path);
+		job->error = job->result ? 0 : w->c->error;
+	}
+	return NULL;
+}
+
+/*
+ * Lists the directories of all jobs, using up to max_connections connections of the queue
+ * at once. Every job gets either a result or an error; jobs that could not be started
+ * because all connections broke down get FTP_ENOTREADY. Returns FTP_ERROR (and sets
+ * c->error) only if no connection was usable at all.
+ * The connections stay in the queue for further calls, use ftp_i_trim_queue afterwards.
+ */
+ftp_status ftp_i_list_paths(ftp_connection *c, struct ftp_i_listing_job *jobs, size_t count, unsigned int max_connections)
+{
+	ftp_connection *connections[FTP_MAX_PARALLEL_LISTINGS];
+	struct ftp_i_listing_worker workers[FTP_MAX_PARALLEL_LISTINGS];
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	size_t next = 0;
+	int i, n;
+
+	for (size_t j = 0; j < count; j++) {
+		jobs[j].result = NULL;
+		jobs[j].error = FTP_ENOTREADY;
+	}
+	if (count == 0)
+		return FTP_OK;
+
+	if (max_connections > FTP_MAX_PARALLEL_LISTINGS)
+		max_connections = FTP_MAX_PARALLEL_LISTINGS;
+	if (max_connections > count)
+		max_connections = (unsigned int)count;
+	if (max_connections < 1)
+		max_connections = 1;
+
+	if ((n = ftp_i_claim_idle_connections(c, connections, (int)max_connections)) == 0) {
+		ftp_i_connection_set_error(c, FTP_ENOTREADY);
+		return FTP_ERROR;
+	}
+
+	for (i = 0; i < n; i++) {
+		workers[i] = (struct ftp_i_listing_worker){connections[i], jobs, count, &next, &lock, 0, ftp_bfalse};
+		/* the last worker runs on this thread */
+		if (i < n - 1)
+			workers[i].started = (pthread_create(&workers[i].thread, NULL, ftp_i_listing_worker_run, &workers[i]) == 0);
+	}
+	ftp_i_listing_worker_run(&workers[n - 1]);
+	for (i = 0; i < n - 1; i++) {
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+	}
+	pthread_mutex_destroy(&lock);
+	return FTP_OK;
+}
@@ -32,97 +32,23 @@ NCSA Telnet FTP server. Has LIST = NLST (and bad NLST for directories).
 */
 
 
-#include <time.h>
 #include "ftpparse.h"
 
-static long totai(long year,long month,long mday)
-{
-	long result;
-	if (month >= 2) month -= 2;
-	else { month += 10; --year; }
-	result = (mday - 1) * 10 + 5 + 306 * month;
-	result /= 10;
-	if (result == 365) { year -= 3; result = 1460; }
-	else result += 365 * (year % 4);
-	year /= 4;
-	result += 1461 * (year % 25);
-	year /= 25;
-	if (result == 36524) { year -= 3; result = 146096; }
-	else { result += 36524 * (year % 4); }
-	year /= 4;
-	result += 146097 * (year - 5);
-	result += 11017;
-	return result * 86400;
-}
-
-static int flagneedbase = 1;
-static time_t base; /* time() value on this OS at the beginning of 1970 TAI */
-static long now; /* current time */
-static int flagneedcurrentyear = 1;
-static long currentyear; /* approximation to current year */
-
-static void initbase(void)
-{
-	struct tm *t;
-	if (!flagneedbase) return;
-
-	base = 0;
-	t = gmtime(&base);
-	base = -(totai(t->tm_year + 1900,t->tm_mon,t->tm_mday) + t->tm_hour * 3600 + t->tm_min * 60 + t->tm_sec);
-	/* assumes the right time_t, counting seconds. */
-	/* base may be slightly off if time_t counts non-leap seconds. */
-	flagneedbase = 0;
-}
-
-static void initnow(void)
-{
-	long day;
-	long year;
-
-	initbase();
-	now = time((time_t *) 0) - base;
-
-	if (flagneedcurrentyear) {
-		day = now / 86400;
-		if ((now % 86400) < 0) --day;
-		day -= 11017;
-		year = 5 + day / 146097;
-		day = day % 146097;
-		if (day < 0) { day += 146097; --year; }
-		year *= 4;
-		if (day == 146096) { year += 3; day = 36524; }
-		else { year += day / 36524; day %= 36524; }
-		year *= 25;
-		year += day / 1461;
-		day %= 1461;
-		year *= 4;
-		if (day == 1460) { year += 3; day = 365; }
-		else { year += day / 365; day %= 365; }
-		day *= 10;
-		if ((day + 5) / 306 >= 10) ++year;
-		currentyear = year;
-		flagneedcurrentyear = 0;
-	}
-}
-
 /* UNIX ls does not show the year for dates in the last six months. */
 /* So we have to guess the year. */
 /* Apparently NetWare uses ``twelve months'' instead of ``six months''; ugh. */
 /* Some versions of ls also fail to show the year for future dates. */
-static long guessyear(long month,long mday)
+/* ftpparse may run on several threads at once (see ftp_i_parse_lines), so the
+ * current time is taken once per listing by the caller instead of kept in globals. */
+static long guessyear(long month,long mday,const ftp_i_time_context *t)
 {
 	long year;
-	long t;
-
-	initnow();
-
-	for (year = currentyear - 1;year < currentyear + 100;++year) {
-		t = totai(year,month,mday);
-		if (now - t < 350 * 86400)
-			/*return t;*/
+	for (year = (long)t->current_year - 1;year < (long)t->current_year + 1;++year) {
+		ftp_date d = ftp_i_date_from_values(year, month + 1, mday, 0, 0, 0);
+		if (t->now - ftp_i_date_to_unix_timestamp(&d) < 350 * 86400)
 			return year;
 	}
-	return 0;
+	return year;
 }
 
 static int check(char *buf,char *monthname)
@@ -154,12 +80,23 @@ static long getlong(char *buf,int len)
 	return u;
 }
 
-int ftpparse(struct ftpparse *fp,char *buf,int len)
+/* sizes may not fit into a long; returns 0 if buf is no number or too large. */
+static int getsize(char *buf,int len,ftp_offset *size)
+{
+	int i;
+	for (i = 0;i < len;++i)
+		if ((buf[i] < '0') || (buf[i] > '9')) return 0;
+	return ftp_i_parse_offset(buf,len,size);
+}
+
+int ftpparse(struct ftpparse *fp,char *buf,int len,const ftp_i_time_context *now)
 {
 	int i;
 	int j;
 	int state;
-	long size;
+	ftp_offset size;
+	int sizeok = 0;
+	ftp_offset timestamp;
 	long year;
 	long month;
 	long mday;
@@ -177,6 +114,8 @@ int ftpparse(struct ftpparse *fp,char *buf,int len)
 	fp->idtype = FTPPARSE_ID_UNKNOWN;
 	fp->id = 0;
 	fp->idlen = 0;
+	fp->unix_permissions[0] = 0;
+	fp->mtime_given = ftp_bfalse;
 
 	if (len < 2) /* an empty name in EPLF, with no info, could be 2 chars */
 		return 0;
@@ -202,15 +141,17 @@ int ftpparse(struct ftpparse *fp,char *buf,int len)
 							fp->flagtryretr = 1;
 							break;
 						case 's':
-							fp->sizetype = FTPPARSE_SIZE_BINARY;
-							fp->size = getlong(buf + i + 1,j - i - 1);
+							if (getsize(buf + i + 1,j - i - 1,&fp->size))
+								fp->sizetype = FTPPARSE_SIZE_BINARY;
 							break;
 						case 'm':
 							/*fp->mtimetype = FTPPARSE_MTIME_LOCAL;
 							initbase();
 							fp->mtime = base + getlong(buf + i + 1,j - i - 1);*/
-							fp->mtime = ftp_i_date_from_unix_timestamp(getlong(buf + i + 1,j - i - 1));
-							fp->mtime_given = ftp_btrue;
+							if (getsize(buf + i + 1,j - i - 1,&timestamp) && timestamp <= INT64_MAX) {
+								fp->mtime = ftp_i_date_from_unix_timestamp((int64_t)timestamp);
+								fp->mtime_given = ftp_btrue;
+							}
 							break;
 						case 'i':
 							fp->idtype = FTPPARSE_ID_FULL;
@@ -259,8 +200,11 @@ int ftpparse(struct ftpparse *fp,char *buf,int len)
 
 			state = 1;
 			i = 0;
-			for (j = 1;j < len;++j)
-				if ((buf[j] == ' ') && (buf[j - 1] != ' ')) {
+			for (j = 1;(j < len) && (state != 8);++j) {
+				/* jump to the next space */
+				j = ftp_i_scan(buf + j,buf + len,' ') - buf;
+				if (j == len) break;
+				if (buf[j - 1] != ' ') {
 					switch(state) {
 						case 1: /* skipping perm */
 							state = 2;
@@ -274,7 +218,7 @@ int ftpparse(struct ftpparse *fp,char *buf,int len)
 							state = 4;
 							break;
 						case 4: /* getting tentative size */
-							size = getlong(buf + i,j - i);
+							sizeok = getsize(buf + i,j - i,&size);
 							state = 5;
 							break;
 						case 5: /* searching for month, otherwise getting tentative size */
@@ -282,7 +226,7 @@ int ftpparse(struct ftpparse *fp,char *buf,int len)
 							if (month >= 0)
 								state = 6;
 							else
-								size = getlong(buf + i,j - i);
+								sizeok = getsize(buf + i,j - i,&size);
 							break;
 						case 6: /* have size and month */
 							mday = getlong(buf + i,j - i);
@@ -292,27 +236,28 @@ int ftpparse(struct ftpparse *fp,char *buf,int len)
 							if ((j - i == 4) && (buf[i + 1] == ':')) {
 								hour = getlong(buf + i,1);
 								minute = getlong(buf + i + 2,2);
-								year = guessyear(month, mday);
+								year = guessyear(month, mday, now);
 								/*fp->mtimetype = FTPPARSE_MTIME_REMOTEMINUTE;
 								initbase();
 								fp->mtime = base + guesstai(month,mday) + hour * 3600 + minute * 60;*/
 							} else if ((j - i == 5) && (buf[i + 2] == ':')) {
 								hour = getlong(buf + i,2);
 								minute = getlong(buf + i + 3,2);
-								year = guessyear(month, mday);
+								year = guessyear(month, mday, now);
 								/*fp->mtimetype = FTPPARSE_MTIME_REMOTEMINUTE;
 								initbase();
 								fp->mtime = base + guesstai(month,mday) + hour * 3600 + minute * 60;*/
 							}
 							else if (j - i >= 4) {
 								year = getlong(buf + i,j - i);
+								hour = minute = 0;
 								/*fp->mtimetype = FTPPARSE_MTIME_REMOTEDAY;
 								initbase();
 								fp->mtime = base + totai(year,month,mday);*/
 							}
 							else
 								return 0;
-							fp->mtime = ftp_i_date_from_values(year, month, mday, hour, minute, 0);
+							fp->mtime = ftp_i_date_from_values(year, month + 1, mday, hour, minute, 0);
 							fp->mtime_given = ftp_btrue;
 							fp->name = buf + j + 1;
 							fp->namelen = len - j - 1;
@@ -324,12 +269,15 @@ int ftpparse(struct ftpparse *fp,char *buf,int len)
 					i = j + 1;
 					while ((i < len) && (buf[i] == ' ')) ++i;
 				}
+			}
 
 			if (state != 8)
 				return 0;
 
-			fp->size = size;
-			fp->sizetype = FTPPARSE_SIZE_BINARY;
+			if (sizeok) {
+				fp->size = size;
+				fp->sizetype = FTPPARSE_SIZE_BINARY;
+			}
 
 			if (*buf == 'l')
 				for (i = 0;i + 3 < fp->namelen;++i)
@@ -403,7 +351,7 @@ int ftpparse(struct ftpparse *fp,char *buf,int len)
 		/*fp->mtimetype = FTPPARSE_MTIME_REMOTEMINUTE;
 		initbase();
 		fp->mtime = base + totai(year,month,mday) + hour * 3600 + minute * 60;*/
-		fp->mtime = ftp_i_date_from_values(year, month, mday, hour, minute, 0);
+		fp->mtime = ftp_i_date_from_values(year, month + 1, mday, hour, minute, 0);
 		fp->mtime_given = ftp_btrue;
 
 		return 1;
@@ -449,8 +397,8 @@ int ftpparse(struct ftpparse *fp,char *buf,int len)
 		else {
 			i = j;
 			while (buf[j] != ' ') if (++j == len) return 0;
-			fp->size = getlong(buf + i,j - i);
-			fp->sizetype = FTPPARSE_SIZE_BINARY;
+			if (getsize(buf + i,j - i,&fp->size))
+				fp->sizetype = FTPPARSE_SIZE_BINARY;
 			fp->flagtryretr = 1;
 		}
 		while (buf[j] == ' ') if (++j == len) return 0;
@@ -461,7 +409,7 @@ int ftpparse(struct ftpparse *fp,char *buf,int len)
 		/*fp->mtimetype = FTPPARSE_MTIME_REMOTEMINUTE;
 		initbase();
 		fp->mtime = base + totai(year,month,mday) + hour * 3600 + minute * 60;*/
-		fp->mtime = ftp_i_date_from_values(year, month, mday, hour, minute, 0);
+		fp->mtime = ftp_i_date_from_values(year, month + 1, mday, hour, minute, 0);
 		fp->mtime_given = ftp_btrue;
 
 		return 1;
@@ -38,10 +38,12 @@ NCSA Telnet FTP server. Has LIST = NLST (and bad NLST for directories).
 #include "ftpfunctions.h"
 
 /*
-ftpparse(&fp,buf,len) tries to parse one line of LIST output.
+ftpparse(&fp,buf,len,now) tries to parse one line of LIST output.
 
 The line is an array of len characters stored in buf.
 It should not include the terminating CR LF; so buf[len] is typically CR.
+now is used to guess the year of recent UNIX ls dates
+(see ftp_i_time_context_init).
 
 If ftpparse() can't find a filename, it returns 0.
 
@@ -57,7 +59,7 @@ struct ftpparse {
 	int flagtrycwd; /* 0 if cwd is definitely pointless, 1 otherwise */
 	int flagtryretr; /* 0 if retr is definitely pointless, 1 otherwise */
 	int sizetype;
-	long size; /* number of octets */
+	ftp_offset size; /* number of octets */
 	/*int mtimetype;
 	time_t mtime; /* modification time */
 	int idtype;
@@ -86,6 +88,6 @@ time is correct in the local time zone, and gmtime() for REMOTE* times.
 #define FTPPARSE_ID_UNKNOWN 0
 #define FTPPARSE_ID_FULL 1 /* unique identifier for files on this FTP server */
 
-extern int ftpparse(struct ftpparse *,char *,int);
+extern int ftpparse(struct ftpparse *,char *,int,const ftp_i_time_context *);
 
 #endif
@@ -23,6 +23,7 @@
 
 
 #include <stdio.h>
+#include <string.h>
 #include "ftpfunctions.h"
 
 #define FTP_MAX_TEMP_CONNECTIONS_HELD_OPEN 1
@@ -94,6 +95,17 @@ ftp_connection *ftp_i_generate_simultaneous_connection(ftp_connection *parent)
 	if ((child = ftp_open(parent->_host, parent->_port, ftp_i_open_getsecurity(parent))) == NULL)
 		return NULL;
 	child->_temporary = ftp_btrue;
+	child->low_memory_idle = parent->low_memory_idle;
+	child->keepalive_interval = parent->keepalive_interval;
+	child->reconnect_attempts = parent->reconnect_attempts;
+	child->control_connection_listing = parent->control_connection_listing;
+	child->listing_facts = parent->listing_facts;
+	child->max_listing_size = parent->max_listing_size;
+	child->max_reply_size = parent->max_reply_size;
+	child->listing_spill = parent->listing_spill;
+	/* Capabilities are already known from the parent connection. */
+	child->_current_features = parent->_current_features;
+	ftp_i_dir_cache_share(parent, child);
 
 	if (parent->_mc_user && parent->_mc_pass &&
 		ftp_auth(child, parent->_mc_user, parent->_mc_pass, ftp_bfalse) != FTP_OK) {
@@ -106,10 +118,31 @@ ftp_connection *ftp_i_generate_simultaneous_connection(ftp_connection *parent)
 		ftp_i_close(child);
 		return NULL;
 	}
+	child->_directory_generation = parent->_directory_generation;
 
 	return child;
 }
 
+/*
+ * Changes the directory of an idle queued connection to the one of the main connection
+ * if that changed since the queued connection was used last. The queued connection also
+ * picks up the directory cache, which may have been enabled after it was established.
+ */
+static ftp_bool ftp_i_follow_directory(ftp_connection *oldest, ftp_connection *c)
+{
+	if (!c->_temporary)
+		return ftp_btrue;
+	ftp_i_dir_cache_share(oldest, c);
+	if (c->_directory_generation == oldest->_directory_generation)
+		return ftp_btrue;
+
+	if (ftp_reload_cur_directory(oldest) != FTP_OK ||
+		ftp_change_cur_directory(c, oldest->cur_directory) != FTP_OK)
+		return ftp_bfalse;
+	c->_directory_generation = oldest->_directory_generation;
+	return ftp_btrue;
+}
+
 ftp_connection *ftp_i_dequeue_usable_connection(ftp_connection *c, ftp_bool no_main_connection, ftp_bool needs_free_data_connection)
 {
 	ftp_connection *oldest = ftp_i_get_oldest(c);
@@ -118,7 +151,8 @@ ftp_connection *ftp_i_dequeue_usable_connection(ftp_connection *c, ftp_bool no_m
 	while (usable &&
 		((no_main_connection && !usable->_temporary) ||
 		(needs_free_data_connection && usable->_data_connection) ||
-		!ftp_i_connection_is_ready(usable)))
+		!ftp_i_connection_is_ready(usable) ||
+		!ftp_i_follow_directory(oldest, usable)))
 		usable = usable->_child;
 
 	if (!usable) {
@@ -131,11 +165,46 @@ ftp_connection *ftp_i_dequeue_usable_connection(ftp_connection *c, ftp_bool no_m
 	return usable;
 }
 
+/*
+ * Collects up to max connections of the queue that are ready and idle, establishing new
+ * queued connections if there are not enough. Returns the number of connections stored
+ * in out (0 if not even the main connection is usable).
+ */
+int ftp_i_claim_idle_connections(ftp_connection *c, ftp_connection **out, int max)
+{
+	ftp_connection *oldest = ftp_i_get_oldest(c);
+	int n = 0;
+
+	for (ftp_connection *cur = oldest; cur && n < max; cur = cur->_child)
+		if (ftp_i_connection_is_ready(cur) && !cur->_data_connection &&
+			ftp_i_follow_directory(oldest, cur))
+			out[n++] = cur;
+
+	while (n < max) {
+		ftp_connection *child = ftp_i_generate_simultaneous_connection(oldest);
+		if (!child)
+			break;
+		FTP_LOG("Established new temp connection for parallel listing.\n");
+		ftp_i_add_connection_to_queue(oldest, child);
+		out[n++] = child;
+	}
+	return n;
+}
+
 void ftp_i_mark_as_unused(ftp_connection *c)
 {
 	if (!c->_temporary)
 		return;
 
+	ftp_i_trim_queue(c);
+}
+
+/*
+ * Closes unused queued connections until at most FTP_MAX_TEMP_CONNECTIONS_HELD_OPEN
+ * (or the number reserved with ftp_i_reserve_queued_connections, if larger) are left.
+ */
+void ftp_i_trim_queue(ftp_connection *c)
+{
 	ftp_connection *oldest = ftp_i_get_oldest(c);
 	ftp_connection *youngest = oldest;
 	int cnt = 0;
@@ -144,6 +213,91 @@ void ftp_i_mark_as_unused(ftp_connection *c)
 		cnt++;
 	}
 
-	if (cnt > FTP_MAX_TEMP_CONNECTIONS_HELD_OPEN)
-		ftp_i_queue_try_free(oldest, cnt - FTP_MAX_TEMP_CONNECTIONS_HELD_OPEN);
-}
\ No newline at end of file
+	int keep = FTP_MAX_TEMP_CONNECTIONS_HELD_OPEN;
+	if (oldest->_reserved_connections > keep)
+		keep = oldest->_reserved_connections;
+	if (cnt > keep)
+		ftp_i_queue_try_free(oldest, cnt - keep);
+}
+
+/*
+ * Changes the number of queued connections that are held open between operations by
+ * count (negative to release them again) and closes the ones no longer needed.
+ */
+void ftp_i_reserve_queued_connections(ftp_connection *c, int count)
+{
+	ftp_connection *oldest = ftp_i_get_oldest(c);
+	oldest->_reserved_connections += count;
+	if (oldest->_reserved_connections < 0)
+		oldest->_reserved_connections = 0;
+	ftp_i_trim_queue(oldest);
+}
+
+ftp_status ftp_keepalive(ftp_connection *c)
+{
+	ftp_status result = FTP_OK;
+	for (ftp_connection *cur = ftp_i_get_oldest(c); cur; cur = cur->_child) {
+		if (!ftp_i_connection_is_ready(cur))
+			continue;
+		ftp_i_set_tcp_keepalive(cur);
+		/* Connections with a running transfer do not wait for the answer. */
+		if (ftp_i_keepalive_if_due(cur, !cur->_data_connection) != FTP_OK) {
+			if (cur != c)
+				c->error = cur->error;
+			result = FTP_ERROR;
+		}
+	}
+	return result;
+}
+
+/*
+ * Estimates the memory held by a connection while it is idle.
+ */
+static size_t ftp_i_idle_footprint(ftp_connection *c)
+{
+	size_t bytes = sizeof(ftp_connection);
+	char *strings[] = {c->cur_directory, c->_host, c->_mc_user, c->_mc_pass};
+	for (int i = 0; i < sizeof(strings) / sizeof(strings[0]); i++)
+		if (strings[i])
+			bytes += strlen(strings[i]) + 1;
+	if (c->_last_answer_buffer)
+		bytes += sizeof(ftp_i_managed_buffer) + ((ftp_i_managed_buffer *)c->_last_answer_buffer)->size;
+
+	if (c->_input_thread) {
+		size_t stack = FTP_INPUT_THREAD_STACK_SIZE;
+		pthread_attr_t attr;
+		if (!c->low_memory_idle && pthread_attr_init(&attr) == 0) {
+			pthread_attr_getstacksize(&attr, &stack);
+			pthread_attr_destroy(&attr);
+		}
+		bytes += stack;
+	}
+
+#ifdef FTP_TLS_ENABLED
+	if (c->_tls_info)
+		bytes += ftp_i_tls_idle_footprint(c->_tls_info);
+#endif
+	return bytes;
+}
+
+ftp_status ftp_stats(ftp_connection *c, ftp_connection_stats *stats)
+{
+	if (!stats) {
+		ftp_i_connection_set_error(c, FTP_EARGUMENTS);
+		return FTP_ERROR;
+	}
+
+	size_t idle_bytes = 0;
+	memset(stats, 0, sizeof(ftp_connection_stats));
+	for (ftp_connection *cur = ftp_i_get_oldest(c); cur; cur = cur->_child) {
+		stats->connections++;
+		if (ftp_i_connection_is_ready(cur) && !cur->_data_connection) {
+			stats->idle_connections++;
+			idle_bytes += ftp_i_idle_footprint(cur);
+		}
+	}
+	if (stats->idle_connections > 0)
+		stats->bytes_per_idle_connection = idle_bytes / stats->idle_connections;
+
+	return FTP_OK;
+}
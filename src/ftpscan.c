@@ -0,0 +1,107 @@
+/*   libmftp
+ *
+ *   Copyright (c) 2014 nkreipke
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ftpfunctions.h"
+
+/*
+ * Byte scanning for the listing parsers. Every implementation returns a pointer to the
+ * first occurrence of c in [p, end) or end if there is none. The widest implementation
+ * the CPU supports is selected on first use.
+ */
+
+typedef char *(*ftp_i_scan_fn)(const char *, const char *, char);
+
+static char *ftp_i_scan_scalar(const char *p, const char *end, char c)
+{
+	while (p < end && *p != c)
+		p++;
+	return (char*)p;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FTP_I_SCAN_X86
+
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static char *ftp_i_scan_sse2(const char *p, const char *end, char c)
+{
+	__m128i needle = _mm_set1_epi8(c);
+	while (end - p >= 16) {
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), needle));
+		if (mask)
+			return (char*)p + __builtin_ctz(mask);
+		p += 16;
+	}
+	return ftp_i_scan_scalar(p, end, c);
+}
+
+__attribute__((target("avx2")))
+static char *ftp_i_scan_avx2(const char *p, const char *end, char c)
+{
+	__m256i needle = _mm256_set1_epi8(c);
+	while (end - p >= 32) {
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), needle));
+		if (mask)
+			return (char*)p + __builtin_ctz(mask);
+		p += 32;
+	}
+	return ftp_i_scan_sse2(p, end, c);
+}
+
+#endif
+
+static ftp_i_scan_fn ftp_i_scan_select(void)
+{
+#ifdef FTP_I_SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return ftp_i_scan_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return ftp_i_scan_sse2;
+#endif
+	return ftp_i_scan_scalar;
+}
+
+#ifdef __GNUC__
+static ftp_i_scan_fn ftp_i_scan_impl = NULL;
+
+char *ftp_i_scan(const char *p, const char *end, char c)
+{
+	ftp_i_scan_fn fn = __atomic_load_n(&ftp_i_scan_impl, __ATOMIC_RELAXED);
+	if (!fn) {
+		fn = ftp_i_scan_select();
+		__atomic_store_n(&ftp_i_scan_impl, fn, __ATOMIC_RELAXED);
+	}
+	return fn(p, end, c);
+}
+#else
+char *ftp_i_scan(const char *p, const char *end, char c)
+{
+	return ftp_i_scan_scalar(p, end, c);
+}
+#endif
@@ -24,8 +24,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include "ftpfunctions.h"
 #include "ftpsignals.h"
+#include "ftpcommands.h"
 
 /* SEVERAL PARSERS FOR SERVER ANSWERS */
 
@@ -56,11 +59,7 @@ int ftp_i_set_pwd_information(char *server_answer, char **destination_malloc)
 	//This parses the server answer for PWD:
 	// "/" is the current directory
 	int startchr = -1, endchr = -1, i = 0, len = 0;
-	if (*destination_malloc)
-		free(*destination_malloc);
-	*destination_malloc = malloc(sizeof(char) * ANSWER_LEN);
-	if (!*destination_malloc)
-		return FTP_ECOULDNOTALLOCATE;
+	ftp_i_free(*destination_malloc);
 	while (*(server_answer+i) !='\0') {
 		if (*(server_answer+i) == '\"') {
 			if (startchr == -1)
@@ -85,6 +84,120 @@ int ftp_i_set_pwd_information(char *server_answer, char **destination_malloc)
 		//can not be longer than server_answer
 		return FTP_EUNEXPECTED;
 	}
-	ftp_i_memcpy_nulltrm(*destination_malloc, server_answer, startchr, len);
+	/* Only allocate what is needed, as every connection keeps this string. */
+	ftp_i_memcpy_nulltrm_malloc(*destination_malloc, server_answer, startchr, len);
+	if (!*destination_malloc)
+		return FTP_ECOULDNOTALLOCATE;
 	return 0;
 }
+
+/*
+ * Returns the FTP_FACT_* value for a MLST fact name or 0 if the fact is unknown.
+ */
+unsigned int ftp_i_fact_from_name(const char *name, size_t len)
+{
+	/* The length and first letter select the only candidate. */
+#define ftp_i_fact_name_is(str) (strncasecmp(name, str, len) == 0)
+	switch (len) {
+	case 4:
+		if ((name[0] | 0x20) == 's')
+			return ftp_i_fact_name_is("size") ? FTP_FACT_SIZE : 0;
+		if ((name[0] | 0x20) == 't')
+			return ftp_i_fact_name_is("type") ? FTP_FACT_TYPE : 0;
+		return ftp_i_fact_name_is("perm") ? FTP_FACT_PERM : 0;
+	case 6:
+		if ((name[0] | 0x20) == 'm')
+			return ftp_i_fact_name_is("modify") ? FTP_FACT_MODIFY : 0;
+		if ((name[0] | 0x20) == 'c')
+			return ftp_i_fact_name_is("create") ? FTP_FACT_CREATE : 0;
+		return ftp_i_fact_name_is("unique") ? FTP_FACT_UNIQUE : 0;
+	case 9:
+		return ftp_i_fact_name_is("unix.mode") ? FTP_FACT_UNIXMODE : 0;
+	case 10:
+		if ((name[5] | 0x20) == 'g')
+			return ftp_i_fact_name_is("unix.group") ? FTP_FACT_UNIXGROUP : 0;
+		return ftp_i_fact_name_is("unix.owner") ? FTP_FACT_UNIXOWNER : 0;
+	}
+	return 0;
+#undef ftp_i_fact_name_is
+}
+
+/*
+ * Writes the names of the given FTP_FACT_* values as fact list ("size;type;") to list,
+ * which has to hold FTP_FACT_LIST_MAX bytes.
+ */
+void ftp_i_fact_list(unsigned int facts, char *list)
+{
+	/* In the order of the FTP_FACT_* bits: */
+	static const char *names[] = {"size", "modify", "create", "type", "unix.group",
+		"unix.mode", "perm", "unique", "unix.owner"};
+	*list = '\0';
+	for (unsigned int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (facts & (1u << i)) {
+			strcat(list, names[i]);
+			strcat(list, ";");
+		}
+	}
+}
+
+/*
+ * Parses the MLST feature line ("type*;size*;modify;").
+ */
+static void ftp_i_read_mlst_feature(char *list, struct ftp_features *f)
+{
+	while (*list) {
+		size_t len = strcspn(list, ";");
+		ftp_bool is_default = (len > 0 && list[len - 1] == '*');
+		unsigned int fact = ftp_i_fact_from_name(list, is_default ? len - 1 : len);
+		f->mlst_facts |= fact;
+		if (is_default)
+			f->mlst_default_facts |= fact;
+		list += len;
+		if (*list == ';')
+			list++;
+	}
+}
+
+static inline ftp_bool ftp_i_feature_is(const char *feature, size_t len, const char *name)
+{
+	return len == strlen(name) && strncasecmp(feature, name, len) == 0;
+}
+
+/*
+ * Parses the lines of a FEAT answer (RFC 2389). Every feature line starts with a space.
+ */
+void ftp_i_read_feat_answer(char *answer, struct ftp_features *f)
+{
+	f->feat_supported = ftp_btrue;
+	f->has_epsv = f->has_mlst = f->has_size = f->has_mdtm = ftp_bfalse;
+	f->has_rest_stream = f->has_utf8 = f->has_mode_z = f->has_hash = ftp_bfalse;
+	f->mlst_facts = f->mlst_default_facts = 0;
+
+	for_sep(line, answer, FTP_CENDL, {
+		char *feature = line;
+		while (*feature == ' ')
+			feature++;
+		size_t len = strcspn(feature, " ");
+		char *params = feature + len;
+		while (*params == ' ')
+			params++;
+
+		if (ftp_i_feature_is(feature, len, "EPSV"))
+			f->has_epsv = ftp_btrue;
+		else if (ftp_i_feature_is(feature, len, "MLST")) {
+			f->has_mlst = ftp_btrue;
+			ftp_i_read_mlst_feature(params, f);
+		} else if (ftp_i_feature_is(feature, len, "SIZE"))
+			f->has_size = ftp_btrue;
+		else if (ftp_i_feature_is(feature, len, "MDTM"))
+			f->has_mdtm = ftp_btrue;
+		else if (ftp_i_feature_is(feature, len, "REST"))
+			f->has_rest_stream = (strncasecmp(params, "STREAM", 6) == 0);
+		else if (ftp_i_feature_is(feature, len, "UTF8"))
+			f->has_utf8 = ftp_btrue;
+		else if (ftp_i_feature_is(feature, len, "MODE"))
+			f->has_mode_z = (strchr(params, 'Z') != NULL || strchr(params, 'z') != NULL);
+		else if (ftp_i_feature_is(feature, len, "HASH"))
+			f->has_hash = ftp_btrue;
+	});
+}
@@ -29,9 +29,13 @@
 #define FTP_SIGNAL_ABOUT_TO_OPEN_DATA_CONNECTION 150
 
 #define FTP_SIGNAL_COMMAND_OKAY 200
+#define FTP_SIGNAL_COMMAND_SUPERFLUOUS 202
+#define FTP_SIGNAL_SYSTEM_STATUS 211
+#define FTP_SIGNAL_DIRECTORY_STATUS 212
 #define FTP_SIGNAL_FILE_STATUS 213
 #define FTP_SIGNAL_SERVICE_READY 220
 #define FTP_SIGNAL_GOODBYE 221
+#define FTP_SIGNAL_CLOSING_DATA_CONNECTION 226
 #define FTP_SIGNAL_ENTERING_PASSIVE_MODE 227
 #define FTP_SIGNAL_ENTERING_EXTENDED_PASSIVE_MODE 229
 #define FTP_SIGNAL_LOGGED_IN 230
@@ -42,6 +46,8 @@
 #define FTP_SIGNAL_PASSWORD_REQUIRED 331
 #define FTP_SIGNAL_REQUEST_FURTHER_INFORMATION 350
 
+#define FTP_SIGNAL_TRANSFER_ABORTED 426
+#define FTP_SIGNAL_FILE_UNAVAILABLE 450
 #define FTP_SIGNAL_REQUESTED_ACTION_ABORTED 451
 
 #define FTP_SIGNAL_NOT_LOGGED_IN 530
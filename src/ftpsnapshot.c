@@ -0,0 +1,402 @@
+/*   libmftp
+ *
+ *   Copyright (c) 2014 nkreipke
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+
+
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ftpfunctions.h"
+
+/*
+ * Snapshot file layout (all numbers in host byte order, see byte_order):
+ *
+ *     header                   ftp_i_snapshot_header
+ *     entry table              count * ftp_i_snapshot_entry, sorted by name (strcmp)
+ *     name blob                names_size bytes, every name terminated by NUL
+ *
+ * The header and the entries are multiples of 8 bytes, so the entry table is aligned
+ * in a mapping of the file. Opening a snapshot only checks the header; the name of an
+ * entry is checked against the blob when the entry is read.
+ */
+
+#define FTP_I_SNAPSHOT_MAGIC     "MFTPSNAP"
+#define FTP_I_SNAPSHOT_VERSION   1
+#define FTP_I_SNAPSHOT_BOM       0x01020304
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t entry_size;
+	uint32_t flags;
+	uint64_t count;
+	uint64_t names_offset;
+	uint64_t names_size;
+} ftp_i_snapshot_header;
+
+typedef struct {
+	uint64_t name_offset;
+	uint64_t size;
+	int64_t modify_time;
+	int64_t create_time;
+	uint32_t name_length;
+	uint32_t unixgroup;
+	uint32_t unixmode;
+	uint8_t type;
+	uint8_t given;
+	uint16_t reserved;
+} ftp_i_snapshot_entry;
+
+FILE *ftp_i_file_create(const char *path, char **tmp_path)
+{
+	size_t path_len = strlen(path);
+	*tmp_path = malloc(path_len + sizeof(".tmp"));
+	if (!*tmp_path)
+		return NULL;
+	memcpy(*tmp_path, path, path_len);
+	memcpy(*tmp_path + path_len, ".tmp", sizeof(".tmp"));
+
+	FILE *f = fopen(*tmp_path, "wb");
+	if (!f) {
+		int saved_errno = errno;
+		free(*tmp_path);
+		*tmp_path = NULL;
+		errno = saved_errno;
+	}
+	return f;
+}
+
+ftp_status ftp_i_file_commit(FILE *f, char *tmp_path, const char *path, ftp_bool ok)
+{
+	if (ok)
+		ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+	int saved_errno = errno;
+	if (fclose(f) != 0 && ok) {
+		ok = ftp_bfalse;
+		saved_errno = errno;
+	}
+	if (ok && rename(tmp_path, path) != 0) {
+		ok = ftp_bfalse;
+		saved_errno = errno;
+	}
+	if (!ok)
+		unlink(tmp_path);
+	free(tmp_path);
+
+	errno = saved_errno;
+	return ok ? FTP_OK : FTP_ERROR;
+}
+
+const void *ftp_i_file_map(const char *path, size_t min_size, size_t *size)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return NULL;
+	}
+	if ((uint64_t)st.st_size < min_size || (uint64_t)st.st_size > SIZE_MAX) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	int saved_errno = errno;
+	close(fd);
+	if (map == MAP_FAILED) {
+		errno = saved_errno;
+		return NULL;
+	}
+	*size = (size_t)st.st_size;
+	return map;
+}
+
+/* Bits of the given byte in snapshot entries and index records: */
+#define FTP_I_GIVEN_SIZE         0x01
+#define FTP_I_GIVEN_MODIFY       0x02
+#define FTP_I_GIVEN_CREATE       0x04
+#define FTP_I_GIVEN_TYPE         0x08
+#define FTP_I_GIVEN_UNIXGROUP    0x10
+#define FTP_I_GIVEN_UNIXMODE     0x20
+
+unsigned int ftp_i_facts_given_bits(const ftp_file_facts *f)
+{
+	return (f->given.size ? FTP_I_GIVEN_SIZE : 0) |
+	       (f->given.modify ? FTP_I_GIVEN_MODIFY : 0) |
+	       (f->given.create ? FTP_I_GIVEN_CREATE : 0) |
+	       (f->given.type ? FTP_I_GIVEN_TYPE : 0) |
+	       (f->given.unixgroup ? FTP_I_GIVEN_UNIXGROUP : 0) |
+	       (f->given.unixmode ? FTP_I_GIVEN_UNIXMODE : 0);
+}
+
+void ftp_i_facts_set_given_bits(ftp_file_facts *f, unsigned int given)
+{
+	f->given.size = (given & FTP_I_GIVEN_SIZE) != 0;
+	f->given.modify = (given & FTP_I_GIVEN_MODIFY) != 0;
+	f->given.create = (given & FTP_I_GIVEN_CREATE) != 0;
+	f->given.type = (given & FTP_I_GIVEN_TYPE) != 0;
+	f->given.unixgroup = (given & FTP_I_GIVEN_UNIXGROUP) != 0;
+	f->given.unixmode = (given & FTP_I_GIVEN_UNIXMODE) != 0;
+}
+
+static int ftp_i_compare_entry_pointers(const void *a, const void *b)
+{
+	return strcmp((*(ftp_content_listing * const *)a)->filename, (*(ftp_content_listing * const *)b)->filename);
+}
+
+static void ftp_i_snapshot_fill_entry(ftp_i_snapshot_entry *e, const ftp_content_listing *item, uint64_t name_offset, size_t name_length)
+{
+	const ftp_file_facts *f = &item->facts;
+
+	memset(e, 0, sizeof(ftp_i_snapshot_entry));
+	e->name_offset = name_offset;
+	e->name_length = (uint32_t)name_length;
+	e->size = f->size;
+	e->modify_time = f->modify_time;
+	e->create_time = f->create_time;
+	e->unixgroup = f->unixgroup;
+	e->unixmode = f->unixmode;
+	e->type = (uint8_t)f->type;
+	e->given = (uint8_t)ftp_i_facts_given_bits(f);
+}
+
+/* Writes the entries (sorted in place) to path. The file is written under a temporary
+ * name and renamed, so an existing snapshot is replaced only by a complete one. */
+static ftp_status ftp_i_snapshot_write(ftp_content_listing **items, size_t count, const char *path)
+{
+	ftp_i_snapshot_header header;
+	uint64_t names_size = 0;
+
+	qsort(items, count, sizeof(ftp_content_listing *), ftp_i_compare_entry_pointers);
+
+	for (size_t i = 0; i < count; i++) {
+		size_t len = strlen(items[i]->filename);
+		if (len > UINT32_MAX) {
+			errno = EOVERFLOW;
+			return FTP_ERROR;
+		}
+		names_size += len + 1;
+	}
+
+	memset(&header, 0, sizeof(ftp_i_snapshot_header));
+	memcpy(header.magic, FTP_I_SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = FTP_I_SNAPSHOT_VERSION;
+	header.byte_order = FTP_I_SNAPSHOT_BOM;
+	header.entry_size = sizeof(ftp_i_snapshot_entry);
+	header.count = count;
+	header.names_offset = sizeof(ftp_i_snapshot_header) + (uint64_t)count * sizeof(ftp_i_snapshot_entry);
+	header.names_size = names_size;
+
+	char *tmp_path;
+	FILE *f = ftp_i_file_create(path, &tmp_path);
+	if (!f)
+		return FTP_ERROR;
+
+	ftp_bool ok = fwrite(&header, sizeof(ftp_i_snapshot_header), 1, f) == 1;
+
+	uint64_t name_offset = 0;
+	for (size_t i = 0; ok && i < count; i++) {
+		ftp_i_snapshot_entry e;
+		size_t len = strlen(items[i]->filename);
+		ftp_i_snapshot_fill_entry(&e, items[i], name_offset, len);
+		ok = fwrite(&e, sizeof(ftp_i_snapshot_entry), 1, f) == 1;
+		name_offset += len + 1;
+	}
+	for (size_t i = 0; ok && i < count; i++)
+		ok = fwrite(items[i]->filename, strlen(items[i]->filename) + 1, 1, f) == 1;
+
+	return ftp_i_file_commit(f, tmp_path, path, ok);
+}
+
+ftp_status ftp_snapshot_write(ftp_content_listing *list, const char *path)
+{
+	size_t count = 0;
+	for (ftp_content_listing *i = list; i; i = i->next)
+		count++;
+
+	ftp_content_listing **items = malloc((count ? count : 1) * sizeof(ftp_content_listing *));
+	if (!items)
+		return FTP_ERROR;
+	count = 0;
+	for (ftp_content_listing *i = list; i; i = i->next)
+		items[count++] = i;
+
+	ftp_status status = ftp_i_snapshot_write(items, count, path);
+	int saved_errno = errno;
+	free(items);
+	errno = saved_errno;
+	return status;
+}
+
+ftp_status ftp_snapshot_write_array(ftp_content_array *a, const char *path)
+{
+	ftp_content_listing **items = malloc((a->count ? a->count : 1) * sizeof(ftp_content_listing *));
+	if (!items)
+		return FTP_ERROR;
+	for (size_t i = 0; i < a->count; i++)
+		items[i] = &a->entries[i];
+
+	ftp_status status = ftp_i_snapshot_write(items, a->count, path);
+	int saved_errno = errno;
+	free(items);
+	errno = saved_errno;
+	return status;
+}
+
+static ftp_bool ftp_i_snapshot_header_valid(const ftp_i_snapshot_header *h, size_t map_size)
+{
+	if (memcmp(h->magic, FTP_I_SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != FTP_I_SNAPSHOT_VERSION ||
+	    h->byte_order != FTP_I_SNAPSHOT_BOM ||
+	    h->entry_size != sizeof(ftp_i_snapshot_entry))
+		return ftp_bfalse;
+
+	uint64_t table_size = (uint64_t)map_size - sizeof(ftp_i_snapshot_header);
+	if (h->count > table_size / sizeof(ftp_i_snapshot_entry))
+		return ftp_bfalse;
+	if (h->names_offset != sizeof(ftp_i_snapshot_header) + h->count * sizeof(ftp_i_snapshot_entry))
+		return ftp_bfalse;
+	if (h->names_size > map_size - h->names_offset)
+		return ftp_bfalse;
+	/* Every name ends with NUL, so lookups cannot run off the blob. */
+	if (h->count && (h->names_size == 0 || ((const char *)h)[h->names_offset + h->names_size - 1] != '\0'))
+		return ftp_bfalse;
+	return ftp_btrue;
+}
+
+ftp_snapshot *ftp_snapshot_open(const char *path)
+{
+	size_t map_size;
+	const void *map = ftp_i_file_map(path, sizeof(ftp_i_snapshot_header), &map_size);
+	if (!map)
+		return NULL;
+
+	if (!ftp_i_snapshot_header_valid(map, map_size)) {
+		munmap((void *)map, map_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ftp_snapshot *s = calloc(1, sizeof(ftp_snapshot));
+	if (!s) {
+		munmap((void *)map, map_size);
+		errno = ENOMEM;
+		return NULL;
+	}
+	s->count = (size_t)((const ftp_i_snapshot_header *)map)->count;
+	s->_map = map;
+	s->_map_size = map_size;
+	return s;
+}
+
+void ftp_snapshot_close(ftp_snapshot *s)
+{
+	if (!s)
+		return;
+	munmap((void *)s->_map, s->_map_size);
+	free(s);
+}
+
+#define ftp_i_snapshot_entries(s) ((const ftp_i_snapshot_entry *)((const char *)(s)->_map + sizeof(ftp_i_snapshot_header)))
+
+/* Returns the name of an entry, or NULL if it does not lie within the name blob. */
+static const char *ftp_i_snapshot_name(ftp_snapshot *s, const ftp_i_snapshot_entry *e)
+{
+	const ftp_i_snapshot_header *h = s->_map;
+	if (e->name_offset >= h->names_size || e->name_length >= h->names_size - e->name_offset)
+		return NULL;
+	const char *name = (const char *)s->_map + h->names_offset + e->name_offset;
+	if (name[e->name_length] != '\0')
+		return NULL;
+	return name;
+}
+
+static void ftp_i_snapshot_read_entry(const ftp_i_snapshot_entry *e, const char *name, ftp_content_listing *item)
+{
+	ftp_file_facts *f = &item->facts;
+
+	memset(item, 0, sizeof(ftp_content_listing));
+	item->filename = (char *)name;
+	ftp_i_facts_set_given_bits(f, e->given);
+	f->size = e->size;
+	f->modify_time = e->modify_time;
+	f->create_time = e->create_time;
+	if (f->given.modify)
+		f->modify = ftp_i_date_from_unix_timestamp(e->modify_time);
+	if (f->given.create)
+		f->create = ftp_i_date_from_unix_timestamp(e->create_time);
+	f->type = e->type <= ft_other ? (ftp_file_type)e->type : ft_other;
+	f->unixgroup = e->unixgroup;
+	f->unixmode = e->unixmode;
+}
+
+ftp_bool ftp_snapshot_entry(ftp_snapshot *s, size_t index, ftp_content_listing *item)
+{
+	if (index >= s->count)
+		return ftp_bfalse;
+	const ftp_i_snapshot_entry *e = ftp_i_snapshot_entries(s) + index;
+	const char *name = ftp_i_snapshot_name(s, e);
+	if (!name)
+		return ftp_bfalse;
+	ftp_i_snapshot_read_entry(e, name, item);
+	return ftp_btrue;
+}
+
+ftp_bool ftp_snapshot_find(ftp_snapshot *s, const char *file_nm, ftp_content_listing *item)
+{
+	const ftp_i_snapshot_entry *entries = ftp_i_snapshot_entries(s);
+	size_t low = 0, high = s->count;
+
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		const char *name = ftp_i_snapshot_name(s, &entries[mid]);
+		if (!name)
+			return ftp_bfalse;
+		int cmp = strcmp(file_nm, name);
+		if (cmp == 0) {
+			if (item)
+				ftp_i_snapshot_read_entry(&entries[mid], name, item);
+			return ftp_btrue;
+		}
+		if (cmp < 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	return ftp_bfalse;
+}
@@ -27,16 +27,45 @@
 #ifdef FTP_TLS_ENABLED
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define TLS_client_method SSLv23_client_method
+#endif
+
+#define FTP_TLS_SESSION_TIMEOUT 600
+
 struct tls_info {
-	SSL_CTX *ctx;
 	SSL *ssl;
+	/* Session cache key, only set for control connections: */
+	char *host;
+	int port;
 };
 #define tls_info_malloc() calloc(1, sizeof(struct tls_info))
-int tls_loaded = 0;
-void load_tls(void);
+
+/*
+ * All connections share one SSL_CTX. Sessions of control connections are kept
+ * in a small cache keyed by host and port, so that new connections to the same
+ * server (e.g. queued connections) can resume a session instead of doing a full
+ * handshake.
+ */
+struct tls_cached_session {
+	char *host;
+	int port;
+	SSL_SESSION *session;
+	struct tls_cached_session *next;
+};
+
+static SSL_CTX *tls_ctx = NULL;
+static int tls_ex_index = -1;
+static pthread_once_t tls_once = PTHREAD_ONCE_INIT;
+static struct tls_cached_session *tls_sessions = NULL;
+static pthread_mutex_t tls_sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void load_tls(void);
 
 #define FTP_LOGSSL(...) FTP_LOG("$$$ " __VA_ARGS__)
 
@@ -46,12 +75,76 @@ void load_tls(void);
 #define FTP_SSL_log_errors()
 #endif
 
-#define FTP_SSLRETURNERROR(x) *error=x;if(tls->ctx)SSL_CTX_free(tls->ctx);SSL_free(tls->ssl);free(tls);return FTP_ERROR;
+#define FTP_SSLRETURNERROR(x) *error=x;ftp_i_tls_free(tls);return FTP_ERROR;
+
+
+static void ftp_i_tls_free(struct tls_info *tls)
+{
+	if (tls->ssl)
+		SSL_free(tls->ssl);
+	ftp_i_free(tls->host);
+	free(tls);
+}
+
+/*
+ * Called by OpenSSL whenever the server hands out a new session (with TLS 1.3 this
+ * happens after the handshake, in the input thread). Returns 1 if we keep the reference.
+ */
+static int tls_new_session(SSL *ssl, SSL_SESSION *session)
+{
+	struct tls_info *tls = SSL_get_ex_data(ssl, tls_ex_index);
+	struct tls_cached_session *cached;
+
+	if (!tls || !tls->host)
+		return 0;
 
+	pthread_mutex_lock(&tls_sessions_lock);
+	for (cached = tls_sessions; cached; cached = cached->next)
+		if (cached->port == tls->port && strcmp(cached->host, tls->host) == 0)
+			break;
+	if (!cached) {
+		cached = calloc(1, sizeof(struct tls_cached_session));
+		if (cached)
+			ftp_i_strcpy_malloc(cached->host, tls->host);
+		if (!cached || !cached->host) {
+			ftp_i_free(cached);
+			pthread_mutex_unlock(&tls_sessions_lock);
+			return 0;
+		}
+		cached->port = tls->port;
+		cached->next = tls_sessions;
+		tls_sessions = cached;
+	}
+	if (cached->session)
+		SSL_SESSION_free(cached->session);
+	cached->session = session;
+	pthread_mutex_unlock(&tls_sessions_lock);
+
+	FTP_LOGSSL("cached session for %s\n", tls->host);
+	return 1;
+}
+
+static void ftp_i_tls_resume_cached_session(struct tls_info *tls)
+{
+	pthread_mutex_lock(&tls_sessions_lock);
+	for (struct tls_cached_session *cached = tls_sessions; cached; cached = cached->next) {
+		if (cached->port == tls->port && strcmp(cached->host, tls->host) == 0) {
+			if (cached->session && SSL_set_session(tls->ssl, cached->session))
+				FTP_LOGSSL("resuming cached session\n");
+			break;
+		}
+	}
+	pthread_mutex_unlock(&tls_sessions_lock);
+}
 
-ftp_status ftp_i_tls_connect(int sockfd, void **tls_info_ptr, void *tls_reuse_info_ptr, int *error) {
-	load_tls();
-	if (!tls_loaded) {
+/*
+ * Establishes a TLS connection on sockfd. For control connections, pass the host and port
+ * so that the session can be cached. For data connections, pass the control connection's
+ * tls_info as tls_reuse_info_ptr to reuse its session (some servers require this).
+ */
+ftp_status ftp_i_tls_connect(int sockfd, const char *host, int port, void **tls_info_ptr, void *tls_reuse_info_ptr, int *error) {
+	pthread_once(&tls_once, load_tls);
+	if (!tls_ctx) {
 		*error = FTP_ETLS_COULDNOTINIT;
 		return FTP_ERROR;
 	}
@@ -61,40 +154,18 @@ ftp_status ftp_i_tls_connect(int sockfd, void **tls_info_ptr, void *tls_reuse_in
 		return FTP_ERROR;
 	}
 
-	SSL_CTX *ctx = NULL;
-	if (tls_reuse_info_ptr) {
-		ctx = ((struct tls_info*)tls_reuse_info_ptr)->ctx;
-	}
-	if (!ctx) {
-		FTP_LOGSSL("new context\n");
-		tls->ctx = SSL_CTX_new(SSLv23_client_method());
-		if (!tls->ctx) {
-			FTP_SSL_log_errors();
-			*error = FTP_ETLS_COULDNOTINIT;
-			free(tls);
-			return FTP_ERROR;
-		}
-		SSL_CTX_set_timeout(tls->ctx, 600);
-		long mode = SSL_CTX_get_session_cache_mode(tls->ctx);
-		mode |= SSL_SESS_CACHE_CLIENT;
-		SSL_CTX_set_session_cache_mode(tls->ctx, mode);
-		ctx = tls->ctx;
-	}
 	FTP_LOGSSL("new ssl\n");
-	tls->ssl = SSL_new(ctx);
+	tls->ssl = SSL_new(tls_ctx);
 	if (!tls->ssl) {
 		FTP_SSL_log_errors();
-		*error = FTP_ETLS_COULDNOTINIT;
-		if (tls->ctx) SSL_CTX_free(tls->ctx);
-		free(tls);
-		return FTP_ERROR;
+		FTP_SSLRETURNERROR(FTP_ETLS_COULDNOTINIT);
 	}
 	if (!SSL_set_fd(tls->ssl, sockfd)) {
 		FTP_SSL_log_errors();
 		FTP_SSLRETURNERROR(FTP_ETLS_COULDNOTINIT);
 	}
-	//reuse session (for data connection as some servers require this):
 	if (tls_reuse_info_ptr) {
+		//reuse session (for data connection as some servers require this):
 		FTP_LOGSSL("reusing session!\n");
 		struct tls_info *reuse = tls_reuse_info_ptr;
 		SSL_SESSION *sess = SSL_get_session(reuse->ssl);
@@ -102,6 +173,14 @@ ftp_status ftp_i_tls_connect(int sockfd, void **tls_info_ptr, void *tls_reuse_in
 			FTP_ERR("session reuse failed.\n");
 			FTP_SSLRETURNERROR(FTP_ETLS_COULDNOTINIT);
 		}
+	} else if (host) {
+		ftp_i_strcpy_malloc(tls->host, (char *)host);
+		if (!tls->host) {
+			FTP_SSLRETURNERROR(FTP_ECOULDNOTALLOCATE);
+		}
+		tls->port = port;
+		SSL_set_ex_data(tls->ssl, tls_ex_index, tls);
+		ftp_i_tls_resume_cached_session(tls);
 	}
 	FTP_LOGSSL("ssl handshake\n");
 	if (SSL_connect(tls->ssl) != 1) {
@@ -109,7 +188,7 @@ ftp_status ftp_i_tls_connect(int sockfd, void **tls_info_ptr, void *tls_reuse_in
 		FTP_SSL_log_errors();
 		FTP_SSLRETURNERROR(FTP_ETLS_COULDNOTINIT);
 	}
-	FTP_LOGSSL("ssl handshake successful\n");
+	FTP_LOGSSL("ssl handshake successful%s\n", SSL_session_reused(tls->ssl) ? " (resumed)" : "");
 
 	*tls_info_ptr = tls;
 
@@ -119,18 +198,24 @@ ftp_status ftp_i_tls_connect(int sockfd, void **tls_info_ptr, void *tls_reuse_in
 void ftp_i_tls_disconnect(void **tls_info_ptr) {
 	struct tls_info *tls = *tls_info_ptr;
 	if (tls) {
-		if (tls->ssl) {
+		if (tls->ssl)
 			SSL_shutdown(tls->ssl);
-			SSL_free(tls->ssl);
-		}
-		if (tls->ctx) {
-			SSL_CTX_free(tls->ctx);
-		}
-		free(tls);
+		ftp_i_tls_free(tls);
 	}
 	*tls_info_ptr = NULL;
 }
 
+/*
+ * Frees a TLS connection without sending close_notify, for connections that are
+ * already broken.
+ */
+void ftp_i_tls_drop(void **tls_info_ptr) {
+	struct tls_info *tls = *tls_info_ptr;
+	if (tls)
+		ftp_i_tls_free(tls);
+	*tls_info_ptr = NULL;
+}
+
 ssize_t ftp_i_tls_write(void *tls_info_ptr, const void *buf, size_t len) {
 	struct tls_info *tls = tls_info_ptr;
 	return (ssize_t)SSL_write(tls->ssl, buf, (int)len);
@@ -141,16 +226,63 @@ ssize_t ftp_i_tls_read(void *tls_info_ptr, void *buf, size_t len) {
 	return (ssize_t)SSL_read(tls->ssl, buf, (int)len);
 }
 
+/*
+ * With SSL_MODE_RELEASE_BUFFERS, OpenSSL frees the read and write buffers of a
+ * connection whenever they are empty, which is the normal state of an idle
+ * control connection.
+ */
+void ftp_i_tls_set_release_buffers(void *tls_info_ptr, ftp_bool release) {
+	struct tls_info *tls = tls_info_ptr;
+	if (release)
+		SSL_set_mode(tls->ssl, SSL_MODE_RELEASE_BUFFERS);
+	else
+		SSL_clear_mode(tls->ssl, SSL_MODE_RELEASE_BUFFERS);
+}
 
-void load_tls(void) {
-	if (!tls_loaded) {
-		OpenSSL_add_all_algorithms();
-		SSL_load_error_strings();
-		if (SSL_library_init() < 0) {
-			return;
-		}
-		tls_loaded = 1;
+/*
+ * Estimates the number of bytes an idle TLS connection holds in record buffers.
+ */
+size_t ftp_i_tls_idle_footprint(void *tls_info_ptr) {
+	struct tls_info *tls = tls_info_ptr;
+	size_t bytes = sizeof(struct tls_info);
+	if (tls->host)
+		bytes += strlen(tls->host) + 1;
+	if (!(SSL_get_mode(tls->ssl) & SSL_MODE_RELEASE_BUFFERS))
+		bytes += 2 * (SSL3_RT_HEADER_LENGTH + SSL3_RT_MAX_ENCRYPTED_LENGTH);
+	return bytes;
+}
+
+
+static void load_tls(void) {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	OpenSSL_add_all_algorithms();
+	SSL_load_error_strings();
+	if (SSL_library_init() < 0)
+		return;
+#else
+	if (!OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS | OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL))
+		return;
+#endif
+
+	FTP_LOGSSL("new context\n");
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	if (!ctx) {
+		FTP_SSL_log_errors();
+		return;
+	}
+	/* TLS_client_method negotiates the highest version both sides support, including
+	 * TLS 1.3. Session tickets are left enabled. */
+	SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+	SSL_CTX_set_timeout(ctx, FTP_TLS_SESSION_TIMEOUT);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, tls_new_session);
+
+	tls_ex_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+	if (tls_ex_index < 0) {
+		SSL_CTX_free(ctx);
+		return;
 	}
+	tls_ctx = ctx;
 }
 
 
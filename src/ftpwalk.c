@@ -0,0 +1,169 @@
+/*   libmftp
+ *
+ *   Copyright (c) 2014 nkreipke
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ftpfunctions.h"
+
+#define FTP_WALK_DEFAULT_CONNECTIONS 4
+/* Directories listed per ftp_i_list_paths call and connection, this bounds the number of
+ * listings held in memory at once: */
+#define FTP_WALK_BATCH_PER_CONNECTION 32
+
+struct ftp_i_walk_level {
+	char **paths;
+	size_t count, capacity;
+};
+
+static ftp_status ftp_i_walk_level_add(struct ftp_i_walk_level *l, char *path)
+{
+	if (l->count == l->capacity) {
+		size_t capacity = l->capacity ? l->capacity * 2 : 64;
+		char **paths = realloc(l->paths, capacity * sizeof(char *));
+		if (!paths)
+			return FTP_ERROR;
+		l->paths = paths;
+		l->capacity = capacity;
+	}
+	l->paths[l->count++] = path;
+	return FTP_OK;
+}
+
+static void ftp_i_walk_level_clear(struct ftp_i_walk_level *l)
+{
+	for (size_t i = 0; i < l->count; i++)
+		free(l->paths[i]);
+	l->count = 0;
+}
+
+static char *ftp_i_walk_join(const char *dir, const char *name)
+{
+	size_t dirlen = strlen(dir);
+	if (dirlen > 0 && dir[dirlen - 1] == '/')
+		dirlen--;
+	char *path = malloc(dirlen + strlen(name) + 2);
+	if (!path)
+		return NULL;
+	memcpy(path, dir, dirlen);
+	path[dirlen] = '/';
+	strcpy(path + dirlen + 1, name);
+	return path;
+}
+
+ftp_status ftp_walk(ftp_connection *c, const char *root, ftp_walk_callback callback, ftp_walk_options *options)
+{
+	if (!root || !callback) {
+		ftp_i_connection_set_error(c, FTP_EARGUMENTS);
+		return FTP_ERROR;
+	}
+
+	ftp_walk_options o = {0, FTP_WALK_DEFAULT_CONNECTIONS, NULL, NULL};
+	if (options) {
+		o = *options;
+		if (o.max_connections == 0)
+			o.max_connections = FTP_WALK_DEFAULT_CONNECTIONS;
+	}
+
+	size_t batch = (size_t)o.max_connections * FTP_WALK_BATCH_PER_CONNECTION;
+	struct ftp_i_listing_job *jobs = malloc(batch * sizeof(struct ftp_i_listing_job));
+	struct ftp_i_walk_level current = {NULL, 0, 0}, next = {NULL, 0, 0};
+	char *start = NULL;
+	if (jobs)
+		ftp_i_strcpy_malloc(start, (char *)root);
+	if (!jobs || !start || ftp_i_walk_level_add(&current, start) != FTP_OK) {
+		ftp_i_free(start);
+		ftp_i_free(jobs);
+		ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
+		return FTP_ERROR;
+	}
+
+	int error = 0;
+	ftp_bool stopped = ftp_bfalse;
+	unsigned int depth = 1;
+	while (current.count > 0 && !stopped) {
+		ftp_bool descend = (o.max_depth == 0 || depth < o.max_depth);
+
+		for (size_t first = 0; first < current.count && !stopped; first += batch) {
+			size_t n = current.count - first < batch ? current.count - first : batch;
+			for (size_t i = 0; i < n; i++)
+				jobs[i].path = current.paths[first + i];
+
+			if (ftp_i_list_paths(c, jobs, n, o.max_connections) != FTP_OK) {
+				error = c->error;
+				stopped = ftp_btrue;
+				break;
+			}
+
+			for (size_t i = 0; i < n; i++) {
+				ftp_content_array *a = jobs[i].result;
+				if (!a) {
+					if (error == 0)
+						error = jobs[i].error;
+					continue;
+				}
+				for (size_t j = 0; j < a->count && !stopped; j++) {
+					ftp_content_listing *entry = &a->entries[j];
+					if (!ftp_i_clfilter_keepthis(entry)) {
+						if (c->content_listing_filter)
+							continue;
+					} else if (descend && entry->facts.given.type && entry->facts.type == ft_dir) {
+						char *path = ftp_i_walk_join(jobs[i].path, entry->filename);
+						if (path && o.prune && o.prune(path, o.context)) {
+							free(path);
+						} else if (!path || ftp_i_walk_level_add(&next, path) != FTP_OK) {
+							ftp_i_free(path);
+							error = FTP_ECOULDNOTALLOCATE;
+							stopped = ftp_btrue;
+							break;
+						}
+					}
+					if (!callback(jobs[i].path, entry, o.context))
+						stopped = ftp_btrue;
+				}
+				ftp_free_array(a);
+			}
+		}
+
+		ftp_i_walk_level_clear(&current);
+		struct ftp_i_walk_level swap = current;
+		current = next;
+		next = swap;
+		depth++;
+	}
+
+	ftp_i_trim_queue(c);
+	ftp_i_walk_level_clear(&current);
+	ftp_i_walk_level_clear(&next);
+	ftp_i_free(current.paths);
+	ftp_i_free(next.paths);
+	free(jobs);
+
+	if (error != 0) {
+		ftp_i_connection_set_error(c, error);
+		return FTP_ERROR;
+	}
+	return FTP_OK;
+}
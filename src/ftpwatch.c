@@ -0,0 +1,260 @@
+/*   libmftp
+ *
+ *   Copyright (c) 2014 nkreipke
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ *  THE SOFTWARE.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "ftpfunctions.h"
+
+#define FTP_WATCH_DEFAULT_MIN_INTERVAL 5
+#define FTP_WATCH_DEFAULT_MAX_INTERVAL 300
+#define FTP_WATCH_DEFAULT_CONNECTIONS 4
+
+struct ftp_i_watched_directory {
+	char *path;
+	/* Contents of the previous poll sorted by name, NULL before the first poll. */
+	ftp_content_array *snapshot;
+	unsigned long interval;
+	time_t next_poll;
+	struct ftp_i_watched_directory *next;
+};
+
+static time_t ftp_i_watch_now(void)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec;
+}
+
+ftp_watcher *ftp_watcher_new(ftp_connection *c, ftp_watch_callback callback, void *context)
+{
+	if (!callback) {
+		ftp_i_connection_set_error(c, FTP_EARGUMENTS);
+		return NULL;
+	}
+	ftp_watcher *w = calloc(1, sizeof(ftp_watcher));
+	if (!w) {
+		ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
+		return NULL;
+	}
+	w->min_interval = FTP_WATCH_DEFAULT_MIN_INTERVAL;
+	w->max_interval = FTP_WATCH_DEFAULT_MAX_INTERVAL;
+	w->max_connections = FTP_WATCH_DEFAULT_CONNECTIONS;
+	w->_c = c;
+	w->_callback = callback;
+	w->_context = context;
+	return w;
+}
+
+static void ftp_i_free_watched_directory(struct ftp_i_watched_directory *d)
+{
+	ftp_i_free(d->path);
+	ftp_free_array(d->snapshot);
+	ftp_i_free(d);
+}
+
+void ftp_watcher_free(ftp_watcher *w)
+{
+	if (!w)
+		return;
+	struct ftp_i_watched_directory *d = w->_directories;
+	while (d) {
+		struct ftp_i_watched_directory *next = d->next;
+		ftp_i_free_watched_directory(d);
+		d = next;
+	}
+	if (w->_reserved > 0)
+		ftp_i_reserve_queued_connections(w->_c, -w->_reserved);
+	free(w);
+}
+
+ftp_status ftp_watch(ftp_watcher *w, const char *path)
+{
+	if (!path) {
+		ftp_i_connection_set_error(w->_c, FTP_EARGUMENTS);
+		return FTP_ERROR;
+	}
+	for (struct ftp_i_watched_directory *d = w->_directories; d; d = d->next)
+		if (strcmp(d->path, path) == 0)
+			return FTP_OK;
+
+	struct ftp_i_watched_directory *d = calloc(1, sizeof(struct ftp_i_watched_directory));
+	if (d)
+		ftp_i_strcpy_malloc(d->path, (char *)path);
+	if (!d || !d->path) {
+		ftp_i_free(d);
+		ftp_i_connection_set_error(w->_c, FTP_ECOULDNOTALLOCATE);
+		return FTP_ERROR;
+	}
+	d->interval = w->min_interval;
+	d->next = w->_directories;
+	w->_directories = d;
+	return FTP_OK;
+}
+
+ftp_status ftp_unwatch(ftp_watcher *w, const char *path)
+{
+	for (struct ftp_i_watched_directory **d = (struct ftp_i_watched_directory **)&w->_directories; *d; d = &(*d)->next) {
+		if (strcmp((*d)->path, path) == 0) {
+			struct ftp_i_watched_directory *found = *d;
+			*d = found->next;
+			ftp_i_free_watched_directory(found);
+			return FTP_OK;
+		}
+	}
+	ftp_i_connection_set_error(w->_c, FTP_ENOTFOUND);
+	return FTP_ERROR;
+}
+
+static ftp_bool ftp_i_facts_differ(const ftp_file_facts *a, const ftp_file_facts *b)
+{
+	if (a->given.type && b->given.type && a->type != b->type)
+		return ftp_btrue;
+	if (a->given.size && b->given.size && a->size != b->size)
+		return ftp_btrue;
+	if (a->given.modify && b->given.modify && a->modify_time != b->modify_time)
+		return ftp_btrue;
+	return ftp_bfalse;
+}
+
+/* Merge join of two listings sorted by name. Returns the number of changes. */
+static unsigned long ftp_i_watch_diff(ftp_watcher *w, const char *path, ftp_content_array *old, ftp_content_array *new)
+{
+	unsigned long changes = 0;
+	size_t i = 0, j = 0;
+	while (i < old->count || j < new->count) {
+		int cmp = (i == old->count) ? 1 : (j == new->count) ? -1 :
+			strcmp(old->entries[i].filename, new->entries[j].filename);
+		if (cmp < 0) {
+			w->_callback(path, ftp_change_removed, &old->entries[i++], w->_context);
+			changes++;
+		} else if (cmp > 0) {
+			w->_callback(path, ftp_change_added, &new->entries[j++], w->_context);
+			changes++;
+		} else {
+			if (ftp_i_facts_differ(&old->entries[i].facts, &new->entries[j].facts)) {
+				w->_callback(path, ftp_change_modified, &new->entries[j], w->_context);
+				changes++;
+			}
+			i++;
+			j++;
+		}
+	}
+	return changes;
+}
+
+ftp_status ftp_watcher_poll(ftp_watcher *w, unsigned long *next_poll)
+{
+	ftp_connection *c = w->_c;
+	time_t now = ftp_i_watch_now();
+	struct ftp_i_watched_directory *d;
+	size_t due = 0;
+
+	for (d = w->_directories; d; d = d->next)
+		if (d->next_poll <= now)
+			due++;
+
+	struct ftp_i_watched_directory **dirs = NULL;
+	struct ftp_i_listing_job *jobs = NULL;
+	if (due > 0) {
+		dirs = malloc(due * sizeof(*dirs));
+		jobs = malloc(due * sizeof(*jobs));
+		if (!dirs || !jobs) {
+			ftp_i_free(dirs);
+			ftp_i_free(jobs);
+			ftp_i_connection_set_error(c, FTP_ECOULDNOTALLOCATE);
+			return FTP_ERROR;
+		}
+	}
+
+	size_t n = 0;
+	for (d = w->_directories; d; d = d->next) {
+		if (d->next_poll <= now) {
+			dirs[n] = d;
+			jobs[n].path = d->path;
+			n++;
+		}
+	}
+
+	int error = 0;
+	if (n > 0) {
+		/* The queued connections used for polling stay open until the watcher is freed,
+		 * instead of being reconnected for every poll. */
+		int reserved = w->max_connections > 1 ? (int)w->max_connections - 1 : 0;
+		if (reserved != w->_reserved) {
+			ftp_i_reserve_queued_connections(c, reserved - w->_reserved);
+			w->_reserved = reserved;
+		}
+		if (ftp_i_list_paths(c, jobs, n, w->max_connections) != FTP_OK)
+			error = c->error;
+	}
+
+	now = ftp_i_watch_now();
+	for (size_t i = 0; i < n; i++) {
+		d = dirs[i];
+		if (!jobs[i].result) {
+			/* keep the snapshot and try again soon */
+			if (error == 0)
+				error = jobs[i].error;
+			d->next_poll = now + w->min_interval;
+			continue;
+		}
+
+		ftp_content_array_sort(jobs[i].result);
+		unsigned long changes = d->snapshot ? ftp_i_watch_diff(w, d->path, d->snapshot, jobs[i].result) : 0;
+		ftp_free_array(d->snapshot);
+		d->snapshot = jobs[i].result;
+
+		if (changes > 0)
+			d->interval = w->min_interval;
+		else
+			d->interval = d->interval > 0 ? d->interval * 2 : 1;
+		if (d->interval < w->min_interval)
+			d->interval = w->min_interval;
+		if (d->interval > w->max_interval)
+			d->interval = w->max_interval;
+		d->next_poll = now + d->interval;
+	}
+
+	ftp_i_free(dirs);
+	ftp_i_free(jobs);
+
+	if (next_poll) {
+		unsigned long wait = w->_directories ? w->max_interval : 0;
+		for (d = w->_directories; d; d = d->next) {
+			unsigned long left = d->next_poll > now ? (unsigned long)(d->next_poll - now) : 0;
+			if (left < wait)
+				wait = left;
+		}
+		*next_poll = wait;
+	}
+
+	if (error != 0) {
+		ftp_i_connection_set_error(c, error);
+		return FTP_ERROR;
+	}
+	return FTP_OK;
+}
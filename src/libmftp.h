@@ -61,13 +61,36 @@
 #define FTP_WRITE            2
 
 /* Use as startpos parameter for ftp_fopen to append to an existing remote file: */
-#define FTP_APPEND        (~(0L))
+#define FTP_APPEND        (~(ftp_offset)0)
+
+/* MLST facts (RFC 3659) as announced by the server, see also listing_facts: */
+#define FTP_FACT_SIZE        (1 << 0)
+#define FTP_FACT_MODIFY      (1 << 1)
+#define FTP_FACT_CREATE      (1 << 2)
+#define FTP_FACT_TYPE        (1 << 3)
+#define FTP_FACT_UNIXGROUP   (1 << 4)
+#define FTP_FACT_UNIXMODE    (1 << 5)
+#define FTP_FACT_PERM        (1 << 6)
+#define FTP_FACT_UNIQUE      (1 << 7)
+#define FTP_FACT_UNIXOWNER   (1 << 8)
 
 
 ////////////////////
 // FTP_CONNECTION //
 ////////////////////
 
+typedef enum {
+	/* Do not establish secure connection. */
+	ftp_security_none
+#ifdef FTP_TLS_ENABLED
+	/* A secure TLS connection will be established if the server supports it. */
+	,ftp_security_auto,
+	/* Always establish a TLS connection. If the server does not support TLS,
+	 * the connection will fail. */
+	ftp_security_always
+#endif
+} ftp_security;
+
 typedef struct _ftp_connection {
 	/* Status of the connection. */
 	ftp_status status;
@@ -79,6 +102,19 @@ typedef struct _ftp_connection {
 	/* The connection timeout when waiting for a server answer. (60 by default) */
 	unsigned long timeout;
 
+	/* Keepalive interval in seconds for the control connection (0 = disabled, default).
+	 * Enables TCP keepalives and sends NOOP while a file transfer runs for longer than
+	 * this interval. Call ftp_keepalive regularly to keep idle queued connections alive.
+	 * Queued connections inherit this setting. */
+	unsigned long keepalive_interval;
+
+	/* Number of reconnect attempts when the control connection is lost during an
+	 * idempotent operation (0 = never, default). The connection is then re-established,
+	 * logged in again and the current directory and transfer type are restored before the
+	 * operation is repeated. Set this before calling ftp_auth, as the credentials have
+	 * to be kept. Queued connections inherit this setting. */
+	unsigned int reconnect_attempts;
+
 	/* The status number of the latest server answer. */
 	int last_signal;
 
@@ -93,6 +129,49 @@ typedef struct _ftp_connection {
 	/* Filters ".", ".." and other items that are neither files nor directories. */
 	ftp_bool content_listing_filter:1;
 
+	/* Reduces the memory held by idle connections (false by default): TLS buffers are
+	 * released while the control connection is idle and input threads use a small stack.
+	 * Queued connections inherit this setting. */
+	ftp_bool low_memory_idle:1;
+
+	/* Seconds a directory listing is kept in the listing cache (0 = disabled, default).
+	 * The cache is shared with the queued connections and keyed by the absolute path of
+	 * the directory, so changing the current directory costs an additional PWD.
+	 * ftp_delete, ftp_rename, ftp_chmod, ftp_create_folder and uploads with ftp_fopen
+	 * drop the affected listings. Queued connections inherit this setting. */
+	unsigned long listing_cache_ttl;
+
+	/* List directories with STAT over the control connection (default: ftp_bfalse).
+	 * This saves the data connection of every listing (EPSV, connect and TLS handshake),
+	 * which takes longer than the transfer for small directories. Only LIST facts are
+	 * available this way. Servers without support are detected and listed as usual.
+	 * Queued connections inherit this setting. */
+	ftp_bool control_connection_listing;
+
+	/* FTP_FACT_* values needed from listings (0 = everything the server sends, default).
+	 * The server is asked with OPTS MLST to send only these facts, which makes MLSD
+	 * answers shorter, and other facts are skipped while parsing. FTP_FACT_TYPE is always
+	 * included. As the selection applies to MLST too, ftp_stat and ftp_item_exists get
+	 * the same facts. Queued connections inherit this setting. */
+	unsigned int listing_facts;
+
+	/* Maximum number of bytes of a listing kept in memory (0 = no limit, default).
+	 * Larger listings fail with FTP_ELISTINGTOOLARGE, unless listing_spill is set. For
+	 * streamed listings (ftp_list_each, ftp_walk, ...) this limits the length of a line.
+	 * Queued connections inherit this setting. */
+	size_t max_listing_size;
+
+	/* Maximum number of bytes of a server reply (0 = no limit, default). The rest of
+	 * a larger reply is skipped and the waiting operation fails with FTP_EREPLYTOOLARGE.
+	 * STAT listings (control_connection_listing) that are too large are fetched over a
+	 * data connection instead. Queued connections inherit this setting. */
+	size_t max_reply_size;
+
+	/* Write listings larger than max_listing_size to a temporary file and parse them
+	 * from there instead of failing (default: ftp_bfalse). Only the parsed entries are
+	 * kept in memory then. Queued connections inherit this setting. */
+	ftp_bool listing_spill;
+
 
 	/* Internal */
 	int _port;
@@ -102,6 +181,7 @@ typedef struct _ftp_connection {
 	struct ftp_features __features;
 	struct ftp_features * _current_features;
 	int _last_answer_lock_signal;
+	int _multiline_signal;
 	void * _last_answer_buffer;
 	char *_host;
 	char * _dataBuf;
@@ -109,12 +189,24 @@ typedef struct _ftp_connection {
 	pthread_t _input_thread;
 	int _input_trigger_signals[FTP_TRIGGER_MAX];
 	struct timeval _wait_start;
+	struct timeval _last_command;
+	int _pending_noops;
+	int _transfer_state;
+	ftp_bool _reply_too_large;
+	void *_listing_cache;
+	void *_found_item;
+	void *_dir_cache;
+	unsigned int _directory_generation;
+	unsigned int _mlst_facts;
+	int _reserved_connections;
 	char *_mc_user, *_mc_pass;
 	struct _ftp_connection *_parent, *_child;
 	ftp_transfer_type _transfer_type;
+	ftp_security _security;
 	ftp_bool _internal_error_signal:1;
 	ftp_bool _mc_enabled:1;
 	ftp_bool _temporary:1;
+	ftp_bool _cur_directory_stale:1;
 	ftp_bool _termination_signal:1;
 	ftp_bool _release_input_thread:1;
 	ftp_bool _disable_input_thread:1;
@@ -127,18 +219,6 @@ typedef struct _ftp_connection {
 #endif
 } ftp_connection;
 
-typedef enum {
-	/* Do not establish secure connection. */
-	ftp_security_none
-#ifdef FTP_TLS_ENABLED
-	/* A secure TLS connection will be established if the server supports it. */
-	,ftp_security_auto,
-	/* Always establish a TLS connection. If the server does not support TLS,
-	 * the connection will fail. */
-	ftp_security_always
-#endif
-} ftp_security;
-
 /*
  * When working with files, always check *(file->error) instead of the error variable in
  * the connection, as ftp_fopen may automatically establish new connections as needed.
@@ -151,8 +231,13 @@ typedef struct {
 
 	ftp_bool eof;
 	int *error;
+
+	/* Internal */
+	char *_path;
 } ftp_file;
 
+/* A date in UTC (month 1-12). Dates of LIST entries are in the unknown time zone of
+ * the server and are taken as UTC. */
 typedef struct {
 	unsigned int year, month, day, hour, minute, second;
 } ftp_date;
@@ -171,14 +256,26 @@ typedef struct {
 		ftp_bool unixmode:1;
 	} given;
 
-	unsigned long size;
+	ftp_offset size;
 	ftp_date modify;
 	ftp_date create;
+	/* modify and create in seconds since 1970-01-01 00:00:00 UTC. */
+	int64_t modify_time;
+	int64_t create_time;
 	ftp_file_type type;
 	unsigned int unixgroup;
 	unsigned int unixmode;
 } ftp_file_facts;
 
+typedef struct {
+	/* Number of connections, including queued connections. */
+	unsigned int connections;
+	/* Number of connections that are neither waiting nor transferring data. */
+	unsigned int idle_connections;
+	/* Estimated memory held by an idle connection (average over all idle connections). */
+	size_t bytes_per_idle_connection;
+} ftp_connection_stats;
+
 typedef struct _ftpcontentlisting {
 	char *filename;
 	ftp_file_facts facts;
@@ -186,6 +283,132 @@ typedef struct _ftpcontentlisting {
 	struct _ftpcontentlisting *next;
 } ftp_content_listing;
 
+typedef struct {
+	/* Entries stored contiguously; next is always NULL. */
+	ftp_content_listing *entries;
+	size_t count;
+	/* All file names, one after another. The filename of every entry points in here. */
+	char *names;
+
+	size_t _capacity, _names_length, _names_size;
+	unsigned int *_index;
+	size_t _index_size;
+} ftp_content_array;
+
+typedef struct {
+	/* File names in listing order. */
+	char **names;
+	size_t count;
+	/* All names, one after another. Every pointer in names points in here. */
+	char *arena;
+
+	size_t _capacity, _arena_length, _arena_size;
+} ftp_name_array;
+
+/* Called by ftp_list_each for every entry. Return ftp_bfalse to stop the listing. */
+typedef ftp_bool (*ftp_list_callback)(ftp_content_listing *, void *);
+
+/* Types for ftp_listing_filter.types: */
+#define FTP_MATCH_FILE       (1 << ft_file)
+#define FTP_MATCH_DIR        (1 << ft_dir)
+#define FTP_MATCH_OTHER      (1 << ft_other)
+
+/* Conditions for ftp_contents_of_directory_matching. An entry has to meet all of them.
+ * Entries whose listing lacks a fact that a condition needs do not match. */
+typedef struct {
+	/* Shell wildcard pattern for the file name (see fnmatch), NULL for any name. */
+	const char *name;
+
+	/* FTP_MATCH_* values (0 = any type). */
+	unsigned int types;
+
+	/* Size range in bytes, inclusive (max_size 0 = no upper bound). */
+	ftp_offset min_size, max_size;
+
+	/* Modification time range in seconds since 1970-01-01 00:00:00 UTC, inclusive
+	 * (0 = no bound). */
+	int64_t modified_min, modified_max;
+
+	/* Called for entries that meet all other conditions (optional). Return ftp_bfalse
+	 * to drop the entry. The entry is only valid during the call. Large listings are
+	 * parsed on several threads, so match can be called on several threads at once. */
+	ftp_list_callback match;
+	void *context;
+
+	/* Also send name as argument of LIST, so the server only sends matching entries
+	 * (false by default). Only used if the server does not support MLSD and name
+	 * contains neither '/' nor spaces. Not every server supports wildcards, and some
+	 * list the contents of matching directories, so only enable this for servers
+	 * known to handle it. */
+	ftp_bool send_pattern;
+} ftp_listing_filter;
+
+typedef enum {
+	ftp_change_added, ftp_change_removed, ftp_change_modified
+} ftp_change_type;
+
+/* Called by ftp_watcher_poll for every change: callback(directory, change, entry, context)
+ * entry is the new entry (the old one for ftp_change_removed) and only valid during the call. */
+typedef void (*ftp_watch_callback)(const char *, ftp_change_type, ftp_content_listing *, void *);
+
+/* Called by ftp_walk for every entry below the root: callback(directory, entry, context)
+ * entry is only valid during the call. Return ftp_bfalse to stop the walk. */
+typedef ftp_bool (*ftp_walk_callback)(const char *, ftp_content_listing *, void *);
+
+typedef struct {
+	/* Number of directory levels to list, 1 lists only the root (0 = unlimited, default). */
+	unsigned int max_depth;
+
+	/* Number of connections that list at the same time (4 by default). Queued
+	 * connections are established as needed. */
+	unsigned int max_connections;
+
+	/* Called with the path of every directory before it is listed (optional).
+	 * Return ftp_btrue to skip the directory and everything below it. */
+	ftp_bool (*prune)(const char *, void *);
+
+	/* Passed to the callback and to prune. */
+	void *context;
+} ftp_walk_options;
+
+typedef struct {
+	/* Bounds of the poll interval of a directory in seconds (5 and 300 by default).
+	 * A directory is polled again after min_interval when it changed, otherwise
+	 * its interval is doubled up to max_interval. */
+	unsigned long min_interval, max_interval;
+
+	/* Number of connections that poll at the same time (4 by default). Queued
+	 * connections are established as needed and held open until the watcher is freed. */
+	unsigned int max_connections;
+
+	/* Internal */
+	ftp_connection *_c;
+	ftp_watch_callback _callback;
+	void *_context;
+	void *_directories;
+	int _reserved;
+} ftp_watcher;
+
+/* A listing snapshot file mapped into memory (see ftp_snapshot_open). */
+typedef struct {
+	/* Number of entries. */
+	size_t count;
+
+	/* Internal */
+	const void *_map;
+	size_t _map_size;
+} ftp_snapshot;
+
+/* A local index of the entries below remote directories (see ftp_index_update). */
+typedef struct {
+	/* Number of entries. */
+	size_t count;
+
+	/* Internal */
+	const void *_map;
+	size_t _map_size;
+} ftp_index;
+
 /*
  * This contains error information only if ftp_open fails. Otherwise, the information
  * will be located in ftp_connection->error or *(ftp_file->error).
@@ -222,6 +445,64 @@ ftp_content_listing *ftp_contents_of_directory(ftp_connection *, int *);
 /* Free content listing: */
 void ftp_free(ftp_content_listing *);
 
+/* Get the contents of current directory that match filter:
+ *     ftp_contents_of_directory_matching(ftpConnection, filter, &items_count)
+ * Entries are checked while the listing is parsed, so entries that do not match are
+ * never allocated. A cached listing (see listing_cache_ttl) is used and filtered, but
+ * a filtered listing is not stored in the cache. */
+ftp_content_listing *ftp_contents_of_directory_matching(ftp_connection *, const ftp_listing_filter *, int *);
+
+/* Drop all cached directory listings: ftp_flush_listing_cache(ftpConnection)
+ * See listing_cache_ttl. ftp_list_each always asks the server. */
+void ftp_flush_listing_cache(ftp_connection *);
+
+/* Iterate over the contents of current directory: ftp_list_each(ftpConnection, callback, context)
+ * Entries are parsed while the listing is received and passed to callback(entry, context)
+ * one at a time, so memory does not grow with the size of the directory. The entry and
+ * its filename are only valid during the callback. */
+ftp_status ftp_list_each(ftp_connection *, ftp_list_callback, void *);
+
+/* Get contents of current directory as an array: ftp_contents_of_directory_array(ftpConnection)
+ * Uses three allocations regardless of the directory size. Free it with ftp_free_array. */
+ftp_content_array *ftp_contents_of_directory_array(ftp_connection *);
+
+/* Get the names of the files in the current directory: ftp_names_of_directory(ftpConnection)
+ * Uses NLST, so the server does not need to look up any file facts and sends much less
+ * than for ftp_contents_of_directory. Directories and files cannot be told apart.
+ * Free it with ftp_free_name_array. */
+ftp_name_array *ftp_names_of_directory(ftp_connection *);
+
+/* Free name array: */
+void ftp_free_name_array(ftp_name_array *);
+
+/* Get contents of a whole directory tree as an array: ftp_contents_of_tree(ftpConnection, path)
+ * path is relative to the current directory (NULL for the current directory itself). The
+ * file names are paths relative to it, e.g. "dir/subdir/file". Uses a single LIST -R if
+ * the server supports it, otherwise every directory is listed on its own (see ftp_walk). */
+ftp_content_array *ftp_contents_of_tree(ftp_connection *, const char *);
+/* Free content array: */
+void ftp_free_array(ftp_content_array *);
+
+/* Convert between content listing and content array:
+ *     ftp_content_array_from_listing(ftpContentListing)
+ *     ftp_content_array_to_listing(ftpContentArray)
+ * The source is not freed. */
+ftp_content_array *ftp_content_array_from_listing(ftp_content_listing *);
+ftp_content_listing *ftp_content_array_to_listing(ftp_content_array *);
+
+/* Check whether item exists in content array:
+ * ftp_item_exists_in_content_array(ftpContentArray, filename, &item) */
+ftp_bool ftp_item_exists_in_content_array(ftp_content_array *, const char *, ftp_content_listing **);
+/* The first call builds a hash index over the file names, so every lookup takes
+ * constant time. */
+
+/* Sort content array by file name: ftp_content_array_sort(ftpContentArray) */
+void ftp_content_array_sort(ftp_content_array *);
+
+/* Remove entries from content array: ftp_content_array_filter(ftpContentArray, keep, context)
+ * Entries for which keep(entry, context) returns ftp_bfalse are removed. */
+void ftp_content_array_filter(ftp_content_array *, ftp_list_callback, void *);
+
 /* Check whether item exists in content listing:
  * ftp_item_exists_in_content_listing(ftpContentListing, filename, &item) */
 ftp_bool ftp_item_exists_in_content_listing(ftp_content_listing *, char *, ftp_content_listing **);
@@ -229,15 +510,26 @@ ftp_bool ftp_item_exists_in_content_listing(ftp_content_listing *, char *, ftp_c
 
 /* Check whether item exists at current path:
  * ftp_item_exists(ftpConnection, filename, &item) */
-#define ftp_item_exists(conn,filenm,item) ftp_item_exists_in_content_listing(ftp_contents_of_directory(conn,NULL),filenm,item)
-/* item will be set to a content listing entry matching filename.
+ftp_bool ftp_item_exists(ftp_connection *, char *, ftp_content_listing **);
+/* item will be set to a content listing entry matching filename. It is owned by the
+ * connection and valid until the next call or until the directory is changed.
+ * Uses MLST if the server supports it; otherwise the listing of the current directory
+ * is fetched once and reused until something is changed through this connection.
  * Check connection->error after using this function. */
 
 /* Get size in bytes of remote file: ftp_size(ftpConnection, filename, &size) */
-ftp_status ftp_size(ftp_connection *, char *, size_t *);
+ftp_status ftp_size(ftp_connection *, char *, ftp_offset *);
+
+/* Get modification date of remote file: ftp_modification_date(ftpConnection, filename, &date) */
+ftp_status ftp_modification_date(ftp_connection *, char *, ftp_date *);
+
+/* Get facts of a single remote file or folder: ftp_stat(ftpConnection, filename, &facts)
+ * Uses MLST, or SIZE and MDTM if the server does not support it. No data connection
+ * is needed. Check facts.given for the facts the server provided. */
+ftp_status ftp_stat(ftp_connection *, char *, ftp_file_facts *);
 
 /* Opens a read/write stream to a file on the server: ftp_fopen(ftpConnection, filename, activity, startpos) */
-ftp_file *ftp_fopen(ftp_connection *, char *, ftp_activity, unsigned long);
+ftp_file *ftp_fopen(ftp_connection *, char *, ftp_activity, ftp_offset);
 /* activity can be FTP_READ or FTP_WRITE.
  * Set startpos to FTP_APPEND to append the data to the remote file (write mode).
  * Keep in mind that many servers do not support values for startpos other than 0 when in write mode. */
@@ -278,6 +570,86 @@ ftp_status ftp_create_folder(ftp_connection *, char *);
 /* Send a NOOP command to the server: ftp_noop(ftpConnection, wait_for_response) */
 ftp_status ftp_noop(ftp_connection *, ftp_bool);
 
+/* Keep the control connections of a connection and its queued connections alive: ftp_keepalive(ftpConnection)
+ * Sends NOOP on every connection whose last command is older than keepalive_interval. */
+ftp_status ftp_keepalive(ftp_connection *);
+
+/* Get statistics about a connection and its queued connections: ftp_stats(ftpConnection, &stats) */
+ftp_status ftp_stats(ftp_connection *, ftp_connection_stats *);
+
+/* Walk a remote directory tree: ftp_walk(ftpConnection, root, callback, options)
+ * Directories are listed by path (no CWD) on several connections at once, level by level;
+ * the entries of a directory are passed to the callback in listing order. options may be
+ * NULL. Directories that could not be listed are skipped and make this return FTP_ERROR
+ * (error in the connection). Not thread safe with other operations on the connection. */
+ftp_status ftp_walk(ftp_connection *, const char *, ftp_walk_callback, ftp_walk_options *);
+
+/* Create a watcher for remote directories: ftp_watcher_new(ftpConnection, callback, context) */
+ftp_watcher *ftp_watcher_new(ftp_connection *, ftp_watch_callback, void *);
+/* Free a watcher and close the queued connections it held open: ftp_watcher_free(watcher) */
+void ftp_watcher_free(ftp_watcher *);
+
+/* Watch a directory: ftp_watch(watcher, path)
+ * Relative paths are relative to the current directory of the connection. */
+ftp_status ftp_watch(ftp_watcher *, const char *);
+/* Stop watching a directory: ftp_unwatch(watcher, path) */
+ftp_status ftp_unwatch(ftp_watcher *, const char *);
+
+/* Poll all directories that are due: ftp_watcher_poll(watcher, &seconds_until_next_poll)
+ * Changes since the previous poll of a directory are passed to the callback; the first
+ * poll of a directory only records its contents. Directories that could not be listed
+ * are retried after min_interval and make this return FTP_ERROR (error in the connection).
+ * Not thread safe with other operations on the connection. */
+ftp_status ftp_watcher_poll(ftp_watcher *, unsigned long *);
+
+/* Save a listing to a snapshot file: ftp_snapshot_write(ftpContentListing, path)
+ *     ftp_snapshot_write_array(ftpContentArray, path)
+ * The entries are stored sorted by name. An existing file is replaced only after the new
+ * one was written completely. On FTP_ERROR, errno is set. */
+ftp_status ftp_snapshot_write(ftp_content_listing *, const char *);
+ftp_status ftp_snapshot_write_array(ftp_content_array *, const char *);
+
+/* Open a snapshot file: ftp_snapshot_open(path)
+ * The file is mapped, not read; entries are decoded when they are accessed. Returns NULL
+ * and sets errno on failure (EINVAL if the file is not a snapshot of this version and
+ * byte order). */
+ftp_snapshot *ftp_snapshot_open(const char *);
+/* Close a snapshot: ftp_snapshot_close(snapshot) */
+void ftp_snapshot_close(ftp_snapshot *);
+
+/* Get an entry of a snapshot: ftp_snapshot_entry(snapshot, index, &entry)
+ * Entries are sorted by name (strcmp). entry->filename points into the mapped file and
+ * is valid until the snapshot is closed; entry->next is NULL. Returns ftp_bfalse if the
+ * index is out of range or the entry is damaged. */
+ftp_bool ftp_snapshot_entry(ftp_snapshot *, size_t, ftp_content_listing *);
+/* Look up an entry by name: ftp_snapshot_find(snapshot, filename, &entry)
+ * entry may be NULL. */
+ftp_bool ftp_snapshot_find(ftp_snapshot *, const char *, ftp_content_listing *);
+
+/* Update a local index of a remote tree: ftp_index_update(ftpConnection, index_path, root, options)
+ * Walks root with ftp_walk (options may be NULL) and replaces the entries below root in
+ * the index file, which is created if it does not exist. Entries outside root are kept,
+ * as are entries below directories that options->prune skips or that are deeper than
+ * options->max_depth, so a part of a tree can be refreshed by listing only that part.
+ * Paths are stored as ftp_walk forms them, so use absolute roots. If a directory could
+ * not be listed, the index is left unchanged. Errors with the index file are reported
+ * as FTP_ELOCALFILE (errno is set). */
+ftp_status ftp_index_update(ftp_connection *, const char *, const char *, ftp_walk_options *);
+
+/* Open an index file: ftp_index_open(path)
+ * The file is mapped and stays valid if it is updated meanwhile. Returns NULL and sets
+ * errno on failure (EINVAL if the file is not an index of this version and byte order). */
+ftp_index *ftp_index_open(const char *);
+/* Close an index: ftp_index_close(index) */
+void ftp_index_close(ftp_index *);
+
+/* Query an index: ftp_index_query(index, directory, filter, callback, context)
+ * Calls callback(directory, entry, context) for every entry below directory (NULL for
+ * all entries) that matches filter (NULL for any entry; send_pattern is ignored), in
+ * order of their paths. No server is contacted. Returns FTP_ERROR and sets errno if the
+ * index is damaged. */
+ftp_status ftp_index_query(ftp_index *, const char *, const ftp_listing_filter *, ftp_walk_callback, void *);
+
 
 FTP_I_END_DECLS
 
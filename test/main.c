@@ -34,6 +34,25 @@ void libmftp_tls_test(char *host, unsigned int port, char *user, char *pw, char
 
 int tls = 0;
 
+ftp_bool count_test_file(ftp_content_listing *entry, void *count)
+{
+	if (strcmp(entry->filename, "testfile.test") == 0)
+		(*(int*)count)++;
+	return ftp_btrue;
+}
+
+void count_added_files(const char *directory, ftp_change_type change, ftp_content_listing *entry, void *count)
+{
+	if (change == ftp_change_added)
+		(*(int*)count)++;
+}
+
+ftp_bool count_walked_entries(const char *directory, ftp_content_listing *entry, void *count)
+{
+	(*(int*)count)++;
+	return ftp_btrue;
+}
+
 int main (int argc, const char * argv[])
 {
 	char user[100], pw[100], workingdir[500], host[500];
@@ -66,6 +85,7 @@ void libmftp_main_test(char *host, unsigned int port, char *user, char *pw, char
 	ftp_file *f = NULL, *g = NULL;
 	ftp_content_listing *cl = NULL, *cl2 = NULL;
 	ftp_date d;
+	ftp_watcher *w = NULL;
 	char *buf = NULL;
 	ftp_connection *c = ftp_open(host, port, tls == 0 ? ftp_security_none : ftp_security_always);
 
@@ -161,16 +181,152 @@ void libmftp_main_test(char *host, unsigned int port, char *user, char *pw, char
 		}
 	}
 
+	//TEST SNAPSHOT
+
+	if (ftp_snapshot_write(cl, "libmftp_test.snap") != FTP_OK) {
+		printf("Could not write snapshot.\n");
+		goto end;
+	}
+
+	ftp_snapshot *snap = ftp_snapshot_open("libmftp_test.snap");
+	remove("libmftp_test.snap");
+	if (!snap) {
+		printf("Could not open snapshot.\n");
+		goto end;
+	}
+
+	ftp_content_listing snap_entry;
+	int snap_ok = snap->count == 1 && ftp_snapshot_find(snap, "testfile.test", &snap_entry) &&
+		snap_entry.facts.modify_time == cl2->facts.modify_time;
+	ftp_snapshot_close(snap);
+	if (!snap_ok) {
+		printf("Snapshot does not match content listing.\n");
+		goto end;
+	}
+
+	//TEST STREAMING CONTENT LISTING
+
+	int stream_count = 0;
+	if (ftp_list_each(c, count_test_file, &stream_count) != FTP_OK) {
+		printf("Could not iterate over content listing. Error: %i\n", c->error);
+		goto end;
+	}
+
+	if (stream_count != 1) {
+		printf("Could not find previously generated file while iterating over content listing.\n");
+		goto end;
+	}
+
+	//TEST CONTENT ARRAY
+
+	ftp_content_array *ca = ftp_contents_of_directory_array(c);
+	if (!ca) {
+		printf("Could not get content array. Error: %i\n", c->error);
+		goto end;
+	}
+
+	int array_ok = ca->count == 1 && strcmp(ca->entries[0].filename, "testfile.test") == 0;
+	ftp_free_array(ca);
+	if (!array_ok) {
+		printf("Content array does not match content listing.\n");
+		goto end;
+	}
+
+	//TEST NAMES
+
+	ftp_name_array *na = ftp_names_of_directory(c);
+	if (!na) {
+		printf("Could not get names of directory. Error: %i\n", c->error);
+		goto end;
+	}
+
+	int names_ok = na->count == 1 && strcmp(na->names[0], "testfile.test") == 0;
+	ftp_free_name_array(na);
+	if (!names_ok) {
+		printf("Names of directory do not match content listing.\n");
+		goto end;
+	}
+
+	//TEST CONTROL CONNECTION LISTING
+
+	c->control_connection_listing = ftp_btrue;
+	ca = ftp_contents_of_directory_array(c);
+	c->control_connection_listing = ftp_bfalse;
+	if (!ca) {
+		printf("Could not get content array over control connection. Error: %i\n", c->error);
+		goto end;
+	}
+
+	int control_ok = ca->count == 1 && strcmp(ca->entries[0].filename, "testfile.test") == 0;
+	ftp_free_array(ca);
+	if (!control_ok) {
+		printf("Content array over control connection does not match content listing.\n");
+		goto end;
+	}
+
+	//TEST LISTING LIMIT
+
+	c->max_listing_size = 16;
+	ftp_content_listing *limited = ftp_contents_of_directory(c, NULL);
+	int limit_error = c->error;
+	c->listing_spill = ftp_btrue;
+	ftp_content_listing *spilled = ftp_contents_of_directory(c, &entry_count);
+	c->listing_spill = ftp_bfalse;
+	c->max_listing_size = 0;
+	int limit_ok = !limited && limit_error == FTP_ELISTINGTOOLARGE &&
+		spilled && entry_count == 1 && strcmp(spilled->filename, "testfile.test") == 0;
+	ftp_free(limited);
+	ftp_free(spilled);
+	if (!limit_ok) {
+		printf("Listing size limit does not work. Error: %i\n", limit_error);
+		goto end;
+	}
+
+	//TEST FILTERED CONTENT LISTING
+
+	ftp_listing_filter lf;
+	memset(&lf, 0, sizeof(lf));
+	lf.name = "*.test";
+	lf.types = FTP_MATCH_FILE;
+	ftp_content_listing *fl = ftp_contents_of_directory_matching(c, &lf, &entry_count);
+	int filter_ok = fl && entry_count == 1;
+	ftp_free(fl);
+	if (!filter_ok) {
+		printf("Filtered content listing does not match. Error: %i\n", c->error);
+		goto end;
+	}
+
+	lf.name = "*.missing";
+	fl = ftp_contents_of_directory_matching(c, &lf, &entry_count);
+	if (fl || c->error != 0) {
+		ftp_free(fl);
+		printf("Filtered content listing should be empty. Error: %i\n", c->error);
+		goto end;
+	}
+
 	//TEST SIZE
 
-	size_t srv_size;
+	ftp_offset srv_size;
 	if (ftp_size(c, "testfile.test", &srv_size) != FTP_OK) {
 		printf("Could not get file size. Error: %i\n", c->error);
 		goto end;
 	}
 
 	if (srv_size != test_len) {
-		printf("Remote file size (%lu) differs from local file size (%lu).\n",srv_size,test_len);
+		printf("Remote file size (%lu) differs from local file size (%lu).\n",(unsigned long)srv_size,(unsigned long)test_len);
+		goto end;
+	}
+
+	//TEST STAT
+
+	ftp_file_facts facts;
+	if (ftp_stat(c, "testfile.test", &facts) != FTP_OK) {
+		printf("Could not get file facts. Error: %i\n", c->error);
+		goto end;
+	}
+
+	if (!facts.given.size || facts.size != test_len) {
+		printf("Remote file size from facts differs from local file size.\n");
 		goto end;
 	}
 
@@ -198,6 +354,17 @@ void libmftp_main_test(char *host, unsigned int port, char *user, char *pw, char
 		goto end;
 	}
 
+	//TEST WATCHER 1
+
+	int added_count = 0;
+	w = ftp_watcher_new(c, count_added_files, &added_count);
+	if (w)
+		w->min_interval = w->max_interval = 0;
+	if (!w || ftp_watch(w, workingdirectory) != FTP_OK || ftp_watcher_poll(w, NULL) != FTP_OK) {
+		printf("Could not watch working directory. Error: %i\n", c->error);
+		goto end;
+	}
+
 	//TEST UPLOAD 2 (SIMULTANEOUS)
 
 	f = ftp_fopen(c, "testfile1.txt", FTP_WRITE, 0);
@@ -222,9 +389,16 @@ void libmftp_main_test(char *host, unsigned int port, char *user, char *pw, char
 	ftp_fclose(g);
 	f = g = NULL;
 
+	//TEST WATCHER 2
+
+	if (ftp_watcher_poll(w, NULL) != FTP_OK || added_count != 2) {
+		printf("Watcher did not report the uploaded files (%i). Error: %i\n", added_count, c->error);
+		goto end;
+	}
+
 	//TEST SIZE 2
 
-	size_t srv_size2;
+	ftp_offset srv_size2;
 	if (ftp_size(c, "testfile1.txt", &srv_size) != FTP_OK) {
 		printf("Could not get file size 2 (1). Error: %i\n", c->error);
 		goto end;
@@ -238,6 +412,53 @@ void libmftp_main_test(char *host, unsigned int port, char *user, char *pw, char
 		goto end;
 	}
 
+	//TEST LISTING CACHE
+
+	/* The following tests check that the cached listing is dropped when files change. */
+	c->listing_cache_ttl = 60;
+	for (int i = 0; i < 2; i++) {
+		ftp_content_listing *cached = ftp_contents_of_directory(c, &entry_count);
+		ftp_free(cached);
+		if (entry_count != 3) {
+			printf("Unexpected number of entries in (cached) content listing: %i\n", entry_count);
+			goto end;
+		}
+	}
+
+	/* The array is served from the listing cached above and has to be filtered alike. */
+	ca = ftp_contents_of_directory_array(c);
+	int cache_ok = ca && ca->count == 3;
+	ftp_free_array(ca);
+	if (!cache_ok) {
+		printf("Unexpected number of entries in cached content array.\n");
+		goto end;
+	}
+
+	f = ftp_fopen(c, "testfile3.txt", FTP_WRITE, 0);
+	if (!f) {
+		printf("Could not fopen to write 3. Error: %i\n", c->error);
+		goto end;
+	}
+	ftp_fclose(f);
+	f = NULL;
+
+	ftp_free(ftp_contents_of_directory(c, &entry_count));
+	if (entry_count != 4) {
+		printf("Cached content listing was not dropped after an upload: %i\n", entry_count);
+		goto end;
+	}
+
+	if (ftp_delete(c, "testfile3.txt", ftp_bfalse) != FTP_OK) {
+		printf("Could not delete file 3. Error: %i\n", c->error);
+		goto end;
+	}
+
+	ftp_free(ftp_contents_of_directory(c, &entry_count));
+	if (entry_count != 3) {
+		printf("Cached content listing was not dropped after a delete: %i\n", entry_count);
+		goto end;
+	}
+
 	//TEST FOLDERS
 
 	if (ftp_create_folder(c, "testfolder") != FTP_OK) {
@@ -250,6 +471,43 @@ void libmftp_main_test(char *host, unsigned int port, char *user, char *pw, char
 		goto end;
 	}
 
+	//TEST WALK
+
+	int walked_count = 0;
+	ftp_walk_options walk_options = {0, 2, NULL, &walked_count};
+	if (ftp_walk(c, workingdirectory, count_walked_entries, &walk_options) != FTP_OK || walked_count != 4) {
+		printf("Unexpected number of entries in walked tree (%i). Error: %i\n", walked_count, c->error);
+		goto end;
+	}
+
+	//TEST INDEX
+
+	remove("libmftp_test.index");
+	if (ftp_index_update(c, "libmftp_test.index", workingdirectory, &walk_options) != FTP_OK) {
+		printf("Could not update index. Error: %i\n", c->error);
+		goto end;
+	}
+
+	ftp_index *index = ftp_index_open("libmftp_test.index");
+	remove("libmftp_test.index");
+	walked_count = 0;
+	if (!index || ftp_index_query(index, workingdirectory, NULL, count_walked_entries, &walked_count) != FTP_OK || walked_count != 4) {
+		ftp_index_close(index);
+		printf("Unexpected number of entries in index (%i).\n", walked_count);
+		goto end;
+	}
+	ftp_index_close(index);
+
+	//TEST TREE
+
+	ftp_content_array *tree = ftp_contents_of_tree(c, NULL);
+	if (!tree || !ftp_item_exists_in_content_array(tree, "testfolder/testfile1.txt", NULL) || tree->count != 4) {
+		printf("Unexpected recursive content listing. Error: %i\n", c->error);
+		ftp_free_array(tree);
+		goto end;
+	}
+	ftp_free_array(tree);
+
 	if (ftp_change_cur_directory(c, "testfolder") != FTP_OK) {
 		printf("Could not cwd 2. Error: %i\n", c->error);
 		goto end;
@@ -297,6 +555,7 @@ end:
 	if (cl) ftp_free(cl);
 	if (f) ftp_fclose(f);
 	if (g) ftp_fclose(g);
+	if (w) ftp_watcher_free(w);
 	if (c) ftp_close(c);
 	if (buf) free(buf);
 	if (!success) {